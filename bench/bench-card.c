@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "cad-card.h"
+
+#include <glib.h>
+#include <pulse/pulseaudio.h>
+
+#include <stdlib.h>
+
+/*
+ * Time card and port selection on cards with many ports and profiles. The
+ * ports we look for come last and our own view of availability covers half
+ * of them, so every lookup goes through the whole card.
+ */
+
+#define DEFAULT_ITERATIONS 10000
+
+static const guint card_sizes[] = { 4, 16, 64, 256 };
+
+typedef struct {
+    GPtrArray *names;
+    pa_card_profile_info2 *profiles;
+    pa_card_profile_info2 **profile_ptrs;
+    pa_card_port_info *card_ports;
+    pa_card_port_info **card_port_ptrs;
+    pa_sink_port_info *sink_ports;
+    pa_sink_port_info **sink_port_ptrs;
+    GHashTable *overrides;
+    pa_card_info card;
+    pa_sink_info sink;
+} BenchCard;
+
+static const gchar *add_name(BenchCard *bench, gchar *name)
+{
+    g_ptr_array_add(bench->names, name);
+
+    return name;
+}
+
+static void bench_card_init(BenchCard *bench, guint n, gboolean ucm)
+{
+    guint i;
+
+    bench->names = g_ptr_array_new_with_free_func(g_free);
+    bench->profiles = g_new0(pa_card_profile_info2, n);
+    bench->profile_ptrs = g_new0(pa_card_profile_info2 *, n);
+    bench->card_ports = g_new0(pa_card_port_info, n);
+    bench->card_port_ptrs = g_new0(pa_card_port_info *, n);
+    bench->sink_ports = g_new0(pa_sink_port_info, n);
+    bench->sink_port_ptrs = g_new0(pa_sink_port_info *, n);
+    bench->overrides = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    for (i = 0; i < n; i++) {
+        const gchar *name;
+
+        /* Only the last profile tells UCM cards apart */
+        if (ucm && i == n - 1)
+            name = add_name(bench, g_strdup("HiFi"));
+        else
+            name = add_name(bench, g_strdup_printf("profile-%u", i));
+        bench->profiles[i].name = name;
+        bench->profile_ptrs[i] = &bench->profiles[i];
+
+        if (i == n - 2)
+            name = add_name(bench, g_strdup(ucm ? "[Out] Earpiece" : "earpiece"));
+        else if (i == n - 1)
+            name = add_name(bench, g_strdup(ucm ? "[Out] Speaker" : "speaker"));
+        else
+            name = add_name(bench, g_strdup_printf("analog-output-%u", i));
+
+        bench->card_ports[i].name = name;
+        bench->card_port_ptrs[i] = &bench->card_ports[i];
+        bench->sink_ports[i].name = name;
+        bench->sink_ports[i].priority = i;
+        bench->sink_ports[i].available = PA_PORT_AVAILABLE_UNKNOWN;
+        bench->sink_port_ptrs[i] = &bench->sink_ports[i];
+
+        if (i % 2)
+            g_hash_table_insert(bench->overrides, g_strdup(name),
+                                GINT_TO_POINTER(PA_PORT_AVAILABLE_YES));
+    }
+
+    bench->card.name = "bench";
+    bench->card.proplist = pa_proplist_new();
+    pa_proplist_sets(bench->card.proplist, PA_PROP_DEVICE_BUS_PATH, "platform-sound");
+    pa_proplist_sets(bench->card.proplist, PA_PROP_DEVICE_FORM_FACTOR, "internal");
+    bench->card.n_profiles = n;
+    bench->card.profiles2 = bench->profile_ptrs;
+    bench->card.n_ports = n;
+    bench->card.ports = bench->card_port_ptrs;
+
+    bench->sink.name = "bench";
+    bench->sink.n_ports = n;
+    bench->sink.ports = bench->sink_port_ptrs;
+}
+
+static void bench_card_clear(BenchCard *bench)
+{
+    pa_proplist_free(bench->card.proplist);
+    g_hash_table_destroy(bench->overrides);
+    g_free(bench->sink_port_ptrs);
+    g_free(bench->sink_ports);
+    g_free(bench->card_port_ptrs);
+    g_free(bench->card_ports);
+    g_free(bench->profile_ptrs);
+    g_free(bench->profiles);
+    g_ptr_array_free(bench->names, TRUE);
+}
+
+static gdouble elapsed_ns(gint64 start, guint iterations)
+{
+    return (gdouble) (g_get_monotonic_time() - start) * 1000 / iterations;
+}
+
+static void run(guint n, gboolean ucm, guint iterations)
+{
+    BenchCard bench = { 0 };
+    const CadCardStrategy *strategy = NULL;
+    const gchar *speaker = NULL;
+    const gchar *port = NULL;
+    gdouble strategy_ns, sink_ns, output_ns;
+    gint64 start;
+    guint i;
+
+    bench_card_init(&bench, n, ucm);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < iterations; i++) {
+        strategy = cad_card_get_strategy(&bench.card);
+        if (!cad_card_is_suitable(strategy, &bench.card))
+            g_error("card with %u ports isn't suitable", n);
+    }
+    strategy_ns = elapsed_ns(start, iterations);
+
+    speaker = bench.sink.ports[n - 1]->name;
+
+    /* What entering a call does: anything but the speaker */
+    start = g_get_monotonic_time();
+    for (i = 0; i < iterations; i++)
+        port = cad_card_find_sink_port(strategy, &bench.sink, bench.overrides, speaker);
+    sink_ns = elapsed_ns(start, iterations);
+    if (!port)
+        g_error("no sink port found on card with %u ports", n);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < iterations; i++)
+        port = cad_card_find_output_port(&bench.sink, bench.overrides,
+                                         CAD_OUTPUT_EARPIECE, NULL);
+    output_ns = elapsed_ns(start, iterations);
+    if (!port)
+        g_error("no earpiece found on card with %u ports", n);
+
+    g_print("%-8s %6u %14.1f %14.1f %14.1f\n", strategy->name, n,
+            strategy_ns, sink_ns, output_ns);
+
+    bench_card_clear(&bench);
+}
+
+int main(int argc, char **argv)
+{
+    guint iterations = DEFAULT_ITERATIONS;
+    guint i;
+
+    if (argc > 1)
+        iterations = MAX(strtoul(argv[1], NULL, 10), 1);
+
+    g_print("%-8s %6s %14s %14s %14s\n", "strategy", "ports",
+            "card (ns)", "sink port (ns)", "output (ns)");
+
+    for (i = 0; i < G_N_ELEMENTS(card_sizes); i++) {
+        run(card_sizes[i], FALSE, iterations);
+        run(card_sizes[i], TRUE, iterations);
+    }
+
+    return 0;
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "cad-card.h"
+
+#include <glib.h>
+#include <pulse/pulseaudio.h>
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * libFuzzer target for card and port selection: build a card, its sink and
+ * source out of the input, with our own view of port availability on top,
+ * then check every port we'd pick is one we're allowed to use.
+ */
+
+#define MAX_PROFILES 16
+#define MAX_PORTS    32
+#define MAX_NAME     32
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+} FuzzInput;
+
+/* Names the strategies look for, so inputs reach the interesting paths */
+static const gchar * const known_names[] = {
+    "HiFi", "Voice Call", "Voice Call IP", "Speaker", "Earpiece", "Handset",
+    "Headphones", "Headset", "[Out] Speaker", "[Out] Earpiece",
+    "analog-output-speaker", "analog-output-headphones", "handset",
+    "default", "voicecall", "communication", "ringtone",
+    "output-speaker", "output-earpiece", "output-wired_headset",
+    "output-parking", "input-builtin_mic", "input-wired_headset",
+    "input-parking", "droid-hal", "platform-sound", "internal", "usb",
+    "headset-output", "bluetooth", "a2dp-sink",
+};
+
+static guint8 get_byte(FuzzInput *input)
+{
+    guint8 byte;
+
+    if (input->size == 0)
+        return 0;
+
+    byte = *input->data++;
+    input->size--;
+
+    return byte;
+}
+
+/* Either one of the names above, or up to MAX_NAME bytes of the input */
+static gchar *get_name(FuzzInput *input)
+{
+    guint8 byte = get_byte(input);
+    gsize len;
+    gchar *name;
+
+    if (byte & 0x80)
+        return g_strdup(known_names[(byte & 0x7f) % G_N_ELEMENTS(known_names)]);
+
+    len = MIN(byte % (MAX_NAME + 1), input->size);
+    name = g_strndup((const gchar *) input->data, len);
+    input->data += len;
+    input->size -= len;
+
+    return name;
+}
+
+static int get_available(FuzzInput *input)
+{
+    switch (get_byte(input) % 3) {
+    case 0:
+        return PA_PORT_AVAILABLE_UNKNOWN;
+    case 1:
+        return PA_PORT_AVAILABLE_NO;
+    default:
+        return PA_PORT_AVAILABLE_YES;
+    }
+}
+
+static void set_prop(FuzzInput *input, pa_proplist *proplist, const gchar *key)
+{
+    g_autofree gchar *value = NULL;
+
+    if (get_byte(input) & 1)
+        return;
+
+    value = get_name(input);
+    pa_proplist_sets(proplist, key, value);
+}
+
+/* Ports are returned by name, which must be one of the object's own */
+static pa_sink_port_info *get_sink_port(const pa_sink_info *sink, const gchar *name)
+{
+    guint i;
+
+    for (i = 0; i < sink->n_ports; i++) {
+        if (sink->ports[i]->name == name)
+            return sink->ports[i];
+    }
+
+    return NULL;
+}
+
+static pa_source_port_info *get_source_port(const pa_source_info *source, const gchar *name)
+{
+    guint i;
+
+    for (i = 0; i < source->n_ports; i++) {
+        if (source->ports[i]->name == name)
+            return source->ports[i];
+    }
+
+    return NULL;
+}
+
+static void check_sink_port(const CadCardStrategy *strategy, const pa_sink_info *sink,
+                            GHashTable *ports, const gchar *exclude)
+{
+    const gchar *port = cad_card_find_sink_port(strategy, sink, ports, exclude);
+    pa_sink_port_info *info;
+    guint output;
+
+    if (port) {
+        info = get_sink_port(sink, port);
+        g_assert(info != NULL);
+        g_assert(g_strcmp0(port, exclude) != 0);
+        g_assert(cad_card_get_port_available(ports, port, info->available) !=
+                 PA_PORT_AVAILABLE_NO);
+        if (strategy->sink_ports && g_strcmp0(port, strategy->preferred_sink_port) != 0)
+            g_assert(g_strv_contains(strategy->sink_ports, port));
+    }
+
+    for (output = 0; output <= CAD_OUTPUT_UNKNOWN; output++) {
+        port = cad_card_find_output_port(sink, ports, output, exclude);
+        if (!port)
+            continue;
+
+        info = get_sink_port(sink, port);
+        g_assert(info != NULL);
+        g_assert(g_strcmp0(port, exclude) != 0);
+        g_assert(cad_card_get_port_available(ports, port, info->available) !=
+                 PA_PORT_AVAILABLE_NO);
+        g_assert(cad_output_from_port(port) == output);
+    }
+}
+
+static void check_source_port(const CadCardStrategy *strategy, const pa_source_info *source,
+                              GHashTable *ports, const gchar *exclude)
+{
+    const gchar *port = cad_card_find_source_port(strategy, source, ports, exclude);
+    pa_source_port_info *info;
+
+    if (!port)
+        return;
+
+    info = get_source_port(source, port);
+    g_assert(info != NULL);
+    g_assert(g_strcmp0(port, exclude) != 0);
+    g_assert(cad_card_get_port_available(ports, port, info->available) !=
+             PA_PORT_AVAILABLE_NO);
+    if (strategy->source_ports && g_strcmp0(port, strategy->preferred_source_port) != 0)
+        g_assert(g_strv_contains(strategy->source_ports, port));
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    FuzzInput input = { data, size };
+    g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func(g_free);
+    g_autoptr(GHashTable) sink_ports = NULL;
+    g_autoptr(GHashTable) source_ports = NULL;
+    pa_card_profile_info2 profiles[MAX_PROFILES] = { 0 };
+    pa_card_profile_info2 *profile_ptrs[MAX_PROFILES];
+    pa_card_port_info card_ports[MAX_PORTS] = { 0 };
+    pa_card_port_info *card_port_ptrs[MAX_PORTS];
+    pa_sink_port_info sink_port_infos[MAX_PORTS] = { 0 };
+    pa_sink_port_info *sink_port_ptrs[MAX_PORTS];
+    pa_source_port_info source_port_infos[MAX_PORTS] = { 0 };
+    pa_source_port_info *source_port_ptrs[MAX_PORTS];
+    pa_card_info card = { 0 };
+    pa_sink_info sink = { 0 };
+    pa_source_info source = { 0 };
+    const CadCardStrategy *strategy;
+    guint n_overrides;
+    guint i;
+
+    card.name = "fuzz";
+    card.proplist = pa_proplist_new();
+    set_prop(&input, card.proplist, PA_PROP_DEVICE_API);
+    set_prop(&input, card.proplist, PA_PROP_DEVICE_BUS_PATH);
+    set_prop(&input, card.proplist, PA_PROP_DEVICE_FORM_FACTOR);
+
+    card.n_profiles = get_byte(&input) % (MAX_PROFILES + 1);
+    for (i = 0; i < card.n_profiles; i++) {
+        profiles[i].name = get_name(&input);
+        g_ptr_array_add(names, (gpointer) profiles[i].name);
+        profile_ptrs[i] = &profiles[i];
+    }
+    card.profiles2 = profile_ptrs;
+
+    card.n_ports = get_byte(&input) % (MAX_PORTS + 1);
+    for (i = 0; i < card.n_ports; i++) {
+        card_ports[i].name = get_name(&input);
+        g_ptr_array_add(names, (gpointer) card_ports[i].name);
+        card_port_ptrs[i] = &card_ports[i];
+    }
+    card.ports = card_port_ptrs;
+
+    strategy = cad_card_get_strategy(&card);
+    g_assert(strategy != NULL);
+    cad_card_is_suitable(strategy, &card);
+
+    /* The sink and source, each with its own ports */
+    sink.n_ports = get_byte(&input) % (MAX_PORTS + 1);
+    for (i = 0; i < sink.n_ports; i++) {
+        sink_port_infos[i].name = get_name(&input);
+        g_ptr_array_add(names, (gpointer) sink_port_infos[i].name);
+        sink_port_infos[i].priority = get_byte(&input);
+        sink_port_infos[i].available = get_available(&input);
+        sink_port_ptrs[i] = &sink_port_infos[i];
+    }
+    sink.ports = sink_port_ptrs;
+
+    source.n_ports = get_byte(&input) % (MAX_PORTS + 1);
+    for (i = 0; i < source.n_ports; i++) {
+        source_port_infos[i].name = get_name(&input);
+        g_ptr_array_add(names, (gpointer) source_port_infos[i].name);
+        source_port_infos[i].priority = get_byte(&input);
+        source_port_infos[i].available = get_available(&input);
+        source_port_ptrs[i] = &source_port_infos[i];
+    }
+    source.ports = source_port_ptrs;
+
+    /* Our own view of availability, f.e. after jack events */
+    sink_ports = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    source_ports = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    n_overrides = get_byte(&input) % (MAX_PORTS + 1);
+    for (i = 0; i < n_overrides; i++) {
+        GHashTable *ports = (get_byte(&input) & 1) ? sink_ports : source_ports;
+        gchar *name = get_name(&input);
+
+        g_hash_table_insert(ports, name, GINT_TO_POINTER(get_available(&input)));
+    }
+
+    check_sink_port(strategy, &sink, sink_ports, NULL);
+    check_source_port(strategy, &source, source_ports, NULL);
+    for (i = 0; i < sink.n_ports; i++)
+        check_sink_port(strategy, &sink, sink_ports, sink.ports[i]->name);
+    for (i = 0; i < source.n_ports; i++)
+        check_source_port(strategy, &source, source_ports, source.ports[i]->name);
+
+    pa_proplist_free(card.proplist);
+
+    return 0;
+}
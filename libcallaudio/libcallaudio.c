@@ -9,6 +9,11 @@
 #include "callaudiod.h"
 #include "callaudio-dbus.h"
 
+#include <gio/gunixfdlist.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <unistd.h>
+
 /**
  * SECTION:libcallaudio
  * @Short_description: Call audio control library
@@ -33,16 +38,217 @@
  *       return 0;
  *    }
  * ]|
+ *
+ * #call_audio_get_state() retrieves the whole audio state at once, rather
+ * than querying each value separately.
+ *
+ * Audio can also be routed to a given output with #call_audio_select_output(),
+ * picked among those returned by #call_audio_get_available_outputs().
+ *
+ * The output volume is remembered per route: #call_audio_set_volume() only
+ * changes it for the current one, as returned by #call_audio_get_volume().
+ *
+ * When investigating routing issues, #call_audio_dump_events() retrieves the
+ * daemon's most recent routing events, and #call_audio_get_statistics() its
+ * internal counters.
  */
 
 static CallAudioDbusCallAudio *_proxy;
+static CallAudioDbusCallAudio *_bus_proxy;
+static GDBusConnection        *_peer_connection;
 static gboolean               _initted;
+static CallAudioStatePage    *_state_page;
 
 typedef struct _CallAudioAsyncData {
     CallAudioCallback cb;
     gpointer user_data;
 } CallAudioAsyncData;
 
+static gboolean release_object_cb(gpointer data)
+{
+    g_object_unref(data);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void peer_closed_cb(GDBusConnection *connection,
+                           gboolean         remote_peer_vanished,
+                           GError          *error,
+                           gpointer         data)
+{
+    g_debug("Peer connection closed, falling back to the session bus");
+
+    if (_proxy == _bus_proxy)
+        return;
+
+    /*
+     * We're in the middle of the connection's signal emission: only drop
+     * the proxy, then our own reference on the connection, once it's over.
+     */
+    g_signal_handlers_disconnect_by_func(connection, peer_closed_cb, NULL);
+    g_idle_add(release_object_cb, _proxy);
+    g_idle_add(release_object_cb, g_steal_pointer(&_peer_connection));
+    _proxy = _bus_proxy;
+}
+
+/*
+ * The daemon may advertise a private socket exporting the same interface:
+ * prefer it over the session bus as it saves a hop through the bus daemon.
+ */
+static void connect_peer(void)
+{
+    g_autoptr(GDBusConnection) connection = NULL;
+    g_autoptr(GError) error = NULL;
+    CallAudioDbusCallAudio *peer_proxy;
+    const gchar *address;
+
+    address = call_audio_dbus_call_audio_get_peer_address(_bus_proxy);
+    if (!address || !*address)
+        return;
+
+    connection = g_dbus_connection_new_for_address_sync(address,
+                                                        G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+                                                        NULL, NULL, &error);
+    if (!connection) {
+        g_debug("Unable to connect to '%s': %s", address, error->message);
+        return;
+    }
+
+    peer_proxy = call_audio_dbus_call_audio_proxy_new_sync(connection,
+                                                           G_DBUS_PROXY_FLAGS_NONE,
+                                                           NULL,
+                                                           CALLAUDIO_DBUS_PATH,
+                                                           NULL, &error);
+    if (!peer_proxy) {
+        g_debug("Unable to create peer proxy: %s", error->message);
+        return;
+    }
+
+    g_signal_connect(connection, "closed", G_CALLBACK(peer_closed_cb), NULL);
+
+    g_debug("Using peer connection '%s'", address);
+    _peer_connection = g_steal_pointer(&connection);
+    _proxy = peer_proxy;
+}
+
+/*
+ * Map the daemon's state page so the getters can read the current state
+ * without any round-trip. Older daemons don't provide it, in which case we
+ * keep reading the cached D-Bus properties.
+ */
+static void map_state_page(void)
+{
+    g_autoptr(GUnixFDList) fd_list = NULL;
+    g_autoptr(GVariant) handle = NULL;
+    g_autoptr(GError) error = NULL;
+    CallAudioStatePage *page;
+    int fd;
+
+    if (!call_audio_dbus_call_audio_call_get_state_page_sync(_proxy, NULL,
+                                                             &handle, &fd_list,
+                                                             NULL, &error)) {
+        g_debug("State page unavailable: %s", error->message);
+        return;
+    }
+
+    fd = g_unix_fd_list_get(fd_list, g_variant_get_handle(handle), &error);
+    if (fd < 0) {
+        g_debug("Unable to get state page: %s", error->message);
+        return;
+    }
+
+    page = mmap(NULL, sizeof(CallAudioStatePage), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        g_debug("Unable to map state page");
+        return;
+    }
+
+    if (page->magic != CALLAUDIO_STATE_PAGE_MAGIC ||
+        page->version != CALLAUDIO_STATE_PAGE_VERSION) {
+        g_debug("Unsupported state page version %d", page->version);
+        munmap(page, sizeof(CallAudioStatePage));
+        return;
+    }
+
+    _state_page = page;
+}
+
+static void unmap_state_page(void)
+{
+    if (!_state_page)
+        return;
+
+    munmap(_state_page, sizeof(CallAudioStatePage));
+    _state_page = NULL;
+}
+
+/*
+ * A crashed daemon leaves its page marked alive: only trust it while our
+ * peer connection is up, or while someone owns the name on the bus. The
+ * former is noticed right away, even without a main loop running.
+ */
+static gboolean daemon_is_running(void)
+{
+    g_autofree gchar *owner = NULL;
+
+    if (_proxy != _bus_proxy) {
+        GDBusConnection *connection = g_dbus_proxy_get_connection(G_DBUS_PROXY(_proxy));
+
+        return !g_dbus_connection_is_closed(connection);
+    }
+
+    owner = g_dbus_proxy_get_name_owner(G_DBUS_PROXY(_bus_proxy));
+
+    return owner != NULL;
+}
+
+/*
+ * Take a consistent snapshot of the state page: the daemon bumps the
+ * sequence number before and after each update, so an odd or changed
+ * sequence means we raced with a writer and must retry.
+ */
+static gboolean read_state_page(CallAudioStatePage *copy)
+{
+    int32_t sequence;
+    int tries;
+
+    if (!_state_page || !daemon_is_running())
+        return FALSE;
+
+    for (tries = 0; tries < 16; tries++) {
+        sequence = g_atomic_int_get(&_state_page->sequence);
+        if (sequence & 1)
+            continue;
+
+        copy->alive = g_atomic_int_get(&_state_page->alive);
+        copy->mode = g_atomic_int_get(&_state_page->mode);
+        copy->speaker = g_atomic_int_get(&_state_page->speaker);
+        copy->mic = g_atomic_int_get(&_state_page->mic);
+        copy->volume = g_atomic_int_get(&_state_page->volume);
+        copy->generation = g_atomic_int_get(&_state_page->generation);
+        memcpy(copy->output, _state_page->output, sizeof(copy->output));
+        copy->output[sizeof(copy->output) - 1] = '\0';
+
+        if (g_atomic_int_get(&_state_page->sequence) == sequence)
+            return copy->alive;
+    }
+
+    return FALSE;
+}
+
+static void name_owner_changed_cb(GObject    *object,
+                                  GParamSpec *pspec,
+                                  gpointer    data)
+{
+    g_autofree gchar *owner = g_dbus_proxy_get_name_owner(G_DBUS_PROXY(object));
+
+    /* A restarted daemon creates a new page, the old one is stale */
+    unmap_state_page();
+    if (owner)
+        map_state_page();
+}
+
 /**
  * call_audio_init:
  * @error: Error information
@@ -56,15 +262,22 @@ gboolean call_audio_init(GError **error)
     if (_initted)
         return TRUE;
 
-    _proxy = call_audio_dbus_call_audio_proxy_new_for_bus_sync(
+    _bus_proxy = call_audio_dbus_call_audio_proxy_new_for_bus_sync(
                                     CALLAUDIO_DBUS_TYPE,
                                     G_DBUS_PROXY_FLAGS_NONE,
                                     CALLAUDIO_DBUS_NAME,
                                     CALLAUDIO_DBUS_PATH, NULL, error);
-    if (!_proxy)
+    if (!_bus_proxy)
         return FALSE;
 
-    g_object_add_weak_pointer(G_OBJECT(_proxy), (gpointer *)&_proxy);
+    g_object_add_weak_pointer(G_OBJECT(_bus_proxy), (gpointer *)&_bus_proxy);
+
+    _proxy = _bus_proxy;
+    connect_peer();
+
+    g_signal_connect(_bus_proxy, "notify::g-name-owner",
+                     G_CALLBACK(name_owner_changed_cb), NULL);
+    map_state_page();
 
     _initted = TRUE;
     return TRUE;
@@ -92,7 +305,19 @@ gboolean call_audio_is_inited(void)
 void call_audio_deinit(void)
 {
     _initted = FALSE;
-    g_clear_object(&_proxy);
+
+    unmap_state_page();
+    if (_bus_proxy)
+        g_signal_handlers_disconnect_by_func(_bus_proxy, name_owner_changed_cb, NULL);
+
+    if (_proxy && _proxy != _bus_proxy) {
+        g_signal_handlers_disconnect_by_func(_peer_connection, peer_closed_cb, NULL);
+        g_object_unref(_proxy);
+        g_clear_object(&_peer_connection);
+    }
+    _proxy = NULL;
+
+    g_clear_object(&_bus_proxy);
 }
 
 static void select_mode_done(GObject *object, GAsyncResult *result, gpointer data)
@@ -108,7 +333,8 @@ static void select_mode_done(GObject *object, GAsyncResult *result, gpointer dat
     ret = call_audio_dbus_call_audio_call_select_mode_finish(proxy, &success,
                                                              result, &error);
     if (!ret || !success) {
-        g_warning("SelectMode failed with code %d: %s", success, error->message);
+        g_warning("SelectMode failed with code %d: %s", success,
+                  error ? error->message : "operation failed");
     }
 
     g_debug("%s: D-bus call returned %d (success=%d)", __func__, ret, success);
@@ -180,9 +406,14 @@ gboolean call_audio_select_mode(CallAudioMode mode, GError **error)
  */
 CallAudioMode call_audio_get_audio_mode(void)
 {
+    CallAudioStatePage page;
+
     if (!_initted)
         return CALL_AUDIO_MODE_UNKNOWN;
 
+    if (read_state_page(&page))
+        return page.mode;
+
     return call_audio_dbus_call_audio_get_audio_mode(_proxy);
 }
 
@@ -199,7 +430,8 @@ static void enable_speaker_done(GObject *object, GAsyncResult *result, gpointer
     ret = call_audio_dbus_call_audio_call_enable_speaker_finish(proxy, &success,
                                                                 result, &error);
     if (!ret || !success) {
-        g_warning("EnableSpeaker failed with code %d: %s", success, error->message);
+        g_warning("EnableSpeaker failed with code %d: %s", success,
+                  error ? error->message : "operation failed");
     }
 
     g_debug("%s: D-bus call returned %d (success=%d)", __func__, ret, success);
@@ -244,9 +476,14 @@ gboolean call_audio_enable_speaker_async(gboolean          enable,
  */
 CallAudioSpeakerState call_audio_get_speaker_state(void)
 {
+    CallAudioStatePage page;
+
     if (!_initted)
         return CALL_AUDIO_SPEAKER_UNKNOWN;
 
+    if (read_state_page(&page))
+        return page.speaker;
+
     return call_audio_dbus_call_audio_get_speaker_state(_proxy);
 }
 
@@ -291,7 +528,8 @@ static void mute_mic_done(GObject *object, GAsyncResult *result, gpointer data)
     ret = call_audio_dbus_call_audio_call_mute_mic_finish(proxy, &success,
                                                           result, &error);
     if (!ret || !success)
-        g_warning("MuteMic failed with code %d: %s", success, error->message);
+        g_warning("MuteMic failed with code %d: %s", success,
+                  error ? error->message : "operation failed");
 
     g_debug("%s: D-bus call returned %d (success=%d)", __func__, ret, success);
 
@@ -363,8 +601,310 @@ gboolean call_audio_mute_mic(gboolean mute, GError **error)
  */
 CallAudioMicState call_audio_get_mic_state(void)
 {
+    CallAudioStatePage page;
+
     if (!_initted)
         return CALL_AUDIO_MIC_UNKNOWN;
 
+    if (read_state_page(&page))
+        return page.mic;
+
     return call_audio_dbus_call_audio_get_mic_state(_proxy);
 }
+
+static void set_volume_done(GObject *object, GAsyncResult *result, gpointer data)
+{
+    CallAudioDbusCallAudio *proxy = CALL_AUDIO_DBUS_CALL_AUDIO(object);
+    CallAudioAsyncData *async_data = data;
+    GError *error = NULL;
+    gboolean success = FALSE;
+    gboolean ret;
+
+    g_return_if_fail(CALL_AUDIO_DBUS_IS_CALL_AUDIO(proxy));
+
+    ret = call_audio_dbus_call_audio_call_set_volume_finish(proxy, &success,
+                                                            result, &error);
+    if (!ret || !success)
+        g_warning("SetVolume failed with code %d: %s", success,
+                  error ? error->message : "operation failed");
+
+    g_debug("%s: D-bus call returned %d (success=%d)", __func__, ret, success);
+
+    if (async_data && async_data->cb)
+        async_data->cb(ret && success, error, async_data->user_data);
+    g_free(async_data);
+}
+
+/**
+ * call_audio_set_volume_async:
+ * @volume: Output volume, in percent
+ * @cb: Function to be called when operation completes
+ * @data: User data to be passed to the callback function after completion. This
+ *        data is owned by the caller, which is responsible for freeing it.
+ *
+ * Set the output volume of the current route. The daemon remembers it and
+ * restores it whenever switching back to this route.
+ */
+gboolean call_audio_set_volume_async(guint             volume,
+                                     CallAudioCallback cb,
+                                     gpointer          data)
+{
+    CallAudioAsyncData *async_data = g_new0(CallAudioAsyncData, 1);
+
+    if (!_initted || !async_data)
+        return FALSE;
+
+    async_data->cb = cb;
+    async_data->user_data = data;
+
+    call_audio_dbus_call_audio_call_set_volume(_proxy, volume, NULL,
+                                               set_volume_done, async_data);
+
+    return TRUE;
+}
+
+/**
+ * call_audio_set_volume:
+ * @volume: Output volume, in percent
+ * @error: The error that will be set if the volume could not be set.
+ *
+ * Set the output volume of the current route. This function is synchronous,
+ * and will return only once the operation has been executed.
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean call_audio_set_volume(guint volume, GError **error)
+{
+    gboolean success = FALSE;
+    gboolean ret;
+
+    if (!_initted)
+        return FALSE;
+
+    ret = call_audio_dbus_call_audio_call_set_volume_sync(_proxy, volume, &success,
+                                                          NULL, error);
+    if (error && *error)
+        g_critical("Couldn't set volume %u: %s", volume, (*error)->message);
+
+    g_debug("SetVolume %s: success=%d", ret ? "succeeded" : "failed", success);
+
+    return (ret && success);
+}
+
+/**
+ * call_audio_get_volume:
+ *
+ * Returns: The output volume of the current route, in percent.
+ */
+guint call_audio_get_volume(void)
+{
+    CallAudioStatePage page;
+
+    if (!_initted)
+        return 0;
+
+    if (read_state_page(&page))
+        return page.volume;
+
+    return call_audio_dbus_call_audio_get_volume(_proxy);
+}
+
+static void select_output_done(GObject *object, GAsyncResult *result, gpointer data)
+{
+    CallAudioDbusCallAudio *proxy = CALL_AUDIO_DBUS_CALL_AUDIO(object);
+    CallAudioAsyncData *async_data = data;
+    GError *error = NULL;
+    gboolean success = FALSE;
+    gboolean ret;
+
+    g_return_if_fail(CALL_AUDIO_DBUS_IS_CALL_AUDIO(proxy));
+
+    ret = call_audio_dbus_call_audio_call_select_output_finish(proxy, &success,
+                                                               result, &error);
+    if (!ret || !success) {
+        g_warning("SelectOutput failed with code %d: %s", success,
+                  error ? error->message : "operation failed");
+    }
+
+    g_debug("%s: D-bus call returned %d (success=%d)", __func__, ret, success);
+
+    if (async_data && async_data->cb)
+        async_data->cb(ret && success, error, async_data->user_data);
+    g_free(async_data);
+}
+
+/**
+ * call_audio_select_output_async:
+ * @output: Identifier of the output to select, e.g. %CALL_AUDIO_OUTPUT_HEADSET
+ * @cb: Function to be called when operation completes
+ * @data: User data to be passed to the callback function after completion. This
+ *        data is owned by the caller, which is responsible for freeing it.
+ *
+ * Route audio to the given output. The daemon remembers the choice and uses
+ * it again the next time the current audio mode is selected.
+ */
+gboolean call_audio_select_output_async(const gchar       *output,
+                                        CallAudioCallback cb,
+                                        gpointer          data)
+{
+    CallAudioAsyncData *async_data = g_new0(CallAudioAsyncData, 1);
+
+    if (!_initted || !async_data)
+        return FALSE;
+
+    async_data->cb = cb;
+    async_data->user_data = data;
+
+    call_audio_dbus_call_audio_call_select_output(_proxy, output, NULL,
+                                                  select_output_done, async_data);
+
+    return TRUE;
+}
+
+/**
+ * call_audio_select_output:
+ * @output: Identifier of the output to select, e.g. %CALL_AUDIO_OUTPUT_HEADSET
+ * @error: The error that will be set if the output could not be selected.
+ *
+ * Route audio to the given output. This function is synchronous, and will
+ * return only once the operation has been executed.
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean call_audio_select_output(const gchar *output, GError **error)
+{
+    gboolean success = FALSE;
+    gboolean ret;
+
+    if (!_initted)
+        return FALSE;
+
+    ret = call_audio_dbus_call_audio_call_select_output_sync(_proxy, output, &success,
+                                                             NULL, error);
+    if (error && *error)
+        g_critical("Couldn't select output '%s': %s", output, (*error)->message);
+
+    g_debug("SelectOutput %s: success=%d", ret ? "succeeded" : "failed", success);
+
+    return (ret && success);
+}
+
+/**
+ * call_audio_get_available_outputs:
+ *
+ * Returns: (transfer full) (nullable): The identifiers of the outputs which
+ * can currently be selected, or %NULL if not initialized. Free with
+ * g_strfreev().
+ */
+gchar **call_audio_get_available_outputs(void)
+{
+    if (!_initted)
+        return NULL;
+
+    return g_strdupv((gchar **)call_audio_dbus_call_audio_get_available_outputs(_proxy));
+}
+
+/**
+ * call_audio_get_state:
+ * @error: The error that will be set if the state could not be retrieved.
+ *
+ * Retrieve a consistent snapshot of the audio state in a single call, rather
+ * than querying each value separately. The returned dictionary contains the
+ * following keys:
+ * - "mode" (u): the current #CallAudioMode
+ * - "speaker" (u): the current #CallAudioSpeakerState
+ * - "mic" (u): the current #CallAudioMicState
+ * - "output" (s): the CALL_AUDIO_OUTPUT_* identifier of the selected output,
+ *   or an empty string if unknown
+ * - "output-port" (s): the active output port
+ * - "input-port" (s): the active input port
+ * - "volume" (u): the output volume of the current route, in percent
+ * - "card" (s): the sound card in use
+ * - "backend" (s): the audio backend in use
+ * - "generation" (t): a counter incremented on every state change
+ *
+ * This function is synchronous.
+ *
+ * Returns: (transfer full): the state as a `a{sv}` #GVariant, or %NULL on
+ * error. Free with g_variant_unref().
+ */
+GVariant *call_audio_get_state(GError **error)
+{
+    GVariant *state = NULL;
+    gboolean ret;
+
+    if (!_initted)
+        return NULL;
+
+    ret = call_audio_dbus_call_audio_call_get_state_sync(_proxy, &state,
+                                                         NULL, error);
+    if (error && *error)
+        g_critical("Couldn't get state: %s", (*error)->message);
+
+    g_debug("GetState %s", ret ? "succeeded" : "failed");
+
+    return ret ? state : NULL;
+}
+
+/**
+ * call_audio_get_statistics:
+ * @error: The error that will be set if the statistics could not be retrieved.
+ *
+ * Retrieve the daemon's internal counters, such as the number of operations
+ * and D-Bus calls still waiting for an answer, or its memory usage; see the
+ * GetStatistics D-Bus method.
+ *
+ * This function is synchronous.
+ *
+ * Returns: (transfer full): the statistics as a `a{sv}` #GVariant, or %NULL
+ * on error. Free with g_variant_unref().
+ */
+GVariant *call_audio_get_statistics(GError **error)
+{
+    GVariant *stats = NULL;
+    gboolean ret;
+
+    if (!_initted)
+        return NULL;
+
+    ret = call_audio_dbus_call_audio_call_get_statistics_sync(_proxy, &stats,
+                                                              NULL, error);
+    if (error && *error)
+        g_critical("Couldn't get statistics: %s", (*error)->message);
+
+    g_debug("GetStatistics %s", ret ? "succeeded" : "failed");
+
+    return ret ? stats : NULL;
+}
+
+/**
+ * call_audio_dump_events:
+ * @error: The error that will be set if the events could not be retrieved.
+ *
+ * Retrieve the last routing events recorded by the daemon, oldest first, for
+ * diagnostics. Each event is a `(xsuus)` tuple holding its wall-clock time in
+ * microseconds, its name, an id, a value and a detail string; see the
+ * DumpEvents D-Bus method for their meaning.
+ *
+ * This function is synchronous.
+ *
+ * Returns: (transfer full): the events as a `a(xsuus)` #GVariant, or %NULL on
+ * error. Free with g_variant_unref().
+ */
+GVariant *call_audio_dump_events(GError **error)
+{
+    GVariant *events = NULL;
+    gboolean ret;
+
+    if (!_initted)
+        return NULL;
+
+    ret = call_audio_dbus_call_audio_call_dump_events_sync(_proxy, &events,
+                                                           NULL, error);
+    if (error && *error)
+        g_critical("Couldn't dump events: %s", (*error)->message);
+
+    g_debug("DumpEvents %s", ret ? "succeeded" : "failed");
+
+    return ret ? events : NULL;
+}
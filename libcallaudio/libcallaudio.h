@@ -17,6 +17,11 @@ G_BEGIN_DECLS
  * CallAudioMode:
  * @CALL_AUDIO_MODE_DEFAULT: Default mode (used for music, alarms, ringtones...)
  * @CALL_AUDIO_MODE_CALL: Voice call mode
+ * @CALL_AUDIO_MODE_RINGING: Incoming call ringing, audio stays on the default
+ *   route until the call is answered
+ * @CALL_AUDIO_MODE_VOIP: VoIP (or other communication app) call, using the
+ *   call route and echo cancellation without switching to the modem voice
+ *   profile
  * @CALL_AUDIO_MODE_UNKNOWN: Mode unknown
  *
  * Enum values to indicate the mode to be selected.
@@ -25,6 +30,8 @@ G_BEGIN_DECLS
 typedef enum {
   CALL_AUDIO_MODE_DEFAULT = 0,
   CALL_AUDIO_MODE_CALL,
+  CALL_AUDIO_MODE_RINGING,
+  CALL_AUDIO_MODE_VOIP,
   CALL_AUDIO_MODE_UNKNOWN = 255
 } CallAudioMode;
 
@@ -54,6 +61,37 @@ typedef enum {
   CALL_AUDIO_MIC_UNKNOWN = 255
 } CallAudioMicState;
 
+/**
+ * CALL_AUDIO_OUTPUT_EARPIECE:
+ *
+ * Identifier of the built-in earpiece, see call_audio_select_output().
+ */
+#define CALL_AUDIO_OUTPUT_EARPIECE "earpiece"
+/**
+ * CALL_AUDIO_OUTPUT_SPEAKER:
+ *
+ * Identifier of the built-in loudspeaker.
+ */
+#define CALL_AUDIO_OUTPUT_SPEAKER "speaker"
+/**
+ * CALL_AUDIO_OUTPUT_HEADSET:
+ *
+ * Identifier of a wired headset or headphones.
+ */
+#define CALL_AUDIO_OUTPUT_HEADSET "headset"
+/**
+ * CALL_AUDIO_OUTPUT_BLUETOOTH:
+ *
+ * Identifier of a Bluetooth headset.
+ */
+#define CALL_AUDIO_OUTPUT_BLUETOOTH "bluetooth"
+/**
+ * CALL_AUDIO_OUTPUT_USB:
+ *
+ * Identifier of a USB audio device.
+ */
+#define CALL_AUDIO_OUTPUT_USB "usb"
+
 typedef void (*CallAudioCallback)(gboolean success,
                                   GError *error,
                                   gpointer data);
@@ -74,10 +112,26 @@ gboolean call_audio_enable_speaker_async(gboolean          enable,
                                          gpointer          data);
 CallAudioSpeakerState call_audio_get_speaker_state(void);
 
+gboolean call_audio_select_output      (const gchar *output, GError **error);
+gboolean call_audio_select_output_async(const gchar       *output,
+                                        CallAudioCallback  cb,
+                                        gpointer           data);
+gchar  **call_audio_get_available_outputs(void);
+
 gboolean call_audio_mute_mic      (gboolean mute, GError **error);
 gboolean call_audio_mute_mic_async(gboolean          mute,
                                    CallAudioCallback cb,
                                    gpointer          data);
 CallAudioMicState call_audio_get_mic_state(void);
 
+gboolean call_audio_set_volume      (guint volume, GError **error);
+gboolean call_audio_set_volume_async(guint             volume,
+                                     CallAudioCallback cb,
+                                     gpointer          data);
+guint call_audio_get_volume(void);
+
+GVariant *call_audio_get_state(GError **error);
+GVariant *call_audio_get_statistics(GError **error);
+GVariant *call_audio_dump_events(GError **error);
+
 G_END_DECLS
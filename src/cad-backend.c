@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-backend"
+
+#include "cad-backend.h"
+#include "cad-pulse.h"
+#include "cad-ucm.h"
+
+#include <gio/gio.h>
+
+static gboolean pulse_init(GError **error)
+{
+    cad_pulse_get_default();
+
+    return TRUE;
+}
+
+/* Disposing the backend restores the streams ducked during a call, if any */
+static void pulse_shutdown(void)
+{
+    g_object_unref(cad_pulse_get_default());
+}
+
+static const CadBackend backends[] = {
+    {
+        .name = "pulseaudio",
+        .init = pulse_init,
+        .shutdown = pulse_shutdown,
+        .select_mode = cad_pulse_select_mode,
+        .enable_speaker = cad_pulse_enable_speaker,
+        .mute_mic = cad_pulse_mute_mic,
+        .set_volume = cad_pulse_set_volume,
+        .select_output = cad_pulse_select_output,
+        .get_audio_mode = cad_pulse_get_audio_mode,
+        .get_speaker_state = cad_pulse_get_speaker_state,
+        .get_mic_state = cad_pulse_get_mic_state,
+        .get_volume = cad_pulse_get_volume,
+        .add_state = cad_pulse_add_state,
+        .add_statistics = cad_pulse_add_statistics,
+    },
+    {
+        .name = "ucm",
+        .init = cad_ucm_start,
+        .select_mode = cad_ucm_select_mode,
+        .enable_speaker = cad_ucm_enable_speaker,
+        .mute_mic = cad_ucm_mute_mic,
+        .set_volume = cad_ucm_set_volume,
+        .select_output = cad_ucm_select_output,
+        .get_audio_mode = cad_ucm_get_audio_mode,
+        .get_speaker_state = cad_ucm_get_speaker_state,
+        .get_mic_state = cad_ucm_get_mic_state,
+        .get_volume = cad_ucm_get_volume,
+        .add_state = cad_ucm_add_state,
+        .add_statistics = cad_ucm_add_statistics,
+    },
+};
+
+static const CadBackend *backend = &backends[0];
+
+/**
+ * cad_backend_init:
+ * @name: (nullable): name of the backend to use, or %NULL for the default one
+ * @error: return location for a #GError
+ *
+ * Select and initialize the audio backend. This must be called once, before
+ * any operation is requested.
+ *
+ * Returns: %TRUE on success.
+ */
+gboolean cad_backend_init(const gchar *name, GError **error)
+{
+    guint i;
+
+    if (name) {
+        backend = NULL;
+        for (i = 0; i < G_N_ELEMENTS(backends); i++) {
+            if (g_strcmp0(backends[i].name, name) == 0) {
+                backend = &backends[i];
+                break;
+            }
+        }
+
+        if (!backend) {
+            backend = &backends[0];
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        "Unknown backend '%s'", name);
+            return FALSE;
+        }
+    }
+
+    g_debug("using %s backend", backend->name);
+
+    return backend->init(error);
+}
+
+/**
+ * cad_backend_shutdown:
+ *
+ * Let the audio backend clean up before exiting.
+ */
+void cad_backend_shutdown(void)
+{
+    if (backend->shutdown)
+        backend->shutdown();
+}
+
+const CadBackend *cad_backend_get_default(void)
+{
+    return backend;
+}
+
+/**
+ * cad_backend_set_default:
+ * @stand_in: the backend to use instead of the built-in ones
+ *
+ * Replace the audio backend, f.e. with a fake one driving the manager from
+ * tests. As with cad_backend_init(), this must be called before any
+ * operation is requested.
+ */
+void cad_backend_set_default(const CadBackend *stand_in)
+{
+    g_return_if_fail(stand_in != NULL);
+
+    g_debug("using %s backend", stand_in->name);
+    backend = stand_in;
+}
+
+void cad_backend_select_mode(guint mode, CadOperation *op)
+{
+    backend->select_mode(mode, op);
+}
+
+void cad_backend_enable_speaker(gboolean enable, CadOperation *op)
+{
+    backend->enable_speaker(enable, op);
+}
+
+void cad_backend_mute_mic(gboolean mute, CadOperation *op)
+{
+    backend->mute_mic(mute, op);
+}
+
+void cad_backend_set_volume(guint volume, CadOperation *op)
+{
+    backend->set_volume(volume, op);
+}
+
+void cad_backend_select_output(CadOutput output, CadOperation *op)
+{
+    backend->select_output(output, op);
+}
+
+CallAudioMode cad_backend_get_audio_mode(void)
+{
+    return backend->get_audio_mode();
+}
+
+CallAudioSpeakerState cad_backend_get_speaker_state(void)
+{
+    return backend->get_speaker_state();
+}
+
+CallAudioMicState cad_backend_get_mic_state(void)
+{
+    return backend->get_mic_state();
+}
+
+guint cad_backend_get_volume(void)
+{
+    return backend->get_volume();
+}
+
+void cad_backend_add_state(GVariantDict *dict)
+{
+    backend->add_state(dict);
+}
+
+void cad_backend_add_statistics(GVariantDict *dict)
+{
+    backend->add_statistics(dict);
+}
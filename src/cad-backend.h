@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "libcallaudio.h"
+#include "cad-operation.h"
+#include "cad-output.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * An audio backend actually carries out the operations requested over D-Bus.
+ * Operations must be completed (through cad_operation_complete() or by
+ * dropping the last reference) once processed, and the manager's properties
+ * kept up to date.
+ */
+typedef struct _CadBackend {
+    const gchar *name;
+
+    gboolean (*init)(GError **error);
+    /* Optional, puts things back as they were before exiting */
+    void (*shutdown)(void);
+
+    void (*select_mode)(guint mode, CadOperation *op);
+    void (*enable_speaker)(gboolean enable, CadOperation *op);
+    void (*mute_mic)(gboolean mute, CadOperation *op);
+    void (*set_volume)(guint volume, CadOperation *op);
+    void (*select_output)(CadOutput output, CadOperation *op);
+
+    CallAudioMode (*get_audio_mode)(void);
+    CallAudioSpeakerState (*get_speaker_state)(void);
+    CallAudioMicState (*get_mic_state)(void);
+    guint (*get_volume)(void);
+
+    void (*add_state)(GVariantDict *dict);
+    void (*add_statistics)(GVariantDict *dict);
+} CadBackend;
+
+gboolean cad_backend_init(const gchar *name, GError **error);
+void cad_backend_shutdown(void);
+const CadBackend *cad_backend_get_default(void);
+void cad_backend_set_default(const CadBackend *stand_in);
+
+void cad_backend_select_mode(guint mode, CadOperation *op);
+void cad_backend_enable_speaker(gboolean enable, CadOperation *op);
+void cad_backend_mute_mic(gboolean mute, CadOperation *op);
+void cad_backend_set_volume(guint volume, CadOperation *op);
+void cad_backend_select_output(CadOutput output, CadOperation *op);
+
+CallAudioMode cad_backend_get_audio_mode(void);
+CallAudioSpeakerState cad_backend_get_speaker_state(void);
+CallAudioMicState cad_backend_get_mic_state(void);
+guint cad_backend_get_volume(void);
+
+void cad_backend_add_state(GVariantDict *dict);
+void cad_backend_add_statistics(GVariantDict *dict);
+
+G_END_DECLS
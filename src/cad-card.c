@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-card"
+
+#include "config.h"
+
+#include "cad-card.h"
+
+#include <alsa/use-case.h>
+
+#include <string.h>
+
+/*
+ * Everything here only looks at the objects the sound server describes, and
+ * never talks to it: this keeps card and port selection usable from the fuzz
+ * targets and benchmarks, which feed it synthetic objects.
+ */
+
+#define CARD_BUS_PATH_PREFIX "platform-"
+#define CARD_FORM_FACTOR "internal"
+
+#ifdef WITH_DROID_SUPPORT
+#define DROID_API_NAME "droid-hal"
+#define DROID_PROFILE_HIFI "default"
+#define DROID_PROFILE_VOICECALL "voicecall"
+#define DROID_PROFILE_COMMUNICATION "communication"
+#define DROID_PROFILE_RINGTONE "ringtone"
+#define DROID_OUTPUT_PORT_SPEAKER "output-speaker"
+#define DROID_OUTPUT_PORT_EARPIECE "output-earpiece"
+#define DROID_OUTPUT_PORT_WIRED_HEADSET "output-wired_headset"
+#define DROID_INPUT_PORT_BUILTIN_MIC "input-builtin_mic"
+#define DROID_INPUT_PORT_WIRED_HEADSET_MIC "input-wired_headset"
+#endif /* WITH_DROID_SUPPORT */
+
+static gboolean match_port_substring(const gchar *port, const gchar *name)
+{
+    return strstr(port, name) != NULL;
+}
+
+static gboolean match_port_nocase(const gchar *port, const gchar *name)
+{
+    g_autofree gchar *lower = g_ascii_strdown(port, -1);
+
+    return strstr(lower, name) != NULL;
+}
+
+static const gchar * const ucm_speaker_ports[] = {
+    SND_USE_CASE_DEV_SPEAKER, NULL
+};
+static const gchar * const ucm_earpiece_ports[] = {
+    SND_USE_CASE_DEV_EARPIECE, SND_USE_CASE_DEV_HANDSET, NULL
+};
+
+/* ALSA UCM cards, whose profiles are UCM verbs and ports UCM devices */
+static const CadCardStrategy ucm_strategy = {
+    .name = "ucm",
+    .hifi_profile = SND_USE_CASE_VERB_HIFI,
+    .voicecall_profile = SND_USE_CASE_VERB_VOICECALL,
+    .voip_profile = SND_USE_CASE_VERB_IP_VOICECALL,
+    .match_port = match_port_substring,
+    .speaker_ports = ucm_speaker_ports,
+    .earpiece_ports = ucm_earpiece_ports,
+    .echo_cancel = TRUE,
+};
+
+static const gchar * const generic_speaker_ports[] = {
+    "speaker", NULL
+};
+static const gchar * const generic_earpiece_ports[] = {
+    "earpiece", "handset", NULL
+};
+
+/*
+ * Other cards: no voice profile to rely on, calls are only routed through
+ * ports, whose names don't follow any particular convention
+ */
+static const CadCardStrategy generic_strategy = {
+    .name = "generic",
+    .match_port = match_port_nocase,
+    .speaker_ports = generic_speaker_ports,
+    .earpiece_ports = generic_earpiece_ports,
+    .echo_cancel = TRUE,
+};
+
+#ifdef WITH_DROID_SUPPORT
+static gboolean match_port_name(const gchar *port, const gchar *name)
+{
+    return strcmp(port, name) == 0;
+}
+
+static const gchar * const droid_speaker_ports[] = {
+    DROID_OUTPUT_PORT_SPEAKER, NULL
+};
+static const gchar * const droid_earpiece_ports[] = {
+    DROID_OUTPUT_PORT_EARPIECE, NULL
+};
+/* The parking ports must never be selected */
+static const gchar * const droid_sink_ports[] = {
+    DROID_OUTPUT_PORT_SPEAKER, DROID_OUTPUT_PORT_EARPIECE, NULL
+};
+static const gchar * const droid_source_ports[] = {
+    DROID_INPUT_PORT_BUILTIN_MIC, NULL
+};
+
+/*
+ * Android devices running pulseaudio-modules-droid: the HAL only applies a
+ * mode change on the next routing change, and takes care of echo cancellation
+ */
+static const CadCardStrategy droid_strategy = {
+    .name = "droid",
+    .hifi_profile = DROID_PROFILE_HIFI,
+    .voicecall_profile = DROID_PROFILE_VOICECALL,
+    .ringing_profile = DROID_PROFILE_RINGTONE,
+    .voip_profile = DROID_PROFILE_COMMUNICATION,
+    .match_port = match_port_name,
+    .speaker_ports = droid_speaker_ports,
+    .earpiece_ports = droid_earpiece_ports,
+    .preferred_sink_port = DROID_OUTPUT_PORT_WIRED_HEADSET,
+    .sink_ports = droid_sink_ports,
+    .preferred_source_port = DROID_INPUT_PORT_WIRED_HEADSET_MIC,
+    .source_ports = droid_source_ports,
+    .echo_cancel = FALSE,
+    .park_ports = TRUE,
+};
+#endif /* WITH_DROID_SUPPORT */
+
+/**
+ * cad_card_get_default_strategy:
+ *
+ * Returns: the strategy used until a suitable card is found.
+ */
+const CadCardStrategy *cad_card_get_default_strategy(void)
+{
+    return &generic_strategy;
+}
+
+/**
+ * cad_card_get_strategy:
+ * @info: the card, as described by the sound server
+ *
+ * Droid cards advertise themselves through their API, UCM cards through
+ * their profiles being named after UCM verbs.
+ *
+ * Returns: how to drive @info.
+ */
+const CadCardStrategy *cad_card_get_strategy(const pa_card_info *info)
+{
+    guint i;
+
+#ifdef WITH_DROID_SUPPORT
+    const gchar *prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_API);
+
+    if (prop && strcmp(prop, DROID_API_NAME) == 0)
+        return &droid_strategy;
+#endif /* WITH_DROID_SUPPORT */
+
+    for (i = 0; i < info->n_profiles; i++) {
+        const gchar *name = info->profiles2[i]->name;
+
+        if (strcmp(name, SND_USE_CASE_VERB_HIFI) == 0 ||
+            strcmp(name, SND_USE_CASE_VERB_VOICECALL) == 0)
+            return &ucm_strategy;
+    }
+
+    return &generic_strategy;
+}
+
+/**
+ * cad_card_match_port:
+ * @strategy: the card strategy
+ * @ports: a %NULL-terminated list of port names, f.e. @strategy's speaker ports
+ * @name: the port name
+ *
+ * Returns: %TRUE if @name matches one of @ports, the way @strategy compares
+ * port names.
+ */
+gboolean cad_card_match_port(const CadCardStrategy *strategy,
+                             const gchar * const *ports, const gchar *name)
+{
+    guint i;
+
+    for (i = 0; ports[i]; i++) {
+        if (strategy->match_port(name, ports[i]))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/**
+ * cad_card_is_suitable:
+ * @strategy: the strategy picked for @info, see cad_card_get_strategy()
+ * @info: the card, as described by the sound server
+ *
+ * We're only interested in the phone's built-in card, which must have both a
+ * speaker and an earpiece (or a preferred port taking its place, f.e. a wired
+ * headset).
+ *
+ * Returns: %TRUE if @info can be used for calls.
+ */
+gboolean cad_card_is_suitable(const CadCardStrategy *strategy,
+                              const pa_card_info *info)
+{
+    const gchar *prop;
+    gboolean has_speaker = FALSE;
+    gboolean has_earpiece = FALSE;
+    guint i;
+
+    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_BUS_PATH);
+    if (prop && !g_str_has_prefix(prop, CARD_BUS_PATH_PREFIX))
+        return FALSE;
+    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_FORM_FACTOR);
+    if (prop && strcmp(prop, CARD_FORM_FACTOR) != 0)
+        return FALSE;
+
+    for (i = 0; i < info->n_ports; i++) {
+        pa_card_port_info *port = info->ports[i];
+
+        if (!port || !port->name)
+            continue;
+
+        if (cad_card_match_port(strategy, strategy->speaker_ports, port->name))
+            has_speaker = TRUE;
+        else if (cad_card_match_port(strategy, strategy->earpiece_ports, port->name) ||
+                 g_strcmp0(port->name, strategy->preferred_sink_port) == 0)
+            has_earpiece = TRUE;
+    }
+
+    return has_speaker && has_earpiece;
+}
+
+/**
+ * cad_card_get_port_available:
+ * @ports: our own view of port availability, may be %NULL
+ * @name: the port name
+ * @available: the port availability, as reported by the sound server
+ *
+ * Jack events may tell us about a port's availability before the sound server
+ * does, in which case our own view takes precedence.
+ *
+ * Returns: the port availability.
+ */
+int cad_card_get_port_available(GHashTable *ports, const gchar *name, int available)
+{
+    gpointer value;
+
+    if (ports && g_hash_table_lookup_extended(ports, name, NULL, &value))
+        return GPOINTER_TO_INT(value);
+
+    return available;
+}
+
+/**
+ * cad_card_find_sink_port:
+ * @strategy: the card strategy
+ * @sink: the sink
+ * @ports: our own view of port availability, see cad_card_get_port_available()
+ * @exclude: a port not to pick, or %NULL
+ *
+ * The card's preferred output (f.e. the wired headset on droid) is used
+ * whenever available, otherwise the port with the highest priority gets
+ * chosen, possibly among a restricted set of ports.
+ *
+ * Returns: (nullable): the name of the best available output, owned by @sink.
+ */
+const gchar *cad_card_find_sink_port(const CadCardStrategy *strategy,
+                                     const pa_sink_info *sink,
+                                     GHashTable *ports, const gchar *exclude)
+{
+    pa_sink_port_info *available_port = NULL;
+    guint i;
+
+    for (i = 0; i < sink->n_ports; i++) {
+        pa_sink_port_info *port = sink->ports[i];
+
+        if (!port || !port->name)
+            continue;
+
+        if ((exclude && strcmp(port->name, exclude) == 0) ||
+            cad_card_get_port_available(ports, port->name,
+                                        port->available) == PA_PORT_AVAILABLE_NO) {
+            continue;
+        }
+
+        if (g_strcmp0(port->name, strategy->preferred_sink_port) == 0) {
+            available_port = port;
+            break;
+        }
+
+        if (strategy->sink_ports && !g_strv_contains(strategy->sink_ports, port->name))
+            continue;
+
+        if (!available_port || port->priority > available_port->priority)
+            available_port = port;
+    }
+
+    return available_port ? available_port->name : NULL;
+}
+
+/**
+ * cad_card_find_source_port:
+ * @strategy: the card strategy
+ * @source: the source
+ * @ports: our own view of port availability, see cad_card_get_port_available()
+ * @exclude: a port not to pick, or %NULL
+ *
+ * Same as cad_card_find_sink_port(), for inputs.
+ *
+ * Returns: (nullable): the name of the best available input, owned by @source.
+ */
+const gchar *cad_card_find_source_port(const CadCardStrategy *strategy,
+                                       const pa_source_info *source,
+                                       GHashTable *ports, const gchar *exclude)
+{
+    pa_source_port_info *available_port = NULL;
+    guint i;
+
+    for (i = 0; i < source->n_ports; i++) {
+        pa_source_port_info *port = source->ports[i];
+
+        if (!port || !port->name)
+            continue;
+
+        if ((exclude && strcmp(port->name, exclude) == 0) ||
+            cad_card_get_port_available(ports, port->name,
+                                        port->available) == PA_PORT_AVAILABLE_NO) {
+            continue;
+        }
+
+        if (g_strcmp0(port->name, strategy->preferred_source_port) == 0) {
+            available_port = port;
+            break;
+        }
+
+        if (strategy->source_ports && !g_strv_contains(strategy->source_ports, port->name))
+            continue;
+
+        if (!available_port || port->priority > available_port->priority)
+            available_port = port;
+    }
+
+    return available_port ? available_port->name : NULL;
+}
+
+/**
+ * cad_card_find_output_port:
+ * @sink: the sink
+ * @ports: our own view of port availability, see cad_card_get_port_available()
+ * @output: the kind of output to look for, see cad_output_from_port()
+ * @exclude: a port not to pick, or %NULL
+ *
+ * Returns: (nullable): the name of the best available output of the given
+ * kind, owned by @sink.
+ */
+const gchar *cad_card_find_output_port(const pa_sink_info *sink, GHashTable *ports,
+                                       CadOutput output, const gchar *exclude)
+{
+    pa_sink_port_info *found = NULL;
+    guint i;
+
+    for (i = 0; i < sink->n_ports; i++) {
+        pa_sink_port_info *port = sink->ports[i];
+
+        if (!port || !port->name)
+            continue;
+
+        if ((exclude && strcmp(port->name, exclude) == 0) ||
+            cad_output_from_port(port->name) != output ||
+            cad_card_get_port_available(ports, port->name,
+                                        port->available) == PA_PORT_AVAILABLE_NO) {
+            continue;
+        }
+
+        if (!found || port->priority > found->priority)
+            found = port;
+    }
+
+    return found ? found->name : NULL;
+}
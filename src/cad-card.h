@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "cad-output.h"
+
+#include <glib.h>
+#include <pulse/pulseaudio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * CadCardStrategy:
+ * @name: Short name, reported in the statistics
+ * @hifi_profile: Profile used outside calls
+ * @voicecall_profile: Profile used during voice calls
+ * @ringing_profile: Profile used while ringing, only if the card has it
+ * @voip_profile: Profile used during VoIP calls, only if the card has it
+ * @match_port: Compares a port name with one of the names listed below
+ * @speaker_ports: Names of the speaker ports
+ * @earpiece_ports: Names of the earpiece ports
+ * @preferred_sink_port: Output used whenever available
+ * @sink_ports: If not %NULL, the only other outputs to pick from
+ * @preferred_source_port: Input used whenever available
+ * @source_ports: If not %NULL, the only other inputs to pick from
+ * @echo_cancel: Whether our echo canceller is needed on this card
+ * @park_ports: Whether mode switches only apply on the next routing change,
+ *   which is forced by going through the parking ports
+ *
+ * Cards differ in how their profiles and ports are named, and in what it
+ * takes to switch modes: all of this is picked once when the card is found,
+ * see cad_card_get_strategy().
+ */
+typedef struct {
+    const gchar *name;
+
+    const gchar *hifi_profile;
+    const gchar *voicecall_profile;
+    const gchar *ringing_profile;
+    const gchar *voip_profile;
+
+    gboolean (*match_port)(const gchar *port, const gchar *name);
+    const gchar * const *speaker_ports;
+    const gchar * const *earpiece_ports;
+
+    const gchar *preferred_sink_port;
+    const gchar * const *sink_ports;
+    const gchar *preferred_source_port;
+    const gchar * const *source_ports;
+
+    gboolean echo_cancel;
+    gboolean park_ports;
+} CadCardStrategy;
+
+const CadCardStrategy *cad_card_get_default_strategy(void);
+const CadCardStrategy *cad_card_get_strategy(const pa_card_info *info);
+
+gboolean cad_card_match_port(const CadCardStrategy *strategy,
+                             const gchar * const *ports, const gchar *name);
+gboolean cad_card_is_suitable(const CadCardStrategy *strategy,
+                              const pa_card_info *info);
+
+int cad_card_get_port_available(GHashTable *ports, const gchar *name, int available);
+
+const gchar *cad_card_find_sink_port(const CadCardStrategy *strategy,
+                                     const pa_sink_info *sink,
+                                     GHashTable *ports, const gchar *exclude);
+const gchar *cad_card_find_source_port(const CadCardStrategy *strategy,
+                                       const pa_source_info *source,
+                                       GHashTable *ports, const gchar *exclude);
+const gchar *cad_card_find_output_port(const pa_sink_info *sink, GHashTable *ports,
+                                       CadOutput output, const gchar *exclude);
+
+G_END_DECLS
@@ -0,0 +1,433 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-config"
+
+#include "cad-config.h"
+#include "config.h"
+
+/*
+ * Settings are read from a keyfile, then overridden by command-line options:
+ *
+ *   [General]
+ *   Backend=pulseaudio
+ *
+ *   [Loopback]
+ *   Enabled=true
+ *   LatencyMsec=60
+ *
+ *   [EchoCancel]
+ *   Enabled=true
+ *   Method=webrtc
+ *   Args=
+ *
+ *   [Ducking]
+ *   Enabled=true
+ *   VolumePercent=20
+ *   RampMsec=300
+ *
+ *   [Mixer]
+ *   Card=hw:0
+ *   MuteControls=Capture;Modem Uplink,1
+ *
+ *   [UCM]
+ *   Card=hw:0
+ *   ConfigDir=/usr/share/alsa/ucm2
+ *
+ *   [Realtime]
+ *   Enabled=false
+ *   Priority=5
+ *   LockMemory=true
+ *
+ *   [Jack]
+ *   Enabled=false
+ *   Card=hw:0
+ */
+#define CONFIG_FILE SYSCONFDIR "/callaudiod/callaudiod.conf"
+
+#define GENERAL_GROUP "General"
+#define LOOPBACK_GROUP "Loopback"
+#define ECHO_CANCEL_GROUP "EchoCancel"
+#define DUCKING_GROUP "Ducking"
+#define MIXER_GROUP "Mixer"
+#define UCM_GROUP "UCM"
+#define REALTIME_GROUP "Realtime"
+#define JACK_GROUP "Jack"
+
+#define DEFAULT_LOOPBACK_LATENCY_MSEC 60
+#define DEFAULT_ECHO_CANCEL_METHOD "webrtc"
+#define DEFAULT_DUCKING_VOLUME 20
+#define DEFAULT_DUCKING_RAMP_MSEC 300
+#define DEFAULT_MIXER_CARD "default"
+#define DEFAULT_UCM_CARD "hw:0"
+#define DEFAULT_REALTIME_PRIORITY 5
+#define DEFAULT_JACK_CARD "hw:0"
+
+static struct {
+    gchar *backend;
+    gboolean loopback_enabled;
+    guint loopback_latency_msec;
+    gboolean echo_cancel_enabled;
+    gchar *echo_cancel_method;
+    gchar *echo_cancel_args;
+    gboolean ducking_enabled;
+    guint ducking_volume;
+    guint ducking_ramp_msec;
+    gchar *mixer_card;
+    gchar **mixer_mute_controls;
+    gchar *ucm_card;
+    gchar *ucm_config_dir;
+    gboolean realtime_enabled;
+    guint realtime_priority;
+    gboolean lock_memory;
+    gboolean jack_enabled;
+    gchar *jack_card;
+} config = {
+    .loopback_enabled = TRUE,
+    .loopback_latency_msec = DEFAULT_LOOPBACK_LATENCY_MSEC,
+    .echo_cancel_enabled = TRUE,
+    .ducking_enabled = TRUE,
+    .ducking_volume = DEFAULT_DUCKING_VOLUME,
+    .ducking_ramp_msec = DEFAULT_DUCKING_RAMP_MSEC,
+    .realtime_priority = DEFAULT_REALTIME_PRIORITY,
+    .lock_memory = TRUE,
+};
+
+/* Command-line overrides, left untouched when the option isn't used */
+static gchar *config_file;
+static gchar *backend;
+static gint loopback_latency_msec = -1;
+static gboolean no_loopback;
+static gboolean no_echo_cancel;
+static gboolean no_ducking;
+static gboolean realtime;
+
+static GOptionEntry entries[] = {
+    { "config", 'c', 0, G_OPTION_ARG_FILENAME, &config_file,
+      "Configuration file (default: " CONFIG_FILE ")", "FILE" },
+    { "backend", 'b', 0, G_OPTION_ARG_STRING, &backend,
+      "Audio backend to use (pulseaudio, ucm)", "NAME" },
+    { "loopback-latency", 0, 0, G_OPTION_ARG_INT, &loopback_latency_msec,
+      "Target latency of the modem audio loopback", "MSEC" },
+    { "no-loopback", 0, 0, G_OPTION_ARG_NONE, &no_loopback,
+      "Don't manage the modem audio loopback", NULL },
+    { "no-echo-cancel", 0, 0, G_OPTION_ARG_NONE, &no_echo_cancel,
+      "Don't set up echo cancellation for calls", NULL },
+    { "no-ducking", 0, 0, G_OPTION_ARG_NONE, &no_ducking,
+      "Don't lower other streams during calls", NULL },
+    { "realtime", 0, 0, G_OPTION_ARG_NONE, &realtime,
+      "Run with realtime priority and locked memory", NULL },
+    { NULL }
+};
+
+static void load_config_file(const gchar *path)
+{
+    g_autoptr(GKeyFile) keyfile = g_key_file_new();
+    g_autoptr(GError) error = NULL;
+    gint latency;
+    gint value;
+
+    if (!g_key_file_load_from_file(keyfile, path, G_KEY_FILE_NONE, &error)) {
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_warning("Unable to load '%s': %s", path, error->message);
+        return;
+    }
+
+    g_debug("loading configuration from '%s'", path);
+
+    if (g_key_file_has_key(keyfile, GENERAL_GROUP, "Backend", NULL)) {
+        g_free(config.backend);
+        config.backend = g_key_file_get_string(keyfile, GENERAL_GROUP, "Backend", NULL);
+    }
+
+    if (g_key_file_has_key(keyfile, LOOPBACK_GROUP, "Enabled", NULL))
+        config.loopback_enabled = g_key_file_get_boolean(keyfile, LOOPBACK_GROUP,
+                                                         "Enabled", NULL);
+
+    if (g_key_file_has_key(keyfile, LOOPBACK_GROUP, "LatencyMsec", NULL)) {
+        latency = g_key_file_get_integer(keyfile, LOOPBACK_GROUP,
+                                         "LatencyMsec", NULL);
+        if (latency > 0)
+            config.loopback_latency_msec = latency;
+        else
+            g_warning("Ignoring invalid loopback latency %d", latency);
+    }
+
+    if (g_key_file_has_key(keyfile, ECHO_CANCEL_GROUP, "Enabled", NULL))
+        config.echo_cancel_enabled = g_key_file_get_boolean(keyfile, ECHO_CANCEL_GROUP,
+                                                            "Enabled", NULL);
+    if (g_key_file_has_key(keyfile, ECHO_CANCEL_GROUP, "Method", NULL)) {
+        g_free(config.echo_cancel_method);
+        config.echo_cancel_method = g_key_file_get_string(keyfile, ECHO_CANCEL_GROUP,
+                                                          "Method", NULL);
+    }
+    if (g_key_file_has_key(keyfile, ECHO_CANCEL_GROUP, "Args", NULL)) {
+        g_free(config.echo_cancel_args);
+        config.echo_cancel_args = g_key_file_get_string(keyfile, ECHO_CANCEL_GROUP,
+                                                        "Args", NULL);
+    }
+
+    if (g_key_file_has_key(keyfile, DUCKING_GROUP, "Enabled", NULL))
+        config.ducking_enabled = g_key_file_get_boolean(keyfile, DUCKING_GROUP,
+                                                        "Enabled", NULL);
+    if (g_key_file_has_key(keyfile, DUCKING_GROUP, "VolumePercent", NULL)) {
+        value = g_key_file_get_integer(keyfile, DUCKING_GROUP, "VolumePercent", NULL);
+        if (value >= 0 && value <= 100)
+            config.ducking_volume = value;
+        else
+            g_warning("Ignoring invalid ducking volume %d", value);
+    }
+    if (g_key_file_has_key(keyfile, DUCKING_GROUP, "RampMsec", NULL)) {
+        value = g_key_file_get_integer(keyfile, DUCKING_GROUP, "RampMsec", NULL);
+        if (value >= 0)
+            config.ducking_ramp_msec = value;
+        else
+            g_warning("Ignoring invalid ducking ramp duration %d", value);
+    }
+
+    if (g_key_file_has_key(keyfile, MIXER_GROUP, "Card", NULL)) {
+        g_free(config.mixer_card);
+        config.mixer_card = g_key_file_get_string(keyfile, MIXER_GROUP, "Card", NULL);
+    }
+    if (g_key_file_has_key(keyfile, MIXER_GROUP, "MuteControls", NULL)) {
+        g_strfreev(config.mixer_mute_controls);
+        config.mixer_mute_controls = g_key_file_get_string_list(keyfile, MIXER_GROUP,
+                                                                "MuteControls",
+                                                                NULL, NULL);
+    }
+
+    if (g_key_file_has_key(keyfile, UCM_GROUP, "Card", NULL)) {
+        g_free(config.ucm_card);
+        config.ucm_card = g_key_file_get_string(keyfile, UCM_GROUP, "Card", NULL);
+    }
+    if (g_key_file_has_key(keyfile, UCM_GROUP, "ConfigDir", NULL)) {
+        g_free(config.ucm_config_dir);
+        config.ucm_config_dir = g_key_file_get_string(keyfile, UCM_GROUP,
+                                                      "ConfigDir", NULL);
+    }
+
+    if (g_key_file_has_key(keyfile, REALTIME_GROUP, "Enabled", NULL))
+        config.realtime_enabled = g_key_file_get_boolean(keyfile, REALTIME_GROUP,
+                                                         "Enabled", NULL);
+    if (g_key_file_has_key(keyfile, REALTIME_GROUP, "Priority", NULL)) {
+        value = g_key_file_get_integer(keyfile, REALTIME_GROUP, "Priority", NULL);
+        if (value >= 1 && value <= 99)
+            config.realtime_priority = value;
+        else
+            g_warning("Ignoring invalid realtime priority %d", value);
+    }
+    if (g_key_file_has_key(keyfile, REALTIME_GROUP, "LockMemory", NULL))
+        config.lock_memory = g_key_file_get_boolean(keyfile, REALTIME_GROUP,
+                                                    "LockMemory", NULL);
+
+    if (g_key_file_has_key(keyfile, JACK_GROUP, "Enabled", NULL))
+        config.jack_enabled = g_key_file_get_boolean(keyfile, JACK_GROUP,
+                                                     "Enabled", NULL);
+    if (g_key_file_has_key(keyfile, JACK_GROUP, "Card", NULL)) {
+        g_free(config.jack_card);
+        config.jack_card = g_key_file_get_string(keyfile, JACK_GROUP, "Card", NULL);
+    }
+}
+
+static gboolean post_parse_cb(GOptionContext *context, GOptionGroup *group,
+                              gpointer data, GError **error)
+{
+    load_config_file(config_file ? config_file : CONFIG_FILE);
+
+    if (backend) {
+        g_free(config.backend);
+        config.backend = g_strdup(backend);
+    }
+
+    if (no_loopback)
+        config.loopback_enabled = FALSE;
+    if (no_echo_cancel)
+        config.echo_cancel_enabled = FALSE;
+    if (no_ducking)
+        config.ducking_enabled = FALSE;
+    if (realtime)
+        config.realtime_enabled = TRUE;
+
+    if (loopback_latency_msec == 0 || loopback_latency_msec < -1) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                    "Invalid loopback latency %d", loopback_latency_msec);
+        return FALSE;
+    } else if (loopback_latency_msec > 0) {
+        config.loopback_latency_msec = loopback_latency_msec;
+    }
+
+    g_debug("loopback: %s, latency %u ms",
+            config.loopback_enabled ? "enabled" : "disabled",
+            config.loopback_latency_msec);
+    g_debug("echo cancellation: %s, method '%s'",
+            config.echo_cancel_enabled ? "enabled" : "disabled",
+            cad_config_get_echo_cancel_method());
+
+    return TRUE;
+}
+
+/**
+ * cad_config_get_option_group:
+ *
+ * Returns: a new option group holding the daemon settings, which loads the
+ * configuration file once the command line has been parsed.
+ */
+GOptionGroup *cad_config_get_option_group(void)
+{
+    GOptionGroup *group;
+
+    group = g_option_group_new("callaudiod", "callaudiod options",
+                               "Show callaudiod options", NULL, NULL);
+    g_option_group_add_entries(group, entries);
+    g_option_group_set_parse_hooks(group, NULL, post_parse_cb);
+
+    return group;
+}
+
+/**
+ * cad_config_get_backend:
+ *
+ * Returns: (nullable): the name of the audio backend to use, or %NULL for
+ * the default one.
+ */
+const gchar *cad_config_get_backend(void)
+{
+    if (config.backend && *config.backend)
+        return config.backend;
+
+    return NULL;
+}
+
+gboolean cad_config_get_loopback_enabled(void)
+{
+    return config.loopback_enabled;
+}
+
+guint cad_config_get_loopback_latency_msec(void)
+{
+    return config.loopback_latency_msec;
+}
+
+gboolean cad_config_get_echo_cancel_enabled(void)
+{
+    return config.echo_cancel_enabled;
+}
+
+const gchar *cad_config_get_echo_cancel_method(void)
+{
+    if (config.echo_cancel_method && *config.echo_cancel_method)
+        return config.echo_cancel_method;
+
+    return DEFAULT_ECHO_CANCEL_METHOD;
+}
+
+/**
+ * cad_config_get_echo_cancel_args:
+ *
+ * Returns: the arguments passed to the echo canceller, or %NULL to use its
+ * defaults.
+ */
+const gchar *cad_config_get_echo_cancel_args(void)
+{
+    if (config.echo_cancel_args && *config.echo_cancel_args)
+        return config.echo_cancel_args;
+
+    return NULL;
+}
+
+gboolean cad_config_get_ducking_enabled(void)
+{
+    return config.ducking_enabled;
+}
+
+/**
+ * cad_config_get_ducking_volume:
+ *
+ * Returns: the volume of ducked streams, in percent of their original
+ * volume. Streams are muted if 0.
+ */
+guint cad_config_get_ducking_volume(void)
+{
+    return config.ducking_volume;
+}
+
+guint cad_config_get_ducking_ramp_msec(void)
+{
+    return config.ducking_ramp_msec;
+}
+
+const gchar *cad_config_get_mixer_card(void)
+{
+    if (config.mixer_card && *config.mixer_card)
+        return config.mixer_card;
+
+    return DEFAULT_MIXER_CARD;
+}
+
+/**
+ * cad_config_get_mixer_mute_controls:
+ *
+ * Returns: (nullable): the ALSA simple mixer controls to switch off when
+ * muting the microphone, as "name" or "name,index" strings, or %NULL if
+ * there are none.
+ */
+const gchar * const *cad_config_get_mixer_mute_controls(void)
+{
+    if (config.mixer_mute_controls && config.mixer_mute_controls[0])
+        return (const gchar * const *)config.mixer_mute_controls;
+
+    return NULL;
+}
+
+const gchar *cad_config_get_ucm_card(void)
+{
+    if (config.ucm_card && *config.ucm_card)
+        return config.ucm_card;
+
+    return DEFAULT_UCM_CARD;
+}
+
+/**
+ * cad_config_get_ucm_config_dir:
+ *
+ * Returns: (nullable): the directory holding the UCM configuration files, or
+ * %NULL to let alsa-lib use its default location.
+ */
+const gchar *cad_config_get_ucm_config_dir(void)
+{
+    if (config.ucm_config_dir && *config.ucm_config_dir)
+        return config.ucm_config_dir;
+
+    return NULL;
+}
+
+gboolean cad_config_get_realtime_enabled(void)
+{
+    return config.realtime_enabled;
+}
+
+guint cad_config_get_realtime_priority(void)
+{
+    return config.realtime_priority;
+}
+
+gboolean cad_config_get_lock_memory(void)
+{
+    return config.lock_memory;
+}
+
+gboolean cad_config_get_jack_enabled(void)
+{
+    return config.jack_enabled;
+}
+
+const gchar *cad_config_get_jack_card(void)
+{
+    if (config.jack_card && *config.jack_card)
+        return config.jack_card;
+
+    return DEFAULT_JACK_CARD;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+GOptionGroup *cad_config_get_option_group(void);
+
+const gchar *cad_config_get_backend(void);
+
+gboolean cad_config_get_loopback_enabled(void);
+guint cad_config_get_loopback_latency_msec(void);
+
+gboolean cad_config_get_echo_cancel_enabled(void);
+const gchar *cad_config_get_echo_cancel_method(void);
+const gchar *cad_config_get_echo_cancel_args(void);
+
+gboolean cad_config_get_ducking_enabled(void);
+guint cad_config_get_ducking_volume(void);
+guint cad_config_get_ducking_ramp_msec(void);
+
+const gchar *cad_config_get_mixer_card(void);
+const gchar * const *cad_config_get_mixer_mute_controls(void);
+
+const gchar *cad_config_get_ucm_card(void);
+const gchar *cad_config_get_ucm_config_dir(void);
+
+gboolean cad_config_get_realtime_enabled(void);
+guint cad_config_get_realtime_priority(void);
+gboolean cad_config_get_lock_memory(void);
+
+gboolean cad_config_get_jack_enabled(void);
+const gchar *cad_config_get_jack_card(void);
+
+G_END_DECLS
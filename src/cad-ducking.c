@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-ducking"
+
+#include "cad-ducking.h"
+
+/**
+ * cad_ducking_is_wanted:
+ * @mode: the audio mode
+ *
+ * Only voice calls duck other streams: during VoIP calls, the call audio is
+ * played by an application whose streams don't necessarily carry the "phone"
+ * role (f.e. WebRTC in a browser), and ducking would silence the call itself.
+ *
+ * Returns: %TRUE if other streams should be lowered in @mode.
+ */
+gboolean cad_ducking_is_wanted(CallAudioMode mode)
+{
+    return mode == CALL_AUDIO_MODE_CALL;
+}
+
+/**
+ * cad_ducking_should_duck:
+ * @proplist: the properties of a sink input
+ *
+ * Returns: %TRUE if the stream isn't a call stream, and should be lowered
+ * while ducking.
+ */
+gboolean cad_ducking_should_duck(const pa_proplist *proplist)
+{
+    const gchar *role = pa_proplist_gets(proplist, PA_PROP_MEDIA_ROLE);
+
+    return g_strcmp0(role, "phone") != 0;
+}
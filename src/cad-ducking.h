@@ -0,0 +1,19 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "libcallaudio.h"
+
+#include <glib.h>
+#include <pulse/proplist.h>
+
+G_BEGIN_DECLS
+
+gboolean cad_ducking_is_wanted(CallAudioMode mode);
+gboolean cad_ducking_should_duck(const pa_proplist *proplist);
+
+G_END_DECLS
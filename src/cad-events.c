@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-events"
+
+#include "cad-events.h"
+
+/*
+ * Flight recorder: the last routing events are kept in a fixed-size ring
+ * buffer, so glitches can be investigated after the fact even though debug
+ * logs are usually disabled. Recording an event only takes a timestamp and a
+ * few copies, and never allocates.
+ */
+#define CAD_EVENTS_SIZE 256
+#define CAD_EVENT_DETAIL_SIZE 48
+
+typedef struct {
+    gint64 time;
+    CadEventType type;
+    guint32 id;
+    guint32 value;
+    gchar detail[CAD_EVENT_DETAIL_SIZE];
+} CadEvent;
+
+static const gchar * const event_names[] = {
+    [CAD_EVENT_REQUEST] = "request",
+    [CAD_EVENT_COMPLETE] = "complete",
+    [CAD_EVENT_SERVER] = "server",
+    [CAD_EVENT_SERVER_EVENT] = "server-event",
+    [CAD_EVENT_PROFILE] = "profile",
+    [CAD_EVENT_OUTPUT_PORT] = "output-port",
+    [CAD_EVENT_INPUT_PORT] = "input-port",
+    [CAD_EVENT_MODULE] = "module",
+};
+
+static CadEvent events[CAD_EVENTS_SIZE];
+static guint64 n_events;
+
+/**
+ * cad_events_record:
+ * @type: the event type
+ * @id: the object (operation type, card, sink...) the event relates to
+ * @value: a value whose meaning depends on @type
+ * @detail: (nullable): a short description, truncated if needed
+ *
+ * Append an event to the flight recorder, overwriting the oldest one if it
+ * is full.
+ */
+void cad_events_record(CadEventType type, guint32 id, guint32 value,
+                       const gchar *detail)
+{
+    CadEvent *event = &events[n_events % CAD_EVENTS_SIZE];
+
+    event->time = g_get_real_time();
+    event->type = type;
+    event->id = id;
+    event->value = value;
+    if (detail)
+        g_strlcpy(event->detail, detail, sizeof(event->detail));
+    else
+        event->detail[0] = '\0';
+
+    n_events++;
+}
+
+/**
+ * cad_events_dump:
+ *
+ * Returns: (transfer floating): the recorded events as a `a(xsuus)`
+ * #GVariant, oldest first: wall-clock time in microseconds, event name,
+ * id, value and detail.
+ */
+GVariant *cad_events_dump(void)
+{
+    GVariantBuilder builder;
+    guint64 i;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(xsuus)"));
+
+    i = n_events > CAD_EVENTS_SIZE ? n_events - CAD_EVENTS_SIZE : 0;
+    for (; i < n_events; i++) {
+        CadEvent *event = &events[i % CAD_EVENTS_SIZE];
+
+        g_variant_builder_add(&builder, "(xsuus)", event->time,
+                              event_names[event->type], event->id,
+                              event->value, event->detail);
+    }
+
+    return g_variant_builder_end(&builder);
+}
+
+void cad_events_add_statistics(GVariantDict *dict)
+{
+    g_variant_dict_insert(dict, "events-capacity", "u", CAD_EVENTS_SIZE);
+    g_variant_dict_insert(dict, "events-recorded", "t", n_events);
+}
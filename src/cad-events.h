@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * CadEventType:
+ * @CAD_EVENT_REQUEST: A client request was received
+ * @CAD_EVENT_COMPLETE: An operation completed
+ * @CAD_EVENT_SERVER: The sound server connection state changed
+ * @CAD_EVENT_SERVER_EVENT: The sound server notified us of an object change
+ * @CAD_EVENT_PROFILE: A card profile (or UCM verb) was selected
+ * @CAD_EVENT_OUTPUT_PORT: An output port was selected
+ * @CAD_EVENT_INPUT_PORT: An input port was selected
+ * @CAD_EVENT_MODULE: A sound server module was loaded
+ *
+ * Kinds of routing events kept in the flight recorder.
+ */
+typedef enum {
+    CAD_EVENT_REQUEST = 0,
+    CAD_EVENT_COMPLETE,
+    CAD_EVENT_SERVER,
+    CAD_EVENT_SERVER_EVENT,
+    CAD_EVENT_PROFILE,
+    CAD_EVENT_OUTPUT_PORT,
+    CAD_EVENT_INPUT_PORT,
+    CAD_EVENT_MODULE,
+} CadEventType;
+
+void cad_events_record(CadEventType type, guint32 id, guint32 value,
+                       const gchar *detail);
+GVariant *cad_events_dump(void);
+
+void cad_events_add_statistics(GVariantDict *dict);
+
+G_END_DECLS
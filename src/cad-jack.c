@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-jack"
+
+#include "cad-config.h"
+#include "cad-jack.h"
+
+#include <glib-unix.h>
+#include <alsa/asoundlib.h>
+
+#include <poll.h>
+#include <string.h>
+
+#define JACK_SUFFIX " Jack"
+
+/*
+ * The sound server only notices a headset being (un)plugged after processing
+ * the jack control event itself, then lets us know through a card change
+ * which we have to query before switching ports. Watching the ALSA jack
+ * controls directly lets us react right away, which matters most when
+ * unplugging a headset in the middle of a call.
+ *
+ * Controls are watched on the main loop; ALSA may notify a control without
+ * its value changing, so we only report actual changes.
+ */
+static snd_ctl_t *ctl;
+static GArray *watch_ids;
+static GHashTable *jack_states;
+static CadJackFunc jack_func;
+static gpointer jack_data;
+
+static guint64 n_events;
+static guint64 n_changes;
+
+static void notify_jack(const gchar *name, gboolean plugged)
+{
+    gpointer previous;
+
+    if (g_hash_table_lookup_extended(jack_states, name, NULL, &previous) &&
+        GPOINTER_TO_INT(previous) == plugged)
+        return;
+
+    g_hash_table_insert(jack_states, g_strdup(name), GINT_TO_POINTER(plugged));
+    n_changes++;
+
+    g_debug("jack '%s' %s", name, plugged ? "plugged" : "unplugged");
+
+    /* "Headset Jack" covers both headphones and mic */
+    if (strstr(name, "Mic") != NULL || strstr(name, "Headset") != NULL)
+        jack_func(CAD_JACK_INPUT, plugged, jack_data);
+    if (strstr(name, "Mic") == NULL)
+        jack_func(CAD_JACK_OUTPUT, plugged, jack_data);
+}
+
+static void process_event(snd_ctl_event_t *event)
+{
+    snd_ctl_elem_value_t *value;
+    const char *name;
+    unsigned int mask;
+    int err;
+
+    if (snd_ctl_event_get_type(event) != SND_CTL_EVENT_ELEM)
+        return;
+
+    mask = snd_ctl_event_elem_get_mask(event);
+    if (mask == SND_CTL_EVENT_MASK_REMOVE || !(mask & SND_CTL_EVENT_MASK_VALUE))
+        return;
+
+    if (snd_ctl_event_elem_get_interface(event) != SND_CTL_ELEM_IFACE_CARD)
+        return;
+
+    name = snd_ctl_event_elem_get_name(event);
+    if (!g_str_has_suffix(name, JACK_SUFFIX) ||
+        !(strstr(name, "Headphone") || strstr(name, "Headset") ||
+          strstr(name, "Mic") || strstr(name, "Line Out")))
+        return;
+
+    n_events++;
+
+    if (snd_ctl_elem_value_malloc(&value) < 0)
+        return;
+
+    snd_ctl_elem_value_set_numid(value, snd_ctl_event_elem_get_numid(event));
+    err = snd_ctl_elem_read(ctl, value);
+    if (err < 0)
+        g_warning("Unable to read jack control '%s': %s", name, snd_strerror(err));
+    else
+        notify_jack(name, snd_ctl_elem_value_get_boolean(value, 0));
+
+    snd_ctl_elem_value_free(value);
+}
+
+static gboolean ctl_event_cb(gint fd, GIOCondition condition, gpointer data)
+{
+    snd_ctl_event_t *event;
+
+    if (condition & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+        g_warning("Lost jack controls, stopping jack detection");
+        cad_jack_stop();
+        return G_SOURCE_REMOVE;
+    }
+
+    if (snd_ctl_event_malloc(&event) < 0)
+        return G_SOURCE_CONTINUE;
+
+    while (snd_ctl_read(ctl, event) > 0)
+        process_event(event);
+
+    snd_ctl_event_free(event);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * cad_jack_start:
+ * @func: the function to call when a jack gets (un)plugged
+ * @data: user data passed to @func
+ *
+ * Start watching the jack controls of the configured card.
+ *
+ * Returns: %TRUE if the controls are being watched.
+ */
+gboolean cad_jack_start(CadJackFunc func, gpointer data)
+{
+    const gchar *card = cad_config_get_jack_card();
+    struct pollfd *fds;
+    int n, err, i;
+
+    g_return_val_if_fail(func != NULL, FALSE);
+
+    if (ctl)
+        return TRUE;
+
+    err = snd_ctl_open(&ctl, card, SND_CTL_NONBLOCK);
+    if (err < 0) {
+        g_warning("Unable to open controls of '%s': %s", card, snd_strerror(err));
+        ctl = NULL;
+        return FALSE;
+    }
+
+    err = snd_ctl_subscribe_events(ctl, 1);
+    n = snd_ctl_poll_descriptors_count(ctl);
+    if (err < 0 || n <= 0) {
+        g_warning("Unable to watch controls of '%s': %s", card,
+                  snd_strerror(err < 0 ? err : n));
+        g_clear_pointer(&ctl, snd_ctl_close);
+        return FALSE;
+    }
+
+    jack_func = func;
+    jack_data = data;
+    jack_states = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    watch_ids = g_array_new(FALSE, FALSE, sizeof(guint));
+
+    fds = g_new0(struct pollfd, n);
+    n = snd_ctl_poll_descriptors(ctl, fds, n);
+    for (i = 0; i < n; i++) {
+        guint id = g_unix_fd_add(fds[i].fd, G_IO_IN | G_IO_ERR | G_IO_HUP,
+                                 ctl_event_cb, NULL);
+        g_array_append_val(watch_ids, id);
+    }
+    g_free(fds);
+
+    g_debug("watching jack controls of '%s'", card);
+
+    return TRUE;
+}
+
+void cad_jack_stop(void)
+{
+    guint i;
+
+    if (watch_ids) {
+        for (i = 0; i < watch_ids->len; i++)
+            g_source_remove(g_array_index(watch_ids, guint, i));
+        g_clear_pointer(&watch_ids, g_array_unref);
+    }
+
+    g_clear_pointer(&jack_states, g_hash_table_destroy);
+    g_clear_pointer(&ctl, snd_ctl_close);
+}
+
+void cad_jack_add_statistics(GVariantDict *dict)
+{
+    g_variant_dict_insert(dict, "jack-watching", "b", ctl != NULL);
+    g_variant_dict_insert(dict, "jack-events", "t", n_events);
+    g_variant_dict_insert(dict, "jack-changes", "t", n_changes);
+}
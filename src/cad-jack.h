@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * CadJackType:
+ * @CAD_JACK_OUTPUT: Headphones or headset speakers
+ * @CAD_JACK_INPUT: Headset microphone
+ *
+ * The kind of device a jack control reports.
+ */
+typedef enum {
+    CAD_JACK_OUTPUT = 0,
+    CAD_JACK_INPUT,
+} CadJackType;
+
+typedef void (*CadJackFunc)(CadJackType type, gboolean plugged, gpointer data);
+
+gboolean cad_jack_start(CadJackFunc func, gpointer data);
+void cad_jack_stop(void);
+
+void cad_jack_add_statistics(GVariantDict *dict);
+
+G_END_DECLS
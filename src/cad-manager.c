@@ -8,15 +8,40 @@
 
 #include "callaudiod.h"
 #include "cad-manager.h"
-#include "cad-pulse.h"
+#include "cad-jack.h"
+#include "cad-mixer.h"
+#include "cad-objects.h"
+#include "cad-output.h"
+#include "cad-realtime.h"
+#include "cad-state-page.h"
+#include "cad-trace.h"
+#include "cad-backend.h"
+#include "cad-events.h"
+#include "cad-volume.h"
 
 #include "libcallaudio.h"
 
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 #include <glib-unix.h>
 
+/* Longest time property notifications are held, see operations_activity_cb() */
+#define BATCH_TIMEOUT 500 /* milliseconds */
+
 typedef struct _CadManager {
     CallAudioDbusCallAudioSkeleton parent;
+
+    GVariant *state;
+    guint64 state_generation;
+    CadOutput output;
+
+    gboolean batching;
+    gboolean state_dirty;
+    guint batch_timeout_id;
+    guint64 n_batches;
+    guint64 n_batch_timeouts;
+    guint64 n_deferred_updates;
+    guint64 n_output_changes;
 } CadManager;
 
 static void cad_manager_call_audio_iface_init(CallAudioDbusCallAudioIface *iface);
@@ -26,11 +51,53 @@ G_DEFINE_TYPE_WITH_CODE(CadManager, cad_manager,
                         G_IMPLEMENT_INTERFACE(CALL_AUDIO_DBUS_TYPE_CALL_AUDIO,
                                               cad_manager_call_audio_iface_init));
 
+static void refresh_state(CadManager *self)
+{
+    GVariantDict dict;
+    GVariant *state;
+    const gchar *port = NULL;
+    CadOutput output;
+
+    self->state_dirty = FALSE;
+
+    g_variant_dict_init(&dict, NULL);
+    cad_backend_add_state(&dict);
+    g_variant_dict_lookup(&dict, "output-port", "&s", &port);
+    output = cad_output_from_port(port);
+    g_variant_dict_insert(&dict, "output", "s", cad_output_to_string(output));
+    state = g_variant_ref_sink(g_variant_dict_end(&dict));
+
+    if (self->state && g_variant_equal(self->state, state)) {
+        g_variant_unref(state);
+        return;
+    }
+
+    g_clear_pointer(&self->state, g_variant_unref);
+    self->state = state;
+    self->state_generation++;
+
+    if (self->output != output) {
+        self->output = output;
+        self->n_output_changes++;
+        call_audio_dbus_call_audio_emit_output_changed(CALL_AUDIO_DBUS_CALL_AUDIO(self),
+                                                       cad_output_to_string(output));
+    }
+
+    g_variant_dict_init(&dict, self->state);
+    g_variant_dict_insert(&dict, "generation", "t", self->state_generation);
+    state = g_variant_ref_sink(g_variant_dict_end(&dict));
+    cad_state_page_update(state);
+    g_object_set(self, "state", state, NULL);
+    g_variant_unref(state);
+}
+
 static void complete_command_cb(CadOperation *op)
 {
     if (!op)
         return;
 
+    CAD_TRACE2(complete, op->type, op->success);
+
     if (op->success) {
         switch (op->type) {
         case CAD_OPERATION_SELECT_MODE:
@@ -42,10 +109,20 @@ static void complete_command_cb(CadOperation *op)
         case CAD_OPERATION_MUTE_MIC:
             call_audio_dbus_call_audio_complete_mute_mic(op->object, op->invocation, op->success);
             break;
+        case CAD_OPERATION_SET_VOLUME:
+            call_audio_dbus_call_audio_complete_set_volume(op->object, op->invocation, op->success);
+            break;
+        case CAD_OPERATION_SELECT_OUTPUT:
+            call_audio_dbus_call_audio_complete_select_output(op->object, op->invocation, op->success);
+            break;
         default:
             g_critical("unknown operation %d", op->type);
             break;
         }
+    } else if (op->superseded) {
+        g_dbus_method_invocation_return_dbus_error(op->invocation,
+                                                   CALLAUDIO_DBUS_ERROR_SUPERSEDED,
+                                                   "Operation superseded by a newer request");
     } else {
         g_dbus_method_invocation_return_error(op->invocation, G_DBUS_ERROR,
                                               G_DBUS_ERROR_FAILED,
@@ -58,42 +135,47 @@ static gboolean cad_manager_handle_select_mode(CallAudioDbusCallAudio *object,
                                                guint mode)
 {
     CadOperation *op;
+    gboolean pending;
 
-    if (mode >= 2) {
+    if (mode != CALL_AUDIO_MODE_DEFAULT && mode != CALL_AUDIO_MODE_CALL &&
+        mode != CALL_AUDIO_MODE_RINGING && mode != CALL_AUDIO_MODE_VOIP) {
         g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
                                               G_DBUS_ERROR_INVALID_ARGS,
                                               "Invalid mode %u", mode);
-        return FALSE;
+        return TRUE;
     }
 
-    op = g_new(CadOperation, 1);
-    if (!op) {
-        g_critical("Unable to allocate memory for select mode operation");
-        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
-                                              G_DBUS_ERROR_NO_MEMORY,
-                                              "Failed to allocate operation");
-        return FALSE;
-    }
+    /*
+     * If a mode switch is still in flight, the current mode doesn't tell us
+     * where we're heading: start a new switch, which supersedes the previous
+     * one, in any case.
+     */
+    pending = cad_operation_has_pending(CAD_OPERATION_SELECT_MODE);
 
-    op->type = CAD_OPERATION_SELECT_MODE;
-    op->value = GUINT_TO_POINTER(mode);
-    op->object = object;
-    op->invocation = invocation;
-    op->callback = complete_command_cb;
+    CAD_TRACE2(request, CAD_OPERATION_SELECT_MODE, mode);
+    cad_events_record(CAD_EVENT_REQUEST, CAD_OPERATION_SELECT_MODE, mode,
+                      g_dbus_method_invocation_get_sender(invocation));
 
-    CallAudioMode currentMode = cad_pulse_get_audio_mode();
-    if(currentMode != mode){
+    op = cad_operation_new(CAD_OPERATION_SELECT_MODE, object, invocation,
+                           complete_command_cb);
+
+    CallAudioMode currentMode = cad_backend_get_audio_mode();
+    if(pending || currentMode != mode){
         g_debug("Change mode from '%u', to '%u'",currentMode, mode);
-        cad_pulse_select_mode(mode, op);
+        cad_backend_select_mode(mode, op);
+    } else {
+        cad_operation_complete(op, TRUE);
     }
 
+    cad_operation_unref(op);
+
     return TRUE;
 }
 
 static CallAudioMode
 cad_manager_get_audio_mode(CallAudioDbusCallAudio *object)
 {
-    return cad_pulse_get_audio_mode();
+    return cad_backend_get_audio_mode();
 }
 
 static gboolean cad_manager_handle_enable_speaker(CallAudioDbusCallAudio *object,
@@ -102,23 +184,46 @@ static gboolean cad_manager_handle_enable_speaker(CallAudioDbusCallAudio *object
 {
     CadOperation *op;
 
-    op = g_new(CadOperation, 1);
-    if (!op) {
-        g_critical("Unable to allocate memory for speaker operation");
+    CAD_TRACE2(request, CAD_OPERATION_ENABLE_SPEAKER, enable);
+    cad_events_record(CAD_EVENT_REQUEST, CAD_OPERATION_ENABLE_SPEAKER, enable,
+                      g_dbus_method_invocation_get_sender(invocation));
+
+    op = cad_operation_new(CAD_OPERATION_ENABLE_SPEAKER, object, invocation,
+                           complete_command_cb);
+
+    g_debug("Enable speaker: %d", enable);
+    cad_backend_enable_speaker(enable, op);
+
+    cad_operation_unref(op);
+
+    return TRUE;
+}
+
+static gboolean cad_manager_handle_select_output(CallAudioDbusCallAudio *object,
+                                                 GDBusMethodInvocation *invocation,
+                                                 const gchar *name)
+{
+    CadOperation *op;
+    CadOutput output = cad_output_from_string(name);
+
+    if (output == CAD_OUTPUT_UNKNOWN) {
         g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
-                                              G_DBUS_ERROR_NO_MEMORY,
-                                              "Failed to allocate operation");
-        return FALSE;
+                                              G_DBUS_ERROR_INVALID_ARGS,
+                                              "Invalid output '%s'", name);
+        return TRUE;
     }
 
-    op->type = CAD_OPERATION_ENABLE_SPEAKER;
-    op->value = GUINT_TO_POINTER(enable ? CALL_AUDIO_SPEAKER_ON : CALL_AUDIO_SPEAKER_OFF);
-    op->object = object;
-    op->invocation = invocation;
-    op->callback = complete_command_cb;
+    CAD_TRACE2(request, CAD_OPERATION_SELECT_OUTPUT, output);
+    cad_events_record(CAD_EVENT_REQUEST, CAD_OPERATION_SELECT_OUTPUT, output,
+                      g_dbus_method_invocation_get_sender(invocation));
 
-    g_debug("Enable speaker: %d", enable);
-    cad_pulse_enable_speaker(enable, op);
+    op = cad_operation_new(CAD_OPERATION_SELECT_OUTPUT, object, invocation,
+                           complete_command_cb);
+
+    g_debug("Select output: %s", name);
+    cad_backend_select_output(output, op);
+
+    cad_operation_unref(op);
 
     return TRUE;
 }
@@ -126,7 +231,7 @@ static gboolean cad_manager_handle_enable_speaker(CallAudioDbusCallAudio *object
 static CallAudioSpeakerState
 cad_manager_get_speaker_state(CallAudioDbusCallAudio *object)
 {
-    return cad_pulse_get_speaker_state();
+    return cad_backend_get_speaker_state();
 }
 
 static gboolean cad_manager_handle_mute_mic(CallAudioDbusCallAudio *object,
@@ -135,23 +240,17 @@ static gboolean cad_manager_handle_mute_mic(CallAudioDbusCallAudio *object,
 {
     CadOperation *op;
 
-    op = g_new(CadOperation, 1);
-    if (!op) {
-        g_critical("Unable to allocate memory for mic operation");
-        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
-                                              G_DBUS_ERROR_NO_MEMORY,
-                                              "Failed to allocate operation");
-        return FALSE;
-    }
+    CAD_TRACE2(request, CAD_OPERATION_MUTE_MIC, mute);
+    cad_events_record(CAD_EVENT_REQUEST, CAD_OPERATION_MUTE_MIC, mute,
+                      g_dbus_method_invocation_get_sender(invocation));
 
-    op->type = CAD_OPERATION_MUTE_MIC;
-    op->value = GUINT_TO_POINTER(mute ? CALL_AUDIO_MIC_OFF : CALL_AUDIO_MIC_ON);
-    op->object = object;
-    op->invocation = invocation;
-    op->callback = complete_command_cb;
+    op = cad_operation_new(CAD_OPERATION_MUTE_MIC, object, invocation,
+                           complete_command_cb);
 
     g_debug("Mute mic: %d", mute);
-    cad_pulse_mute_mic(mute, op);
+    cad_backend_mute_mic(mute, op);
+
+    cad_operation_unref(op);
 
     return TRUE;
 }
@@ -159,7 +258,126 @@ static gboolean cad_manager_handle_mute_mic(CallAudioDbusCallAudio *object,
 static CallAudioMicState
 cad_manager_get_mic_state(CallAudioDbusCallAudio *object)
 {
-    return cad_pulse_get_mic_state();
+    return cad_backend_get_mic_state();
+}
+
+static gboolean cad_manager_handle_set_volume(CallAudioDbusCallAudio *object,
+                                              GDBusMethodInvocation *invocation,
+                                              guint volume)
+{
+    CadOperation *op;
+
+    if (volume > 100) {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+                                              G_DBUS_ERROR_INVALID_ARGS,
+                                              "Invalid volume %u", volume);
+        return TRUE;
+    }
+
+    CAD_TRACE2(request, CAD_OPERATION_SET_VOLUME, volume);
+    cad_events_record(CAD_EVENT_REQUEST, CAD_OPERATION_SET_VOLUME, volume,
+                      g_dbus_method_invocation_get_sender(invocation));
+
+    op = cad_operation_new(CAD_OPERATION_SET_VOLUME, object, invocation,
+                           complete_command_cb);
+
+    g_debug("Set volume: %u", volume);
+    cad_backend_set_volume(volume, op);
+
+    cad_operation_unref(op);
+
+    return TRUE;
+}
+
+static guint
+cad_manager_get_volume(CallAudioDbusCallAudio *object)
+{
+    return cad_backend_get_volume();
+}
+
+static gboolean cad_manager_handle_get_state(CallAudioDbusCallAudio *object,
+                                             GDBusMethodInvocation *invocation)
+{
+    CadManager *self = CAD_MANAGER(object);
+
+    refresh_state(self);
+    call_audio_dbus_call_audio_complete_get_state(object, invocation,
+                                                  call_audio_dbus_call_audio_get_state(object));
+
+    return TRUE;
+}
+
+static gboolean cad_manager_handle_get_state_page(CallAudioDbusCallAudio *object,
+                                                  GDBusMethodInvocation *invocation,
+                                                  GUnixFDList *fd_list)
+{
+    CadManager *self = CAD_MANAGER(object);
+    g_autoptr(GUnixFDList) out_fd_list = NULL;
+    g_autoptr(GError) error = NULL;
+    int fd;
+
+    refresh_state(self);
+
+    fd = cad_state_page_get_fd(call_audio_dbus_call_audio_get_state(object));
+    if (fd < 0) {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+                                              G_DBUS_ERROR_NOT_SUPPORTED,
+                                              "State page unavailable");
+        return TRUE;
+    }
+
+    /* The fd list dups the descriptor, the page keeps its own */
+    out_fd_list = g_unix_fd_list_new();
+    if (g_unix_fd_list_append(out_fd_list, fd, &error) < 0) {
+        g_dbus_method_invocation_return_gerror(invocation, error);
+        return TRUE;
+    }
+
+    call_audio_dbus_call_audio_complete_get_state_page(object, invocation,
+                                                       out_fd_list,
+                                                       g_variant_new_handle(0));
+
+    return TRUE;
+}
+
+static gboolean cad_manager_handle_get_statistics(CallAudioDbusCallAudio *object,
+                                                  GDBusMethodInvocation *invocation)
+{
+    GVariantDict dict;
+
+    g_variant_dict_init(&dict, NULL);
+    cad_operation_add_statistics(&dict);
+    cad_backend_add_statistics(&dict);
+    cad_volume_add_statistics(&dict);
+    cad_mixer_add_statistics(&dict);
+    cad_jack_add_statistics(&dict);
+    cad_objects_add_statistics(&dict);
+    cad_output_add_statistics(&dict);
+    cad_events_add_statistics(&dict);
+    cad_realtime_add_statistics(&dict);
+    cad_state_page_add_statistics(&dict);
+    g_variant_dict_insert(&dict, "property-batches", "t",
+                          CAD_MANAGER(object)->n_batches);
+    g_variant_dict_insert(&dict, "state-updates-deferred", "t",
+                          CAD_MANAGER(object)->n_deferred_updates);
+    g_variant_dict_insert(&dict, "property-batch-timeouts", "t",
+                          CAD_MANAGER(object)->n_batch_timeouts);
+    g_variant_dict_insert(&dict, "output-changes", "t",
+                          CAD_MANAGER(object)->n_output_changes);
+
+    call_audio_dbus_call_audio_complete_get_statistics(object, invocation,
+                                                       g_variant_dict_end(&dict));
+
+    return TRUE;
+}
+
+static gboolean cad_manager_handle_dump_events(CallAudioDbusCallAudio *object,
+                                               GDBusMethodInvocation *invocation)
+{
+    call_audio_dbus_call_audio_complete_dump_events(object, invocation,
+                                                    cad_events_dump());
+
+    return TRUE;
 }
 
 static void cad_manager_call_audio_iface_init(CallAudioDbusCallAudioIface *iface)
@@ -168,16 +386,109 @@ static void cad_manager_call_audio_iface_init(CallAudioDbusCallAudioIface *iface
     iface->get_audio_mode = cad_manager_get_audio_mode;
     iface->handle_enable_speaker = cad_manager_handle_enable_speaker;
     iface->get_speaker_state = cad_manager_get_speaker_state;
+    iface->handle_select_output = cad_manager_handle_select_output;
     iface->handle_mute_mic = cad_manager_handle_mute_mic;
     iface->get_mic_state = cad_manager_get_mic_state;
+    iface->handle_set_volume = cad_manager_handle_set_volume;
+    iface->get_volume = cad_manager_get_volume;
+    iface->handle_get_state = cad_manager_handle_get_state;
+    iface->handle_get_state_page = cad_manager_handle_get_state_page;
+    iface->handle_get_statistics = cad_manager_handle_get_statistics;
+    iface->handle_dump_events = cad_manager_handle_dump_events;
+}
+
+static void state_property_changed_cb(CadManager *self, GParamSpec *pspec,
+                                      gpointer user_data)
+{
+    cad_manager_update_state(self);
+}
+
+static void end_batch(CadManager *self)
+{
+    g_clear_handle_id(&self->batch_timeout_id, g_source_remove);
+
+    if (!self->batching)
+        return;
+
+    self->batching = FALSE;
+    self->n_batches++;
+    g_object_thaw_notify(G_OBJECT(self));
+
+    if (self->state_dirty)
+        cad_manager_update_state(self);
+
+    g_dbus_interface_skeleton_flush(G_DBUS_INTERFACE_SKELETON(self));
+}
+
+static gboolean batch_timeout_cb(gpointer data)
+{
+    CadManager *self = data;
+
+    self->batch_timeout_id = 0;
+    self->n_batch_timeouts++;
+    g_warning("operations still in flight after %u ms, sending notifications",
+              BATCH_TIMEOUT);
+    end_batch(self);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * A single request may change several properties, in several steps, possibly
+ * through implicit sub-operations. Hold property notifications while
+ * operations are in flight, so clients get a single PropertiesChanged signal
+ * once everything settled, rather than being woken up for each step.
+ *
+ * An operation stuck in a backend must not hold them forever though: past
+ * BATCH_TIMEOUT, notifications are released and no longer held until no
+ * operation is in flight again.
+ */
+static void operations_activity_cb(gboolean busy, gpointer data)
+{
+    CadManager *self = data;
+
+    if (busy) {
+        self->batching = TRUE;
+        g_object_freeze_notify(G_OBJECT(self));
+        self->batch_timeout_id = g_timeout_add(BATCH_TIMEOUT, batch_timeout_cb, self);
+        return;
+    }
+
+    end_batch(self);
+}
+
+static void cad_manager_finalize(GObject *object)
+{
+    GObjectClass *parent_class = G_OBJECT_CLASS(cad_manager_parent_class);
+    CadManager *self = CAD_MANAGER(object);
+
+    g_clear_handle_id(&self->batch_timeout_id, g_source_remove);
+    g_clear_pointer(&self->state, g_variant_unref);
+
+    parent_class->finalize(object);
 }
 
 static void cad_manager_class_init(CadManagerClass *klass)
 {
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+    object_class->finalize = cad_manager_finalize;
 }
 
 static void cad_manager_init(CadManager *self)
 {
+    self->output = CAD_OUTPUT_UNKNOWN;
+
+    g_signal_connect(self, "notify::audio-mode",
+                     G_CALLBACK(state_property_changed_cb), NULL);
+    g_signal_connect(self, "notify::speaker-state",
+                     G_CALLBACK(state_property_changed_cb), NULL);
+    g_signal_connect(self, "notify::mic-state",
+                     G_CALLBACK(state_property_changed_cb), NULL);
+    g_signal_connect(self, "notify::volume",
+                     G_CALLBACK(state_property_changed_cb), NULL);
+
+    cad_operation_set_activity_func(operations_activity_cb, self);
 }
 
 CadManager *cad_manager_get_default(void)
@@ -192,3 +503,26 @@ CadManager *cad_manager_get_default(void)
 
     return manager;
 }
+
+/**
+ * cad_manager_update_state:
+ * @self: the manager
+ *
+ * Refresh the "State" property from the backend. Its generation counter is
+ * incremented only if something actually changed, so clients can compare
+ * generations to know whether two snapshots are identical.
+ *
+ * While operations are in flight, the refresh is deferred until the last one
+ * completes.
+ */
+void cad_manager_update_state(CadManager *self)
+{
+    /* Operations in flight: wait until they're all done */
+    if (self->batching) {
+        self->state_dirty = TRUE;
+        self->n_deferred_updates++;
+        return;
+    }
+
+    refresh_state(self);
+}
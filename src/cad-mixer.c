@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-mixer"
+
+#include "cad-config.h"
+#include "cad-mixer.h"
+
+#include <alsa/asoundlib.h>
+
+#include <stdlib.h>
+
+/*
+ * Muting the PulseAudio source doesn't affect audio paths which don't go
+ * through it, such as the modem uplink on many devices. When configured, the
+ * relevant ALSA mixer switches are toggled as well, synchronously: this only
+ * takes a few ioctls, so the microphone is muted by the time we return.
+ *
+ * The mixer is opened on first use and kept open afterwards.
+ */
+static snd_mixer_t *mixer;
+static GPtrArray *mute_elems;
+static gboolean mixer_failed;
+
+static guint64 n_mutes;
+static gint64 last_mute_duration;
+
+static snd_mixer_elem_t *find_elem(const gchar *control)
+{
+    g_auto(GStrv) parts = g_strsplit(control, ",", 2);
+    snd_mixer_selem_id_t *sid;
+    snd_mixer_elem_t *elem;
+
+    if (snd_mixer_selem_id_malloc(&sid) < 0)
+        return NULL;
+
+    snd_mixer_selem_id_set_name(sid, g_strstrip(parts[0]));
+    snd_mixer_selem_id_set_index(sid, parts[1] ? atoi(parts[1]) : 0);
+
+    elem = snd_mixer_find_selem(mixer, sid);
+    snd_mixer_selem_id_free(sid);
+
+    return elem;
+}
+
+static gboolean mixer_open(void)
+{
+    const gchar * const *controls = cad_config_get_mixer_mute_controls();
+    const gchar *card = cad_config_get_mixer_card();
+    int err;
+    guint i;
+
+    if (mixer)
+        return TRUE;
+    if (!controls || mixer_failed)
+        return FALSE;
+
+    /* Don't retry on every request if the configuration is wrong */
+    mixer_failed = TRUE;
+
+    err = snd_mixer_open(&mixer, 0);
+    if (err < 0) {
+        g_warning("Unable to open mixer: %s", snd_strerror(err));
+        return FALSE;
+    }
+
+    if ((err = snd_mixer_attach(mixer, card)) < 0 ||
+        (err = snd_mixer_selem_register(mixer, NULL, NULL)) < 0 ||
+        (err = snd_mixer_load(mixer)) < 0) {
+        g_warning("Unable to load mixer '%s': %s", card, snd_strerror(err));
+        snd_mixer_close(mixer);
+        mixer = NULL;
+        return FALSE;
+    }
+
+    mute_elems = g_ptr_array_new();
+
+    for (i = 0; controls[i]; i++) {
+        snd_mixer_elem_t *elem = find_elem(controls[i]);
+
+        if (!elem) {
+            g_warning("Mixer control '%s' not found on '%s'", controls[i], card);
+            continue;
+        }
+
+        if (!snd_mixer_selem_has_capture_switch(elem) &&
+            !snd_mixer_selem_has_playback_switch(elem)) {
+            g_warning("Mixer control '%s' has no switch", controls[i]);
+            continue;
+        }
+
+        g_debug("using mixer control '%s' for mic mute", controls[i]);
+        g_ptr_array_add(mute_elems, elem);
+    }
+
+    mixer_failed = FALSE;
+    return TRUE;
+}
+
+/**
+ * cad_mixer_set_mic_mute:
+ * @mute: %TRUE to mute the microphone, or %FALSE to unmute it
+ *
+ * Switch the configured mixer controls off (or back on).
+ *
+ * Returns: %TRUE if at least one control was switched, %FALSE if none is
+ * configured or all of them failed.
+ */
+gboolean cad_mixer_set_mic_mute(gboolean mute)
+{
+    gboolean done = FALSE;
+    gint64 start;
+    guint i;
+
+    if (!mixer_open())
+        return FALSE;
+
+    start = g_get_monotonic_time();
+
+    for (i = 0; i < mute_elems->len; i++) {
+        snd_mixer_elem_t *elem = g_ptr_array_index(mute_elems, i);
+        int err;
+
+        if (snd_mixer_selem_has_capture_switch(elem))
+            err = snd_mixer_selem_set_capture_switch_all(elem, !mute);
+        else
+            err = snd_mixer_selem_set_playback_switch_all(elem, !mute);
+
+        if (err < 0) {
+            g_warning("Unable to %s mixer control '%s': %s", mute ? "mute" : "unmute",
+                      snd_mixer_selem_get_name(elem), snd_strerror(err));
+            continue;
+        }
+
+        done = TRUE;
+    }
+
+    last_mute_duration = g_get_monotonic_time() - start;
+    n_mutes++;
+
+    g_debug("mixer controls %s in %" G_GINT64_FORMAT " usec",
+            mute ? "muted" : "unmuted", last_mute_duration);
+
+    return done;
+}
+
+void cad_mixer_close(void)
+{
+    g_clear_pointer(&mute_elems, g_ptr_array_unref);
+    g_clear_pointer(&mixer, snd_mixer_close);
+}
+
+void cad_mixer_add_statistics(GVariantDict *dict)
+{
+    g_variant_dict_insert(dict, "mixer-mute-controls", "u",
+                          mute_elems ? mute_elems->len : 0);
+    g_variant_dict_insert(dict, "mixer-mutes", "t", n_mutes);
+    g_variant_dict_insert(dict, "mixer-last-mute-usec", "t", (guint64)last_mute_duration);
+}
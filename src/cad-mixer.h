@@ -0,0 +1,18 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean cad_mixer_set_mic_mute(gboolean mute);
+void cad_mixer_close(void);
+
+void cad_mixer_add_statistics(GVariantDict *dict);
+
+G_END_DECLS
@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-objects"
+
+#include "callaudiod.h"
+#include "cad-objects.h"
+
+#include "callaudio-dbus.h"
+
+/*
+ * Clients offering a choice of outputs need to know which cards and ports
+ * exist, which ones are available and which one is in use. Rather than having
+ * each of them talk to the sound server, the backends publish their view
+ * here as an object tree:
+ *
+ *   /org/mobian_project/CallAudio/cardN            (CallAudio.Card)
+ *   /org/mobian_project/CallAudio/cardN/routeM     (CallAudio.Route)
+ *
+ * Backends report every route they know about whenever they get fresh
+ * information; objects are only created or removed when routes come and go,
+ * and properties only notified when their value actually changed.
+ */
+typedef struct {
+    GDBusObjectSkeleton *object;
+    CallAudioDbusCallAudioRoute *route;
+    CadRouteDirection direction;
+} CadRouteObject;
+
+typedef struct {
+    GDBusObjectSkeleton *object;
+    CallAudioDbusCallAudioCard *card;
+    GHashTable *routes;
+    gchar *active[2];
+    guint next_route;
+} CadCardObject;
+
+static GDBusObjectManagerServer *server;
+static GHashTable *cards;
+
+static guint64 n_objects_added;
+static guint64 n_objects_removed;
+static guint64 n_updates;
+
+static void route_object_free(CadRouteObject *entry)
+{
+    const gchar *path = g_dbus_object_get_object_path(G_DBUS_OBJECT(entry->object));
+
+    g_dbus_object_manager_server_unexport(server, path);
+    n_objects_removed++;
+
+    g_object_unref(entry->route);
+    g_object_unref(entry->object);
+    g_free(entry);
+}
+
+static void card_object_free(CadCardObject *entry)
+{
+    const gchar *path = g_dbus_object_get_object_path(G_DBUS_OBJECT(entry->object));
+
+    /* Routes go first, clients may not expect orphans */
+    g_hash_table_destroy(entry->routes);
+
+    g_dbus_object_manager_server_unexport(server, path);
+    n_objects_removed++;
+
+    g_free(entry->active[CAD_ROUTE_OUTPUT]);
+    g_free(entry->active[CAD_ROUTE_INPUT]);
+    g_object_unref(entry->card);
+    g_object_unref(entry->object);
+    g_free(entry);
+}
+
+static void ensure_server(void)
+{
+    if (server)
+        return;
+
+    server = g_dbus_object_manager_server_new(CALLAUDIO_DBUS_PATH);
+    cards = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                  (GDestroyNotify)card_object_free);
+}
+
+static CadCardObject *lookup_card(guint card)
+{
+    if (!cards)
+        return NULL;
+
+    return g_hash_table_lookup(cards, GUINT_TO_POINTER(card));
+}
+
+/**
+ * cad_objects_export:
+ * @connection: the connection to export the object tree on
+ *
+ * Export the object manager and all known objects on @connection. Objects
+ * added later on are exported as soon as they are known.
+ */
+void cad_objects_export(GDBusConnection *connection)
+{
+    ensure_server();
+    g_dbus_object_manager_server_set_connection(server, connection);
+}
+
+/**
+ * cad_objects_clear:
+ *
+ * Remove all objects, f.e. when the connection to the sound server is lost
+ * and its objects will be enumerated again.
+ */
+void cad_objects_clear(void)
+{
+    if (cards)
+        g_hash_table_remove_all(cards);
+}
+
+/**
+ * cad_objects_set_card:
+ * @card: backend-specific index of the card
+ * @name: name of the card
+ * @profile: (nullable): active profile of the card
+ *
+ * Create the object for @card if needed, and update its properties.
+ */
+void cad_objects_set_card(guint card, const gchar *name, const gchar *profile)
+{
+    CadCardObject *entry;
+
+    g_return_if_fail(name != NULL);
+
+    ensure_server();
+
+    if (!profile)
+        profile = "";
+
+    entry = lookup_card(card);
+    if (!entry) {
+        g_autofree gchar *path = g_strdup_printf(CALLAUDIO_DBUS_PATH "/card%u", card);
+
+        entry = g_new0(CadCardObject, 1);
+        entry->object = g_dbus_object_skeleton_new(path);
+        entry->card = call_audio_dbus_call_audio_card_skeleton_new();
+        entry->routes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify)route_object_free);
+
+        call_audio_dbus_call_audio_card_set_name(entry->card, name);
+        call_audio_dbus_call_audio_card_set_profile(entry->card, profile);
+        g_dbus_object_skeleton_add_interface(entry->object,
+                                             G_DBUS_INTERFACE_SKELETON(entry->card));
+        g_dbus_object_manager_server_export(server, entry->object);
+        g_hash_table_insert(cards, GUINT_TO_POINTER(card), entry);
+        n_objects_added++;
+
+        g_debug("exported card '%s' at '%s'", name, path);
+        return;
+    }
+
+    if (g_strcmp0(call_audio_dbus_call_audio_card_get_name(entry->card), name) == 0 &&
+        g_strcmp0(call_audio_dbus_call_audio_card_get_profile(entry->card), profile) == 0)
+        return;
+
+    call_audio_dbus_call_audio_card_set_name(entry->card, name);
+    call_audio_dbus_call_audio_card_set_profile(entry->card, profile);
+    n_updates++;
+}
+
+/**
+ * cad_objects_remove_card:
+ * @card: backend-specific index of the card
+ *
+ * Remove the object of @card along with all its routes.
+ */
+void cad_objects_remove_card(guint card)
+{
+    if (cards)
+        g_hash_table_remove(cards, GUINT_TO_POINTER(card));
+}
+
+/**
+ * cad_objects_set_route:
+ * @card: index of the card the route belongs to
+ * @direction: whether the route is an output or an input
+ * @name: name of the port or device
+ * @description: (nullable): human-readable description of the route
+ * @available: whether the route can currently be used
+ * @priority: priority of the route
+ *
+ * Create the object for the route if needed, and update its properties.
+ * Routes of unknown cards are ignored.
+ */
+void cad_objects_set_route(guint card, CadRouteDirection direction,
+                           const gchar *name, const gchar *description,
+                           gboolean available, guint priority)
+{
+    CadCardObject *card_entry = lookup_card(card);
+    CadRouteObject *entry;
+    g_autofree gchar *key = NULL;
+    gboolean active;
+
+    g_return_if_fail(name != NULL);
+
+    if (!card_entry)
+        return;
+
+    if (!description)
+        description = "";
+    available = !!available;
+    active = g_strcmp0(card_entry->active[direction], name) == 0;
+
+    key = g_strdup_printf("%u:%s", direction, name);
+    entry = g_hash_table_lookup(card_entry->routes, key);
+    if (!entry) {
+        const gchar *card_path = g_dbus_object_get_object_path(G_DBUS_OBJECT(card_entry->object));
+        g_autofree gchar *path = g_strdup_printf("%s/route%u", card_path,
+                                                 card_entry->next_route++);
+
+        entry = g_new0(CadRouteObject, 1);
+        entry->object = g_dbus_object_skeleton_new(path);
+        entry->route = call_audio_dbus_call_audio_route_skeleton_new();
+        entry->direction = direction;
+
+        call_audio_dbus_call_audio_route_set_name(entry->route, name);
+        call_audio_dbus_call_audio_route_set_description(entry->route, description);
+        call_audio_dbus_call_audio_route_set_card(entry->route, card_path);
+        call_audio_dbus_call_audio_route_set_direction(entry->route, direction);
+        call_audio_dbus_call_audio_route_set_available(entry->route, available);
+        call_audio_dbus_call_audio_route_set_active(entry->route, active);
+        call_audio_dbus_call_audio_route_set_priority(entry->route, priority);
+        g_dbus_object_skeleton_add_interface(entry->object,
+                                             G_DBUS_INTERFACE_SKELETON(entry->route));
+        g_dbus_object_manager_server_export(server, entry->object);
+        g_hash_table_insert(card_entry->routes, g_steal_pointer(&key), entry);
+        n_objects_added++;
+        return;
+    }
+
+    if (g_strcmp0(call_audio_dbus_call_audio_route_get_description(entry->route), description) == 0 &&
+        call_audio_dbus_call_audio_route_get_available(entry->route) == available &&
+        call_audio_dbus_call_audio_route_get_active(entry->route) == active &&
+        call_audio_dbus_call_audio_route_get_priority(entry->route) == priority)
+        return;
+
+    call_audio_dbus_call_audio_route_set_description(entry->route, description);
+    call_audio_dbus_call_audio_route_set_available(entry->route, available);
+    call_audio_dbus_call_audio_route_set_active(entry->route, active);
+    call_audio_dbus_call_audio_route_set_priority(entry->route, priority);
+    n_updates++;
+}
+
+/**
+ * cad_objects_remove_route:
+ * @card: index of the card the route belongs to
+ * @direction: direction of the route
+ * @name: name of the port or device
+ *
+ * Remove a single route which isn't available anymore.
+ */
+void cad_objects_remove_route(guint card, CadRouteDirection direction,
+                              const gchar *name)
+{
+    CadCardObject *card_entry = lookup_card(card);
+    g_autofree gchar *key = NULL;
+
+    if (!card_entry)
+        return;
+
+    key = g_strdup_printf("%u:%s", direction, name);
+    g_hash_table_remove(card_entry->routes, key);
+}
+
+static gboolean route_has_direction(gpointer key, gpointer value, gpointer data)
+{
+    CadRouteObject *entry = value;
+
+    return entry->direction == GPOINTER_TO_UINT(data);
+}
+
+/**
+ * cad_objects_remove_routes:
+ * @card: index of the card the routes belong to
+ * @direction: direction of the routes to remove
+ *
+ * Remove all routes of @card in @direction, f.e. when its sink goes away.
+ */
+void cad_objects_remove_routes(guint card, CadRouteDirection direction)
+{
+    CadCardObject *card_entry = lookup_card(card);
+
+    if (!card_entry)
+        return;
+
+    g_hash_table_foreach_remove(card_entry->routes, route_has_direction,
+                                GUINT_TO_POINTER(direction));
+}
+
+/**
+ * cad_objects_set_active_route:
+ * @card: index of the card the route belongs to
+ * @direction: direction of the route
+ * @name: (nullable): name of the active route, %NULL if none
+ *
+ * Mark @name as the active route in @direction, and all others as inactive.
+ * This may be called before the route itself is known.
+ */
+void cad_objects_set_active_route(guint card, CadRouteDirection direction,
+                                  const gchar *name)
+{
+    CadCardObject *card_entry = lookup_card(card);
+    GHashTableIter iter;
+    gpointer value;
+
+    if (!card_entry || g_strcmp0(card_entry->active[direction], name) == 0)
+        return;
+
+    g_free(card_entry->active[direction]);
+    card_entry->active[direction] = g_strdup(name);
+
+    g_hash_table_iter_init(&iter, card_entry->routes);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        CadRouteObject *entry = value;
+        const gchar *route_name;
+        gboolean active;
+
+        if (entry->direction != direction)
+            continue;
+
+        route_name = call_audio_dbus_call_audio_route_get_name(entry->route);
+        active = g_strcmp0(route_name, name) == 0;
+        if (call_audio_dbus_call_audio_route_get_active(entry->route) != active) {
+            call_audio_dbus_call_audio_route_set_active(entry->route, active);
+            n_updates++;
+        }
+    }
+}
+
+void cad_objects_add_statistics(GVariantDict *dict)
+{
+    g_variant_dict_insert(dict, "objects-added", "t", n_objects_added);
+    g_variant_dict_insert(dict, "objects-removed", "t", n_objects_removed);
+    g_variant_dict_insert(dict, "objects-updates", "t", n_updates);
+}
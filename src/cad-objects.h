@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * CadRouteDirection:
+ * @CAD_ROUTE_OUTPUT: Sink port or playback device
+ * @CAD_ROUTE_INPUT: Source port or capture device
+ *
+ * Direction of an exported route, matching its Direction property.
+ */
+typedef enum {
+    CAD_ROUTE_OUTPUT = 0,
+    CAD_ROUTE_INPUT,
+} CadRouteDirection;
+
+void cad_objects_export(GDBusConnection *connection);
+void cad_objects_clear(void);
+
+void cad_objects_set_card(guint card, const gchar *name, const gchar *profile);
+void cad_objects_remove_card(guint card);
+
+void cad_objects_set_route(guint card, CadRouteDirection direction,
+                           const gchar *name, const gchar *description,
+                           gboolean available, guint priority);
+void cad_objects_remove_route(guint card, CadRouteDirection direction,
+                              const gchar *name);
+void cad_objects_remove_routes(guint card, CadRouteDirection direction);
+void cad_objects_set_active_route(guint card, CadRouteDirection direction,
+                                  const gchar *name);
+
+void cad_objects_add_statistics(GVariantDict *dict);
+
+G_END_DECLS
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-operation"
+
+#include "cad-events.h"
+#include "cad-operation.h"
+
+#include <string.h>
+
+/*
+ * A single request rarely needs more than 3 operations (SelectMode spawns an
+ * implicit unmute and speaker-off), so this is enough for several concurrent
+ * clients. Should the pool run dry, we fall back to heap allocations.
+ */
+#define CAD_OPERATION_POOL_SIZE 16
+
+#define N_OPERATION_TYPES (CAD_OPERATION_SELECT_OUTPUT + 1)
+
+static CadOperation pool[CAD_OPERATION_POOL_SIZE];
+static CadOperation *free_slots[CAD_OPERATION_POOL_SIZE];
+static guint n_free_slots;
+static gboolean pool_initialized;
+
+static guint64 n_pooled;
+static guint64 n_allocated;
+static guint n_alive;
+static guint64 n_superseded;
+static guint64 n_invocations;
+static guint64 n_invocations_answered;
+
+static guint64 generations[N_OPERATION_TYPES];
+static guint n_pending[N_OPERATION_TYPES];
+static guint n_in_flight;
+
+static CadOperationActivityFunc activity_func;
+static gpointer activity_data;
+
+static void pool_init(void)
+{
+    guint i;
+
+    for (i = 0; i < CAD_OPERATION_POOL_SIZE; i++)
+        free_slots[i] = &pool[CAD_OPERATION_POOL_SIZE - 1 - i];
+
+    n_free_slots = CAD_OPERATION_POOL_SIZE;
+    pool_initialized = TRUE;
+}
+
+CadOperation *cad_operation_new(CadOperationType type,
+                                CallAudioDbusCallAudio *object,
+                                GDBusMethodInvocation *invocation,
+                                CadOperationCallback callback)
+{
+    CadOperation *op;
+
+    if (!pool_initialized)
+        pool_init();
+
+    if (n_free_slots > 0) {
+        op = free_slots[--n_free_slots];
+        op->pooled = TRUE;
+        n_pooled++;
+    } else {
+        g_debug("operation pool exhausted, allocating new operation");
+        op = g_new0(CadOperation, 1);
+        op->pooled = FALSE;
+        n_allocated++;
+    }
+
+    op->type = type;
+    op->value = 0;
+    op->object = object;
+    op->invocation = invocation;
+    op->callback = callback;
+    op->backend_callback = NULL;
+    op->success = FALSE;
+    op->superseded = FALSE;
+    /*
+     * Only client requests supersede each other: implicit sub-operations,
+     * f.e. unmuting the mic when leaving a call, mustn't cancel a request
+     * the client is still waiting for.
+     */
+    op->generation = invocation ? ++generations[type] : generations[type];
+    op->start_time = g_get_monotonic_time();
+    op->ref_count = 1;
+    op->completed = FALSE;
+
+    n_alive++;
+    n_pending[type]++;
+    if (invocation)
+        n_invocations++;
+
+    if (n_in_flight++ == 0 && activity_func)
+        activity_func(TRUE, activity_data);
+
+    return op;
+}
+
+CadOperation *cad_operation_ref(CadOperation *op)
+{
+    g_return_val_if_fail(op != NULL, NULL);
+    g_return_val_if_fail(op->ref_count > 0, NULL);
+
+    op->ref_count++;
+
+    return op;
+}
+
+void cad_operation_unref(CadOperation *op)
+{
+    g_return_if_fail(op != NULL);
+    g_return_if_fail(op->ref_count > 0);
+
+    if (--op->ref_count > 0)
+        return;
+
+    /*
+     * Nobody is holding this operation anymore: make sure its invocation
+     * gets an answer, whatever happened along the way.
+     */
+    if (!op->completed) {
+        g_debug("operation %d dropped before completion", op->type);
+        cad_operation_complete(op, FALSE);
+    }
+
+    n_alive--;
+
+    if (op->pooled) {
+        memset(op, 0, sizeof(*op));
+        free_slots[n_free_slots++] = op;
+    } else {
+        g_free(op);
+    }
+}
+
+/**
+ * cad_operation_complete:
+ * @op: the operation
+ * @success: whether the operation succeeded
+ *
+ * Record the operation result and notify its owner. An operation can only be
+ * completed once, subsequent calls are ignored.
+ */
+void cad_operation_complete(CadOperation *op, gboolean success)
+{
+    gint64 duration;
+
+    g_return_if_fail(op != NULL);
+
+    if (op->completed)
+        return;
+
+    op->completed = TRUE;
+    op->success = success;
+    n_pending[op->type]--;
+    if (op->invocation)
+        n_invocations_answered++;
+
+    duration = g_get_monotonic_time() - op->start_time;
+    cad_events_record(CAD_EVENT_COMPLETE, op->type, MIN(duration, G_MAXUINT32),
+                      success ? "success" : op->superseded ? "superseded" : "failure");
+
+    if (op->backend_callback)
+        op->backend_callback(op);
+
+    /*
+     * Let the owner know we're done before answering the last request, so
+     * its side effects are visible by the time the caller gets the answer.
+     */
+    if (--n_in_flight == 0 && activity_func)
+        activity_func(FALSE, activity_data);
+
+    if (op->callback)
+        op->callback(op);
+}
+
+/**
+ * cad_operation_cancel:
+ * @op: the operation
+ *
+ * Complete an operation which has been superseded by a newer one, so its
+ * owner can report it as such rather than as a plain failure.
+ */
+void cad_operation_cancel(CadOperation *op)
+{
+    g_return_if_fail(op != NULL);
+
+    if (op->completed)
+        return;
+
+    n_superseded++;
+    op->superseded = TRUE;
+    cad_operation_complete(op, FALSE);
+}
+
+/**
+ * cad_operation_is_superseded:
+ * @op: the operation
+ *
+ * Returns: %TRUE if another operation of the same type was created after @op.
+ */
+gboolean cad_operation_is_superseded(CadOperation *op)
+{
+    g_return_val_if_fail(op != NULL, FALSE);
+
+    return op->generation != generations[op->type];
+}
+
+/**
+ * cad_operation_has_pending:
+ * @type: the operation type
+ *
+ * Returns: %TRUE if at least one operation of this type hasn't completed yet.
+ */
+gboolean cad_operation_has_pending(CadOperationType type)
+{
+    g_return_val_if_fail(type < N_OPERATION_TYPES, FALSE);
+
+    return n_pending[type] > 0;
+}
+
+/**
+ * cad_operation_set_activity_func:
+ * @func: (nullable): the function to call
+ * @data: user data passed to @func
+ *
+ * Set a function to be called with @busy set to %TRUE when an operation is
+ * created while none was in flight, and with @busy set to %FALSE once the
+ * last operation in flight completes.
+ */
+void cad_operation_set_activity_func(CadOperationActivityFunc func, gpointer data)
+{
+    activity_func = func;
+    activity_data = data;
+}
+
+void cad_operation_add_statistics(GVariantDict *dict)
+{
+    g_variant_dict_insert(dict, "operations-pool-size", "u",
+                          CAD_OPERATION_POOL_SIZE);
+    g_variant_dict_insert(dict, "operations-pooled", "t", n_pooled);
+    g_variant_dict_insert(dict, "operations-allocated", "t", n_allocated);
+    g_variant_dict_insert(dict, "operations-alive", "u", n_alive);
+    g_variant_dict_insert(dict, "operations-superseded", "t", n_superseded);
+    g_variant_dict_insert(dict, "invocations", "t", n_invocations);
+    g_variant_dict_insert(dict, "invocations-outstanding", "t",
+                          n_invocations - n_invocations_answered);
+}
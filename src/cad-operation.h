@@ -14,6 +14,8 @@
  * @CAD_OPERATION_SELECT_MODE: Selecting an audio mode (default mode, voice call mode)
  * @CAD_OPERATION_ENABLE_SPEAKER: Enable or disable the loudspeaker
  * @CAD_OPERATION_MUTE_MIC: Mute or unmute the microphone
+ * @CAD_OPERATION_SET_VOLUME: Set the output volume of the current route
+ * @CAD_OPERATION_SELECT_OUTPUT: Route audio to a given output
  *
  * Enum values to indicate the operation to be performed.
  */
@@ -21,17 +23,57 @@ typedef enum {
     CAD_OPERATION_SELECT_MODE = 0,
     CAD_OPERATION_ENABLE_SPEAKER,
     CAD_OPERATION_MUTE_MIC,
+    CAD_OPERATION_SET_VOLUME,
+    CAD_OPERATION_SELECT_OUTPUT,
 } CadOperationType;
 
 typedef struct _CadOperation CadOperation;
 
 typedef void (*CadOperationCallback)(CadOperation *op);
+typedef void (*CadOperationActivityFunc)(gboolean busy, gpointer data);
 
+/*
+ * Operations are refcounted: whoever keeps a pointer to an operation, be it
+ * the manager or a pending backend request, owns a reference on it. When the
+ * last reference is dropped, the operation is completed (as a failure if
+ * nobody did it before) and returned to the pool.
+ *
+ * Each operation also gets a generation number when created: a newer client
+ * request of the same type supersedes all older operations, which should then
+ * be cancelled at their next processing step without changing the state.
+ * Internal operations (without an invocation) never supersede anything.
+ *
+ * The backend may set @backend_callback to clean up after an operation once
+ * it's over, whatever its outcome: it's called before @callback.
+ */
 struct _CadOperation {
     CadOperationType type;
-    gpointer value;
+    guint value;
     CallAudioDbusCallAudio *object;
     GDBusMethodInvocation *invocation;
     CadOperationCallback callback;
+    CadOperationCallback backend_callback;
     gboolean success;
+    gboolean superseded;
+
+    /*< private >*/
+    guint64 generation;
+    gint64 start_time;
+    gint ref_count;
+    gboolean completed;
+    gboolean pooled;
 };
+
+CadOperation *cad_operation_new(CadOperationType type,
+                                CallAudioDbusCallAudio *object,
+                                GDBusMethodInvocation *invocation,
+                                CadOperationCallback callback);
+CadOperation *cad_operation_ref(CadOperation *op);
+void cad_operation_unref(CadOperation *op);
+void cad_operation_complete(CadOperation *op, gboolean success);
+void cad_operation_cancel(CadOperation *op);
+gboolean cad_operation_is_superseded(CadOperation *op);
+gboolean cad_operation_has_pending(CadOperationType type);
+void cad_operation_set_activity_func(CadOperationActivityFunc func, gpointer data);
+
+void cad_operation_add_statistics(GVariantDict *dict);
@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-output"
+
+#include "cad-output.h"
+#include "config.h"
+
+#include <glib/gstdio.h>
+#include <string.h>
+
+/*
+ * Outputs explicitly selected by the user are remembered per sound card and
+ * audio mode, so the next call on the same device starts on the same output
+ * if it's available. They are stored on disk as a serialized a{ss} dictionary
+ * keyed by "card|mode", the same way route volumes are.
+ */
+#define OUTPUTS_FILE "route-outputs"
+#define OUTPUTS_TYPE "a{ss}"
+#define SAVE_DELAY 2 /* seconds */
+
+static const gchar * const output_names[] = {
+    [CAD_OUTPUT_EARPIECE] = CALL_AUDIO_OUTPUT_EARPIECE,
+    [CAD_OUTPUT_SPEAKER] = CALL_AUDIO_OUTPUT_SPEAKER,
+    [CAD_OUTPUT_HEADSET] = CALL_AUDIO_OUTPUT_HEADSET,
+    [CAD_OUTPUT_BLUETOOTH] = CALL_AUDIO_OUTPUT_BLUETOOTH,
+    [CAD_OUTPUT_USB] = CALL_AUDIO_OUTPUT_USB,
+};
+
+static GHashTable *outputs;
+static guint save_id;
+static guint64 n_saves;
+
+const gchar *cad_output_to_string(CadOutput output)
+{
+    if (output >= CAD_OUTPUT_UNKNOWN)
+        return "";
+
+    return output_names[output];
+}
+
+CadOutput cad_output_from_string(const gchar *name)
+{
+    guint i;
+
+    for (i = 0; i < CAD_OUTPUT_UNKNOWN; i++) {
+        if (g_strcmp0(output_names[i], name) == 0)
+            return i;
+    }
+
+    return CAD_OUTPUT_UNKNOWN;
+}
+
+/**
+ * cad_output_from_port:
+ * @port: (nullable): a sound server port or UCM device name
+ *
+ * Guess which kind of output @port is, from the naming conventions of ALSA
+ * UCM, PulseAudio and the droid modules.
+ *
+ * Returns: the kind of output, or %CAD_OUTPUT_UNKNOWN.
+ */
+CadOutput cad_output_from_port(const gchar *port)
+{
+    g_autofree gchar *lower = NULL;
+
+    if (!port)
+        return CAD_OUTPUT_UNKNOWN;
+
+    lower = g_ascii_strdown(port, -1);
+
+    /* Those may also be headsets, check them first */
+    if (strstr(lower, "bluetooth") || strstr(lower, "a2dp"))
+        return CAD_OUTPUT_BLUETOOTH;
+    if (strstr(lower, "usb"))
+        return CAD_OUTPUT_USB;
+    if (strstr(lower, "headphone") || strstr(lower, "headset"))
+        return CAD_OUTPUT_HEADSET;
+    if (strstr(lower, "earpiece") || strstr(lower, "handset"))
+        return CAD_OUTPUT_EARPIECE;
+    if (strstr(lower, "speaker"))
+        return CAD_OUTPUT_SPEAKER;
+
+    return CAD_OUTPUT_UNKNOWN;
+}
+
+/**
+ * cad_output_list:
+ * @mask: a combination of CAD_OUTPUT_MASK() values
+ *
+ * Returns: (transfer full): the identifiers of the outputs in @mask, in a
+ * stable order.
+ */
+gchar **cad_output_list(guint mask)
+{
+    GPtrArray *list = g_ptr_array_new();
+    guint i;
+
+    for (i = 0; i < CAD_OUTPUT_UNKNOWN; i++) {
+        if (mask & CAD_OUTPUT_MASK(i))
+            g_ptr_array_add(list, g_strdup(output_names[i]));
+    }
+    g_ptr_array_add(list, NULL);
+
+    return (gchar **)g_ptr_array_free(list, FALSE);
+}
+
+static gchar *get_outputs_path(void)
+{
+    return g_build_filename(g_get_user_data_dir(), APP_DATA_NAME, OUTPUTS_FILE, NULL);
+}
+
+static gchar *device_key(const gchar *card, CallAudioMode mode)
+{
+    return g_strdup_printf("%s|%u", card, mode);
+}
+
+static void load_outputs(void)
+{
+    g_autofree gchar *path = get_outputs_path();
+    g_autoptr(GVariant) dict = NULL;
+    g_autoptr(GError) error = NULL;
+    GVariantIter iter;
+    gchar *contents;
+    gsize length;
+    const gchar *key;
+    const gchar *name;
+
+    outputs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    if (!g_file_get_contents(path, &contents, &length, &error)) {
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_warning("Unable to load selected outputs: %s", error->message);
+        return;
+    }
+
+    dict = g_variant_ref_sink(g_variant_new_from_data(G_VARIANT_TYPE(OUTPUTS_TYPE),
+                                                      contents, length, FALSE,
+                                                      g_free, contents));
+
+    g_variant_iter_init(&iter, dict);
+    while (g_variant_iter_next(&iter, "{&s&s}", &key, &name)) {
+        CadOutput output = cad_output_from_string(name);
+
+        /* Skip outputs this version doesn't know about */
+        if (output != CAD_OUTPUT_UNKNOWN)
+            g_hash_table_insert(outputs, g_strdup(key), GUINT_TO_POINTER(output));
+    }
+
+    g_debug("loaded %u selected outputs", g_hash_table_size(outputs));
+}
+
+static GHashTable *get_outputs(void)
+{
+    if (!outputs)
+        load_outputs();
+
+    return outputs;
+}
+
+static gboolean save_outputs(gpointer data)
+{
+    g_autofree gchar *path = get_outputs_path();
+    g_autofree gchar *dir = g_path_get_dirname(path);
+    g_autoptr(GVariant) dict = NULL;
+    g_autoptr(GError) error = NULL;
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    save_id = 0;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE(OUTPUTS_TYPE));
+    g_hash_table_iter_init(&iter, get_outputs());
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        g_variant_builder_add(&builder, "{ss}", key,
+                              cad_output_to_string(GPOINTER_TO_UINT(value)));
+    }
+    dict = g_variant_ref_sink(g_variant_builder_end(&builder));
+
+    if (g_mkdir_with_parents(dir, 0700) < 0) {
+        g_warning("Unable to create '%s'", dir);
+        return G_SOURCE_REMOVE;
+    }
+
+    if (!g_file_set_contents(path, g_variant_get_data(dict),
+                             g_variant_get_size(dict), &error)) {
+        g_warning("Unable to save selected outputs: %s", error->message);
+        return G_SOURCE_REMOVE;
+    }
+
+    n_saves++;
+    g_debug("saved %u selected outputs", g_hash_table_size(outputs));
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * cad_output_lookup:
+ * @card: the sound card name
+ * @mode: the audio mode
+ *
+ * Returns: the output last selected on @card in @mode, or
+ * %CAD_OUTPUT_UNKNOWN if none was.
+ */
+CadOutput cad_output_lookup(const gchar *card, CallAudioMode mode)
+{
+    g_autofree gchar *key = NULL;
+    gpointer value;
+
+    if (!card)
+        return CAD_OUTPUT_UNKNOWN;
+
+    key = device_key(card, mode);
+    if (!g_hash_table_lookup_extended(get_outputs(), key, NULL, &value))
+        return CAD_OUTPUT_UNKNOWN;
+
+    return GPOINTER_TO_UINT(value);
+}
+
+/**
+ * cad_output_store:
+ * @card: the sound card name
+ * @mode: the audio mode
+ * @output: the selected output, or %CAD_OUTPUT_UNKNOWN to forget it
+ *
+ * Remember the output selected on @card in @mode. It is written to disk
+ * shortly afterwards.
+ */
+void cad_output_store(const gchar *card, CallAudioMode mode, CadOutput output)
+{
+    if (!card || mode == CALL_AUDIO_MODE_UNKNOWN)
+        return;
+
+    if (cad_output_lookup(card, mode) == output)
+        return;
+
+    g_debug("remembering output '%s' for '%s' (mode %u)",
+            cad_output_to_string(output), card, mode);
+
+    if (output == CAD_OUTPUT_UNKNOWN) {
+        g_autofree gchar *key = device_key(card, mode);
+
+        g_hash_table_remove(get_outputs(), key);
+    } else {
+        g_hash_table_insert(get_outputs(), device_key(card, mode),
+                            GUINT_TO_POINTER(output));
+    }
+
+    if (!save_id)
+        save_id = g_timeout_add_seconds(SAVE_DELAY, save_outputs, NULL);
+}
+
+/**
+ * cad_output_flush:
+ *
+ * Write pending changes to disk right away, e.g. before exiting.
+ */
+void cad_output_flush(void)
+{
+    if (!save_id)
+        return;
+
+    g_source_remove(save_id);
+    save_outputs(NULL);
+}
+
+void cad_output_add_statistics(GVariantDict *dict)
+{
+    g_variant_dict_insert(dict, "selected-outputs", "u",
+                          outputs ? g_hash_table_size(outputs) : 0);
+    g_variant_dict_insert(dict, "selected-outputs-saves", "t", n_saves);
+}
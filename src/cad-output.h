@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "libcallaudio.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * CadOutput:
+ * @CAD_OUTPUT_EARPIECE: Built-in earpiece
+ * @CAD_OUTPUT_SPEAKER: Built-in loudspeaker
+ * @CAD_OUTPUT_HEADSET: Wired headset or headphones
+ * @CAD_OUTPUT_BLUETOOTH: Bluetooth headset
+ * @CAD_OUTPUT_USB: USB audio device
+ * @CAD_OUTPUT_UNKNOWN: Any other port, which can't be selected explicitly
+ *
+ * The kinds of outputs clients can select, listed in the AvailableOutputs
+ * D-Bus property by their CALL_AUDIO_OUTPUT_* identifier.
+ */
+typedef enum {
+    CAD_OUTPUT_EARPIECE = 0,
+    CAD_OUTPUT_SPEAKER,
+    CAD_OUTPUT_HEADSET,
+    CAD_OUTPUT_BLUETOOTH,
+    CAD_OUTPUT_USB,
+    CAD_OUTPUT_UNKNOWN,
+} CadOutput;
+
+#define CAD_OUTPUT_MASK(output) (1u << (output))
+
+const gchar *cad_output_to_string(CadOutput output);
+CadOutput cad_output_from_string(const gchar *name);
+CadOutput cad_output_from_port(const gchar *port);
+gchar **cad_output_list(guint mask);
+
+CadOutput cad_output_lookup(const gchar *card, CallAudioMode mode);
+void cad_output_store(const gchar *card, CallAudioMode mode, CadOutput output);
+void cad_output_flush(void);
+
+void cad_output_add_statistics(GVariantDict *dict);
+
+G_END_DECLS
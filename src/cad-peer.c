@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-peer"
+
+#include "callaudiod.h"
+#include "cad-peer.h"
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <unistd.h>
+
+/*
+ * Besides the session bus, the manager is exported on a private socket so
+ * latency-sensitive clients can talk to us directly, without going through
+ * the bus daemon. Its address is advertised through the PeerAddress property.
+ */
+
+#define PEER_SOCKET_DIR  "callaudiod"
+#define PEER_SOCKET_NAME "peer"
+
+static GDBusServer *server;
+static GDBusAuthObserver *observer;
+static gchar *socket_path;
+
+static gboolean allow_mechanism_cb(GDBusAuthObserver *observer,
+                                   const gchar *mechanism,
+                                   gpointer user_data)
+{
+    return g_strcmp0(mechanism, "EXTERNAL") == 0;
+}
+
+static gboolean authorize_peer_cb(GDBusAuthObserver *observer,
+                                  GIOStream *stream,
+                                  GCredentials *credentials,
+                                  gpointer user_data)
+{
+    GError *error = NULL;
+    uid_t uid;
+
+    if (!credentials) {
+        g_debug("rejecting peer without credentials");
+        return FALSE;
+    }
+
+    uid = g_credentials_get_unix_user(credentials, &error);
+    if (error) {
+        g_debug("rejecting peer: %s", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    /* Only accept clients from the same user, just like the session bus */
+    return uid == getuid();
+}
+
+static void connection_closed_cb(GDBusConnection *connection,
+                                 gboolean remote_peer_vanished,
+                                 GError *error,
+                                 gpointer user_data)
+{
+    CadManager *manager = user_data;
+
+    g_debug("peer connection closed");
+
+    g_dbus_interface_skeleton_unexport_from_connection(G_DBUS_INTERFACE_SKELETON(manager),
+                                                       connection);
+    g_object_unref(connection);
+}
+
+static gboolean new_connection_cb(GDBusServer *server,
+                                  GDBusConnection *connection,
+                                  gpointer user_data)
+{
+    CadManager *manager = user_data;
+    GError *error = NULL;
+
+    if (!g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(manager),
+                                          connection, CALLAUDIO_DBUS_PATH,
+                                          &error)) {
+        g_warning("Unable to export interface on peer connection: %s",
+                  error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    g_debug("new peer connection");
+
+    g_signal_connect(connection, "closed",
+                     G_CALLBACK(connection_closed_cb), manager);
+    g_object_ref(connection);
+
+    return TRUE;
+}
+
+/**
+ * cad_peer_start:
+ * @manager: the manager to export
+ * @error: return location for error
+ *
+ * Start listening for peer-to-peer connections and advertise the socket
+ * address through the manager's PeerAddress property.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise.
+ */
+gboolean cad_peer_start(CadManager *manager, GError **error)
+{
+    g_autofree gchar *socket_dir = NULL;
+    g_autofree gchar *address = NULL;
+    g_autofree gchar *guid = NULL;
+
+    if (server)
+        return TRUE;
+
+    socket_dir = g_build_filename(g_get_user_runtime_dir(), PEER_SOCKET_DIR, NULL);
+    if (g_mkdir_with_parents(socket_dir, 0700) < 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "Unable to create directory '%s'", socket_dir);
+        return FALSE;
+    }
+
+    /* Remove any stale socket left by a previous instance */
+    socket_path = g_build_filename(socket_dir, PEER_SOCKET_NAME, NULL);
+    g_unlink(socket_path);
+
+    address = g_strdup_printf("unix:path=%s", socket_path);
+    guid = g_dbus_generate_guid();
+
+    observer = g_dbus_auth_observer_new();
+    g_signal_connect(observer, "allow-mechanism",
+                     G_CALLBACK(allow_mechanism_cb), NULL);
+    g_signal_connect(observer, "authorize-authenticated-peer",
+                     G_CALLBACK(authorize_peer_cb), NULL);
+
+    server = g_dbus_server_new_sync(address, G_DBUS_SERVER_FLAGS_NONE, guid,
+                                    observer, NULL, error);
+    if (!server) {
+        g_clear_object(&observer);
+        g_clear_pointer(&socket_path, g_free);
+        return FALSE;
+    }
+
+    g_signal_connect(server, "new-connection",
+                     G_CALLBACK(new_connection_cb), manager);
+    g_dbus_server_start(server);
+
+    g_debug("listening for peer connections on '%s'",
+            g_dbus_server_get_client_address(server));
+
+    call_audio_dbus_call_audio_set_peer_address(CALL_AUDIO_DBUS_CALL_AUDIO(manager),
+                                                g_dbus_server_get_client_address(server));
+
+    return TRUE;
+}
+
+void cad_peer_stop(void)
+{
+    if (!server)
+        return;
+
+    g_dbus_server_stop(server);
+    g_clear_object(&server);
+    g_clear_object(&observer);
+
+    g_unlink(socket_path);
+    g_clear_pointer(&socket_path, g_free);
+}
@@ -0,0 +1,18 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "cad-manager.h"
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+gboolean cad_peer_start(CadManager *manager, GError **error);
+void cad_peer_stop(void);
+
+G_END_DECLS
@@ -7,8 +7,19 @@
 
 #define G_LOG_DOMAIN "callaudiod-pulse"
 
+#include "config.h"
+
+#include "cad-card.h"
+#include "cad-config.h"
+#include "cad-ducking.h"
+#include "cad-events.h"
+#include "cad-jack.h"
 #include "cad-manager.h"
+#include "cad-mixer.h"
+#include "cad-objects.h"
 #include "cad-pulse.h"
+#include "cad-trace.h"
+#include "cad-volume.h"
 
 #include <glib/gi18n.h>
 #include <glib-object.h>
@@ -18,31 +29,69 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #define APPLICATION_NAME "CallAudio"
 #define APPLICATION_ID   "org.mobian-project.CallAudio"
+#define BACKEND_NAME     "pulseaudio"
 
 #define SINK_CLASS "sound"
-#define CARD_BUS_PATH_PREFIX "platform-"
-#define CARD_FORM_FACTOR "internal"
 #define CARD_MODEM_CLASS "modem"
 #define CARD_MODEM_NAME "Modem"
 
-#define WITH_DROID_SUPPORT 1 /* FIXME: wire into meson */
+#define LOOPBACK_MODULE "module-loopback"
+#define LOOPBACK_MARKER "callaudiod.loopback"
+#define LOOPBACK_SETTLE_DELAY 2 /* seconds */
+
+#define EC_MODULE "module-echo-cancel"
+#define EC_SINK_NAME "callaudiod_ec_sink"
+#define EC_SOURCE_NAME "callaudiod_ec_source"
+
+#define DUCK_RAMP_INTERVAL 20 /* milliseconds */
 
 #ifdef WITH_DROID_SUPPORT
-#define DROID_API_NAME "droid-hal"
-#define DROID_PROFILE_HIFI "default"
-#define DROID_PROFILE_VOICECALL "voicecall"
 #define DROID_OUTPUT_PORT_PARKING "output-parking"
-#define DROID_OUTPUT_PORT_SPEAKER "output-speaker"
-#define DROID_OUTPUT_PORT_EARPIECE "output-earpiece"
-#define DROID_OUTPUT_PORT_WIRED_HEADSET "output-wired_headset"
 #define DROID_INPUT_PORT_PARKING "input-parking"
-#define DROID_INPUT_PORT_BUILTIN_MIC "input-builtin_mic"
-#define DROID_INPUT_PORT_WIRED_HEADSET_MIC "input-wired_headset"
 #endif /* WITH_DROID_SUPPORT */
 
+typedef enum {
+    LOOPBACK_DOWNLINK = 0, /* modem source -> sound card */
+    LOOPBACK_UPLINK,       /* sound card -> modem sink */
+    N_LOOPBACKS
+} CadLoopbackDirection;
+
+static const gchar *loopback_names[N_LOOPBACKS] = { "downlink", "uplink" };
+
+typedef struct {
+    /* Modem-side source (downlink) or sink (uplink) */
+    int endpoint_id;
+    gchar *endpoint;
+    pa_sample_spec spec;
+
+    guint32 module_id;
+    gboolean loading;
+
+    pa_usec_t latency;
+    pa_usec_t measuring;
+} CadLoopback;
+
+typedef struct {
+    uint32_t index;
+    /* The stream's own volume and mute state, restored after the call */
+    pa_cvolume volume;
+    gboolean muted;
+    /* What we last set, and how many of our requests are still in flight */
+    pa_cvolume applied;
+    gboolean applied_mute;
+    guint pending;
+} CadDuckedStream;
+
+/* A PA request holding a reference on an operation, see track_request() */
+typedef struct {
+    pa_operation *pa_op;
+    CadOperation *operation;
+} CadRequest;
+
 struct _CadPulse
 {
     GObject parent_instance;
@@ -51,104 +100,316 @@ struct _CadPulse
 
     pa_glib_mainloop  *loop;
     pa_context        *ctx;
+    GArray            *requests;
 
     int card_id;
     int sink_id;
     int source_id;
 
-#ifdef WITH_DROID_SUPPORT
-    gboolean sink_is_droid;
-    gboolean source_is_droid;
-#endif /* WITH_DROID_SUPPORT */
+    gchar *card_name;
+    gchar *sink_name;
+    gchar *source_name;
+    gchar *active_sink_port;
+    gchar *active_source_port;
+
+    const CadCardStrategy *strategy;
 
     gboolean has_voice_profile;
+    /* Optional profiles for the ringing and VoIP modes, NULL if missing */
+    const gchar *ringing_profile;
+    const gchar *voip_profile;
+    /* Card profile while ringing, so answering can skip querying it */
+    gchar *call_plan;
+    guint64 n_answers;
+    guint64 n_prepared_answers;
+    gint64 last_answer_time;
+    /* When ringing was requested, and when the call was answered (or 0) */
+    gint64 ringing_time;
+    gint64 answer_time;
     gchar *speaker_port;
     gchar *earpiece_port;
 
+    /* Output selected by the user for the current mode, see cad-output.c */
+    CadOutput preferred_output;
+    /* CAD_OUTPUT_MASK() of the outputs currently available */
+    guint available_outputs;
+
     GHashTable *sink_ports;
     GHashTable *source_ports;
 
+    /* Whether a call mode (voice or VoIP) is selected, or about to be */
+    gboolean in_call;
+    /* Mode being switched to, CALL_AUDIO_MODE_UNKNOWN if none was requested */
+    CallAudioMode next_mode;
+    /* Whether the modem audio should be bridged, see update_loopbacks() */
+    gboolean bridge_modem;
+
+    int modem_card_id;
+    CadLoopback loopbacks[N_LOOPBACKS];
+    guint loopback_measure_id;
+
+    /* Echo canceller, loaded beforehand and only suspended outside calls */
+    guint32 ec_module_id;
+    gboolean ec_loading;
+    int ec_sink_id;
+    int ec_source_id;
+    gboolean ec_active;
+    gboolean ec_applied;
+    gint64 ec_active_since;
+    guint64 ec_server_cpu_since;
+    guint64 ec_active_time;
+    guint64 ec_server_cpu_time;
+    guint64 ec_loads;
+    gint64 ec_load_since;
+    gint64 ec_load_time;
+    /* Defaults in place before the echo canceller took over, see set_echo_cancel_active() */
+    gboolean ec_defaults_taken;
+    gchar *ec_saved_sink;
+    gchar *ec_saved_source;
+
+    /*
+     * Streams lowered during calls, indexed by sink input so restoring them
+     * only goes through the streams we actually touched
+     */
+    GHashTable *ducked_streams;
+    gboolean ducking;
+    guint duck_ramp_id;
+    guint duck_step;
+    guint duck_steps;
+    guint64 n_ducked_total;
+    /* Tells whether we reconnected to the server our ducked streams live on */
+    uint32_t server_cookie;
+
+    guint64 n_events;
+    guint64 n_events_filtered;
+    guint64 n_jack_switches;
+
+    /* Startup snapshot, see init_pulseaudio_objects() */
+    guint snapshot_pending;
+    gint64 snapshot_start;
+    gboolean ready;
+    gint64 time_to_ready;
+    guint64 n_snapshots;
+
     CallAudioMode audio_mode;
     CallAudioSpeakerState speaker_state;
     CallAudioMicState mic_state;
+
+    pa_cvolume sink_volume;
+    guint volume;
 };
 
 G_DEFINE_TYPE(CadPulse, cad_pulse, G_TYPE_OBJECT);
 
-typedef struct _CadPulseOperation {
-    CadPulse *pulse;
-    CadOperation *op;
-    guint value;
-} CadPulseOperation;
-
-#ifdef WITH_DROID_SUPPORT
 static void set_output_port(pa_context *ctx, const pa_sink_info *info, int eol, void *data);
+static void operation_complete_cb(pa_context *ctx, int success, void *data);
+#ifdef WITH_DROID_SUPPORT
 static void set_input_port(pa_context *ctx, const pa_source_info *info, int eol, void *data);
+static void droid_mode_change_complete_cb(pa_context *ctx, int success, void *data);
+static void droid_output_port_change_complete_cb(pa_context *ctx, int success, void *data);
 #endif /* WITH_DROID_SUPPORT */
 
 static void pulseaudio_cleanup(CadPulse *self);
+static void fail_requests(CadPulse *self);
 static gboolean pulseaudio_connect(CadPulse *self);
 static gboolean init_pulseaudio_objects(CadPulse *self);
+static void snapshot_list_done(CadPulse *self);
+static gboolean process_modem_device(CadPulse *self, CadLoopbackDirection direction,
+                                     uint32_t card, uint32_t index,
+                                     const gchar *name, const pa_sample_spec *spec);
+static void update_loopbacks(CadPulse *self);
+static void update_echo_cancel(CadPulse *self);
+static void forget_echo_cancel(CadPulse *self);
+static void update_call_audio(CadPulse *self);
+static void update_ducking(CadPulse *self);
 
 /******************************************************************************
- * Source management
+ * Card strategies
  *
- * The following functions take care of monitoring and configuring the default
- * source (input)
+ * The following functions pick how to drive the sound card, see cad-card.c
  ******************************************************************************/
 
+/*
+ * Steps following profile and output port switches, see cad_card_get_strategy()
+ */
+static pa_context_success_cb_t get_profile_switched_cb(CadPulse *self)
+{
 #ifdef WITH_DROID_SUPPORT
-static const gchar *get_available_source_port(const pa_source_info *source, const gchar *exclude,
-                                              gboolean source_is_droid)
-#else
-static const gchar *get_available_source_port(const pa_source_info *source, const gchar *exclude)
+    if (self->strategy->park_ports)
+        return droid_mode_change_complete_cb;
 #endif /* WITH_DROID_SUPPORT */
+
+    return operation_complete_cb;
+}
+
+static pa_context_success_cb_t get_output_port_switched_cb(CadPulse *self)
 {
-    /*
-     * get_available_source_port() works a bit differently than get_available_output():
-     *
-     * On droid, the input is chosen between the builtin_mic and the
-     * wired_headset mic if available.
-     *
-     * On native devices the mic with the highest priority gets
-     * chosen.
-    */
+#ifdef WITH_DROID_SUPPORT
+    if (self->strategy->park_ports)
+        return droid_output_port_change_complete_cb;
+#endif /* WITH_DROID_SUPPORT */
 
-    pa_source_port_info *available_port = NULL;
-    guint i;
+    return operation_complete_cb;
+}
 
-    g_debug("looking for available input excluding '%s'", exclude);
+/*
+ * Both the voice call and VoIP modes route audio to the earpiece and need echo
+ * cancellation, only the former involves the modem.
+ */
+static gboolean is_call_mode(guint mode)
+{
+    return mode == CALL_AUDIO_MODE_CALL || mode == CALL_AUDIO_MODE_VOIP;
+}
 
-    for (i = 0; i < source->n_ports; i++) {
-        pa_source_port_info *port = source->ports[i];
+/*
+ * The modem audio is bridged during voice calls, but also while ringing so
+ * the loopbacks are ready by the time the call is answered.
+ */
+static gboolean is_modem_mode(guint mode)
+{
+    return mode == CALL_AUDIO_MODE_CALL || mode == CALL_AUDIO_MODE_RINGING;
+}
 
-        if ((exclude && strcmp(port->name, exclude) == 0) ||
-            port->available == PA_PORT_AVAILABLE_NO) {
-            continue;
-        }
+/*
+ * Keep track of the port we're (about to be) using, so it can be reported in
+ * the manager's state. PA processes requests in order, so recording the
+ * target port when issuing the request is good enough.
+ */
+static void update_active_port(CadPulse *self, gchar **active_port, const gchar *port)
+{
+    if (g_strcmp0(*active_port, port) == 0)
+        return;
 
-#ifdef WITH_DROID_SUPPORT
-        if (source_is_droid) {
-            if (strcmp(port->name, DROID_INPUT_PORT_WIRED_HEADSET_MIC) == 0) {
-                /* wired_headset is the preferred one */
-                available_port = port;
-                break;
-            } else if (strcmp(port->name, DROID_INPUT_PORT_BUILTIN_MIC) == 0) {
-                /* builtin mic */
-                available_port = port;
-            }
-        } else if (!available_port || port->priority > available_port->priority) {
-            available_port = port;
-        }
-#else
-        if (!available_port || port->priority > available_port->priority)
-            available_port = port;
-#endif /* WITH_DROID_SUPPORT */
+    g_free(*active_port);
+    *active_port = g_strdup(port);
+
+    if (active_port == &self->active_sink_port) {
+        cad_events_record(CAD_EVENT_OUTPUT_PORT, self->sink_id, 0, port);
+        cad_objects_set_active_route(self->card_id, CAD_ROUTE_OUTPUT, port);
+    } else {
+        cad_events_record(CAD_EVENT_INPUT_PORT, self->source_id, 0, port);
+        cad_objects_set_active_route(self->card_id, CAD_ROUTE_INPUT, port);
+    }
+
+    cad_manager_update_state(CAD_MANAGER(self->manager));
+}
+
+/******************************************************************************
+ * Volume management
+ *
+ * The following functions take care of remembering the output volume of each
+ * route, and restoring it when switching routes
+ ******************************************************************************/
+
+/* Volumes are exposed over D-Bus in percent of the nominal volume */
+static guint volume_to_percent(pa_volume_t volume)
+{
+    return (guint)(((guint64)volume * 100 + PA_VOLUME_NORM / 2) / PA_VOLUME_NORM);
+}
+
+static pa_volume_t percent_to_volume(guint percent)
+{
+    return (pa_volume_t)((guint64)percent * PA_VOLUME_NORM / 100);
+}
+
+/*
+ * The mode a route belongs to is the one we're switching to, if a mode switch
+ * is in progress. Each mode, ringing and VoIP included, has its own volumes.
+ */
+static CallAudioMode get_route_mode(CadPulse *self)
+{
+    if (self->next_mode != CALL_AUDIO_MODE_UNKNOWN)
+        return self->next_mode;
+    if (self->audio_mode != CALL_AUDIO_MODE_UNKNOWN)
+        return self->audio_mode;
+
+    return self->in_call ? CALL_AUDIO_MODE_CALL : CALL_AUDIO_MODE_DEFAULT;
+}
+
+static void update_volume(CadPulse *self, const pa_cvolume *volume)
+{
+    guint percent;
+
+    self->sink_volume = *volume;
+
+    percent = volume_to_percent(pa_cvolume_max(volume));
+    if (percent != self->volume) {
+        self->volume = percent;
+        g_object_set(self->manager, "volume", percent, NULL);
     }
+}
+
+/*
+ * Restore the volume remembered for the route we're switching to. This must
+ * be called right after issuing the port switch request, so PulseAudio
+ * processes both in a row rather than waiting for the switch to complete.
+ */
+static void apply_route_volume(CadPulse *self, const gchar *port)
+{
+    pa_cvolume volume;
+    guint32 value;
+    pa_operation *op;
+
+    if (self->sink_id < 0 ||
+        !cad_volume_lookup(self->card_name, port, get_route_mode(self), &value))
+        return;
+
+    g_debug("restoring volume %u for port '%s'", value, port);
+
+    /* A single channel volume applies to all channels of the sink */
+    pa_cvolume_set(&volume, MAX(self->sink_volume.channels, 1), value);
+    op = pa_context_set_sink_volume_by_index(self->ctx, self->sink_id, &volume,
+                                             NULL, NULL);
+    if (op)
+        pa_operation_unref(op);
+
+    update_volume(self, &volume);
+}
+
+static void change_sink_volume(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
 
-    if (available_port) {
-        g_debug("found available input '%s'", available_port->name);
-        return available_port->name;
+    if (eol != 0 || !info)
+        return;
+
+    if (info->index != self->sink_id ||
+        pa_cvolume_equal(&info->volume, &self->sink_volume))
+        return;
+
+    update_volume(self, &info->volume);
+
+    /*
+     * While switching routes, we can't tell whether the volume belongs to the
+     * previous route or the new one.
+     */
+    if (cad_operation_has_pending(CAD_OPERATION_SELECT_MODE) ||
+        cad_operation_has_pending(CAD_OPERATION_ENABLE_SPEAKER))
+        return;
+
+    cad_volume_store(self->card_name, self->active_sink_port,
+                     get_route_mode(self), pa_cvolume_max(&info->volume));
+}
+
+/******************************************************************************
+ * Source management
+ *
+ * The following functions take care of monitoring and configuring the default
+ * source (input)
+ ******************************************************************************/
+
+static const gchar *get_available_source_port(CadPulse *self, const pa_source_info *source,
+                                              const gchar *exclude)
+{
+    const gchar *port;
+
+    g_debug("looking for available input excluding '%s'", exclude);
+
+    port = cad_card_find_source_port(self->strategy, source, self->source_ports, exclude);
+
+    if (port) {
+        g_debug("found available input '%s'", port);
+        return port;
     }
 
     g_warning("no available input found!");
@@ -156,11 +417,45 @@ static const gchar *get_available_source_port(const pa_source_info *source, cons
     return NULL;
 }
 
-static void change_source_info(pa_context *ctx, const pa_source_info *info, int eol, void *data)
+/*
+ * Publish the source ports on D-Bus, with our own view of their availability
+ */
+static void publish_source_routes(CadPulse *self, const pa_source_info *info)
+{
+    guint i;
+
+    for (i = 0; i < info->n_ports; i++) {
+        pa_source_port_info *port = info->ports[i];
+        int available = cad_card_get_port_available(self->source_ports, port->name,
+                                                    port->available);
+
+        cad_objects_set_route(self->card_id, CAD_ROUTE_INPUT, port->name,
+                              port->description,
+                              available != PA_PORT_AVAILABLE_NO, port->priority);
+    }
+}
+
+/*
+ * Switch to the best available port, after some of them were (un)plugged
+ */
+static void reconcile_source_port(CadPulse *self, const pa_source_info *info)
 {
-    CadPulse *self = data;
     const gchar *target_port;
     pa_operation *op;
+
+    target_port = get_available_source_port(self, info, NULL);
+    if (target_port) {
+        op = pa_context_set_source_port_by_index(self->ctx, self->source_id,
+                                                 target_port, NULL, NULL);
+        if (op)
+            pa_operation_unref(op);
+        update_active_port(self, &self->active_source_port, target_port);
+    }
+}
+
+static void change_source_info(pa_context *ctx, const pa_source_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
     gboolean change = FALSE;
     guint i;
 
@@ -189,19 +484,22 @@ static void change_source_info(pa_context *ctx, const pa_source_info *info, int
         }
     }
 
-    if (change) {
-#ifdef WITH_DROID_SUPPORT
-        target_port = get_available_source_port(info, NULL, self->source_is_droid);
-#else
-        target_port = get_available_source_port(info, NULL);
-#endif /* WITH_DROID_SUPPORT */
-        if (target_port) {
-            op = pa_context_set_source_port_by_index(ctx, self->source_id,
-                                                   target_port, NULL, NULL);
-            if (op)
-                pa_operation_unref(op);
-        }
-    }
+    publish_source_routes(self, info);
+
+    if (change)
+        reconcile_source_port(self, info);
+}
+
+/* A headset (un)plugged while PA hadn't noticed yet, see jack_changed_cb() */
+static void jack_source_info(pa_context *ctx, const pa_source_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+
+    if (eol != 0 || !info || info->index != self->source_id)
+        return;
+
+    publish_source_routes(self, info);
+    reconcile_source_port(self, info);
 }
 
 static void process_new_source(CadPulse *self, const pa_source_info *info)
@@ -217,12 +515,11 @@ static void process_new_source(CadPulse *self, const pa_source_info *info)
     if (info->card != self->card_id || self->source_id != -1)
         return;
 
-#ifdef WITH_DROID_SUPPORT
-    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_API);
-    self->source_is_droid = (prop && strcmp(prop, DROID_API_NAME) == 0);
-#endif /* WITH_DROID_SUPPORT */
-
     self->source_id = info->index;
+    g_free(self->source_name);
+    self->source_name = g_strdup(info->name);
+    /* Make sure the echo canceller state is applied on top of the new source */
+    self->ec_applied = FALSE;
     if (self->source_ports)
         g_hash_table_destroy(self->source_ports);
     self->source_ports = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
@@ -254,14 +551,25 @@ static void init_source_info(pa_context *ctx, const pa_source_info *info, int eo
         return;
     }
 
+    if (process_modem_device(self, LOOPBACK_DOWNLINK, info->card, info->index,
+                             info->name, &info->sample_spec))
+        return;
+
     process_new_source(self, info);
     if (self->source_id < 0 || self->source_id != info->index)
         return;
 
+    publish_source_routes(self, info);
+
     op = pa_context_set_default_source(ctx, info->name, NULL, NULL);
     if (op)
         pa_operation_unref(op);
 
+    update_echo_cancel(self);
+
+    if (info->active_port)
+        update_active_port(self, &self->active_source_port, info->active_port->name);
+
     if (self->mic_state == CALL_AUDIO_MIC_UNKNOWN) {
         if (info->mute)
             self->mic_state = CALL_AUDIO_MIC_OFF;
@@ -270,16 +578,13 @@ static void init_source_info(pa_context *ctx, const pa_source_info *info, int eo
         g_object_set(self->manager, "mic-state", self->mic_state, NULL);
     }
 
-#ifdef WITH_DROID_SUPPORT
-    target_port = get_available_source_port(info, NULL, self->source_is_droid);
-#else
-    target_port = get_available_source_port(info, NULL);
-#endif /* WITH_DROID_SUPPORT */
+    target_port = get_available_source_port(self, info, NULL);
     if (target_port) {
         op = pa_context_set_source_port_by_index(ctx, self->source_id,
                                                  target_port, NULL, NULL);
         if (op)
             pa_operation_unref(op);
+        update_active_port(self, &self->active_source_port, target_port);
     }
 }
 
@@ -290,60 +595,116 @@ static void init_source_info(pa_context *ctx, const pa_source_info *info, int eo
  * sink (output)
  ******************************************************************************/
 
-#ifdef WITH_DROID_SUPPORT
-static const gchar *get_available_sink_port(const pa_sink_info *sink, const gchar *exclude, gboolean sink_is_droid)
-#else
-static const gchar *get_available_sink_port(const pa_sink_info *sink, const gchar *exclude)
-#endif /* WITH_DROID_SUPPORT */
+static const gchar *get_available_sink_port(CadPulse *self, const pa_sink_info *sink,
+                                            const gchar *exclude)
 {
-    pa_sink_port_info *available_port = NULL;
-    guint i;
+    const gchar *port;
 
     g_debug("looking for available output excluding '%s'", exclude);
 
-    for (i = 0; i < sink->n_ports; i++) {
-        pa_sink_port_info *port = sink->ports[i];
+    port = cad_card_find_sink_port(self->strategy, sink, self->sink_ports, exclude);
 
-        if ((exclude && strcmp(port->name, exclude) == 0) ||
-            port->available == PA_PORT_AVAILABLE_NO) {
-            continue;
-        }
-
-#ifdef WITH_DROID_SUPPORT
-        if (sink_is_droid) {
-            if (strcmp(port->name, DROID_OUTPUT_PORT_WIRED_HEADSET) == 0) {
-                /* wired_headset is the preferred one */
-                available_port = port;
-                break;
-            } else if ((strcmp(port->name, DROID_OUTPUT_PORT_SPEAKER) == 0 || strcmp(port->name, DROID_OUTPUT_PORT_EARPIECE) == 0) &&
-                       (!available_port || port->priority > available_port->priority)) {
-                /* between the built-in speaker and the earpiece the selection should respect the priority */
-                available_port = port;
-            }
-        } else if (!available_port || port->priority > available_port->priority) {
-            available_port = port;
-        }
-#else
-        if (!available_port || port->priority > available_port->priority)
-            available_port = port;
-#endif /* WITH_DROID_SUPPORT */
+    if (port) {
+        g_debug("found available output '%s'", port);
+        return port;
     }
 
-    if (available_port) {
-        g_debug("found available output '%s'", available_port->name);
-        return available_port->name;
+    g_warning("no available output found!");
+
+    return NULL;
+}
+
+/*
+ * Same as get_available_sink_port(), but honouring the output selected by the
+ * user if it's available
+ */
+static const gchar *get_preferred_sink_port(CadPulse *self, const pa_sink_info *sink,
+                                            const gchar *exclude)
+{
+    const gchar *port = NULL;
+
+    if (self->preferred_output != CAD_OUTPUT_UNKNOWN)
+        port = cad_card_find_output_port(sink, self->sink_ports,
+                                         self->preferred_output, exclude);
+    if (port)
+        return port;
+
+    return get_available_sink_port(self, sink, exclude);
+}
+
+static void update_available_outputs(CadPulse *self, guint mask)
+{
+    g_auto(GStrv) outputs = NULL;
+
+    if (self->available_outputs == mask)
+        return;
+
+    self->available_outputs = mask;
+    outputs = cad_output_list(mask);
+    g_object_set(self->manager, "available-outputs", outputs, NULL);
+}
+
+/*
+ * Publish the sink ports on D-Bus, with our own view of their availability
+ */
+static void publish_sink_routes(CadPulse *self, const pa_sink_info *info)
+{
+    guint outputs = 0;
+    guint i;
+
+    for (i = 0; i < info->n_ports; i++) {
+        pa_sink_port_info *port = info->ports[i];
+        int available = cad_card_get_port_available(self->sink_ports, port->name,
+                                                    port->available);
+        CadOutput output = cad_output_from_port(port->name);
+
+        cad_objects_set_route(self->card_id, CAD_ROUTE_OUTPUT, port->name,
+                              port->description,
+                              available != PA_PORT_AVAILABLE_NO, port->priority);
+
+        if (available != PA_PORT_AVAILABLE_NO && output != CAD_OUTPUT_UNKNOWN)
+            outputs |= CAD_OUTPUT_MASK(output);
     }
 
-    g_warning("no available output found!");
+    update_available_outputs(self, outputs);
+}
+
+/*
+ * During calls, stay off the speaker unless it was asked for: f.e. unplugging
+ * a headset must fall back to the earpiece, not the (higher priority) speaker.
+ */
+static const gchar *get_sink_exclude(CadPulse *self)
+{
+    if (self->in_call && self->speaker_state != CALL_AUDIO_SPEAKER_ON &&
+        self->preferred_output != CAD_OUTPUT_SPEAKER)
+        return self->speaker_port;
 
     return NULL;
 }
 
-static void change_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
+/*
+ * Switch to the best available port, after some of them were (un)plugged
+ */
+static void reconcile_sink_port(CadPulse *self, const pa_sink_info *info)
 {
-    CadPulse *self = data;
     const gchar *target_port;
     pa_operation *op;
+
+    /* Keep the output the user selected while it's still there */
+    target_port = get_preferred_sink_port(self, info, get_sink_exclude(self));
+    if (target_port) {
+        op = pa_context_set_sink_port_by_index(self->ctx, self->sink_id,
+                                               target_port, NULL, NULL);
+        if (op)
+            pa_operation_unref(op);
+        apply_route_volume(self, target_port);
+        update_active_port(self, &self->active_sink_port, target_port);
+    }
+}
+
+static void change_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
     gboolean change = FALSE;
     guint i;
 
@@ -372,19 +733,21 @@ static void change_sink_info(pa_context *ctx, const pa_sink_info *info, int eol,
         }
     }
 
-    if (change) {
-#ifdef WITH_DROID_SUPPORT
-        target_port = get_available_sink_port(info, NULL, self->sink_is_droid);
-#else
-        target_port = get_available_sink_port(info, NULL);
-#endif /* WITH_DROID_SUPPORT */
-        if (target_port) {
-            op = pa_context_set_sink_port_by_index(ctx, self->sink_id,
-                                                   target_port, NULL, NULL);
-            if (op)
-                pa_operation_unref(op);
-        }
-    }
+    publish_sink_routes(self, info);
+
+    if (change)
+        reconcile_sink_port(self, info);
+}
+
+static void jack_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+
+    if (eol != 0 || !info || info->index != self->sink_id)
+        return;
+
+    publish_sink_routes(self, info);
+    reconcile_sink_port(self, info);
 }
 
 static void process_new_sink(CadPulse *self, const pa_sink_info *info)
@@ -398,12 +761,10 @@ static void process_new_sink(CadPulse *self, const pa_sink_info *info)
     if (info->card != self->card_id || self->sink_id != -1)
         return;
 
-#ifdef WITH_DROID_SUPPORT
-    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_API);
-    self->sink_is_droid = (prop && strcmp(prop, DROID_API_NAME) == 0);
-#endif /* WITH_DROID_SUPPORT */
-
     self->sink_id = info->index;
+    g_free(self->sink_name);
+    self->sink_name = g_strdup(info->name);
+    self->ec_applied = FALSE;
     if (self->sink_ports)
         g_hash_table_destroy(self->sink_ports);
     self->sink_ports = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
@@ -413,12 +774,7 @@ static void process_new_sink(CadPulse *self, const pa_sink_info *info)
     for (i = 0; i < info->n_ports; i++) {
         pa_sink_port_info *port = info->ports[i];
 
-#ifdef WITH_DROID_SUPPORT
-        if ((self->sink_is_droid && strcmp(port->name, DROID_OUTPUT_PORT_SPEAKER) == 0) ||
-            (!self->sink_is_droid && strstr(port->name, SND_USE_CASE_DEV_SPEAKER) != 0)) {
-#else
-        if (strstr(port->name, SND_USE_CASE_DEV_SPEAKER) != NULL) {
-#endif /* WITH_DROID_SUPPORT */
+        if (cad_card_match_port(self->strategy, self->strategy->speaker_ports, port->name)) {
             if (self->speaker_port) {
                 if (strcmp(port->name, self->speaker_port) != 0) {
                     g_free(self->speaker_port);
@@ -427,7 +783,7 @@ static void process_new_sink(CadPulse *self, const pa_sink_info *info)
             } else {
                 self->speaker_port = g_strdup(port->name);
             }
-        } else if (strstr(port->name, SND_USE_CASE_DEV_EARPIECE) != NULL) {
+        } else if (cad_card_match_port(self->strategy, self->strategy->earpiece_ports, port->name)) {
             if (self->earpiece_port) {
                 if (strcmp(port->name, self->earpiece_port) != 0) {
                     g_free(self->earpiece_port);
@@ -452,6 +808,7 @@ static void process_new_sink(CadPulse *self, const pa_sink_info *info)
 static void init_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
 {
     CadPulse *self = data;
+    const gchar *active_port;
     const gchar *target_port;
     pa_operation *op;
 
@@ -463,20 +820,35 @@ static void init_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, v
         return;
     }
 
+    if (process_modem_device(self, LOOPBACK_UPLINK, info->card, info->index,
+                             info->name, &info->sample_spec))
+        return;
+
     process_new_sink(self, info);
     if (self->sink_id < 0 || self->sink_id != info->index)
         return;
 
+    publish_sink_routes(self, info);
+
+    update_volume(self, &info->volume);
+
     op = pa_context_set_default_sink(ctx, info->name, NULL, NULL);
     if (op)
         pa_operation_unref(op);
 
+    update_echo_cancel(self);
+
+    active_port = info->active_port ? info->active_port->name : NULL;
+    if (active_port)
+        update_active_port(self, &self->active_sink_port, active_port);
+
     if (self->speaker_state == CALL_AUDIO_SPEAKER_UNKNOWN) {
         self->speaker_state = CALL_AUDIO_SPEAKER_OFF;
 
         switch (self->audio_mode) {
         case CALL_AUDIO_MODE_CALL:
-            if (g_strcmp0(info->active_port->name, self->speaker_port) == 0) {
+        case CALL_AUDIO_MODE_VOIP:
+            if (active_port && g_strcmp0(active_port, self->speaker_port) == 0) {
                 self->speaker_state = CALL_AUDIO_SPEAKER_ON;
                 g_object_set(self->manager, "speaker-state", self->speaker_state, NULL);
                 /*
@@ -499,9 +871,12 @@ static void init_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, v
              * Note: this code path is only used when the card doesn't have a
              * voice profile, otherwise things are easier to deal with.
              */
-            if (g_strcmp0(info->active_port->name, self->earpiece_port) == 0) {
+            if (active_port && g_strcmp0(active_port, self->earpiece_port) == 0) {
                 self->audio_mode = CALL_AUDIO_MODE_CALL;
                 g_object_set(self->manager, "audio-mode", self->audio_mode, NULL);
+                self->in_call = TRUE;
+                self->bridge_modem = TRUE;
+                update_call_audio(self);
                 /*
                  * Don't touch routing as we're likely in the middle of a call,
                  * see above.
@@ -510,6 +885,7 @@ static void init_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, v
             } else {
                 self->audio_mode = CALL_AUDIO_MODE_DEFAULT;
                 g_object_set(self->manager, "audio-mode", self->audio_mode, NULL);
+                update_call_audio(self);
             }
             break;
         default:
@@ -519,17 +895,19 @@ static void init_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, v
         g_object_set(self->manager, "speaker-state", self->speaker_state, NULL);
     }
 
-#ifdef WITH_DROID_SUPPORT
-    target_port = get_available_sink_port(info, NULL, self->sink_is_droid);
-#else
-    target_port = get_available_sink_port(info, NULL);
-#endif /* WITH_DROID_SUPPORT */
-    if (target_port) {
+    /*
+     * The sink may be (re)created while switching to a call mode, f.e. when
+     * VoIP mode falls back to the default profile: stay off the speaker then.
+     */
+    target_port = get_preferred_sink_port(self, info, get_sink_exclude(self));
+    if (target_port) {
         g_debug("  Using sink port '%s'", target_port);
         op = pa_context_set_sink_port_by_index(ctx, self->sink_id,
                                                target_port, NULL, NULL);
         if (op)
             pa_operation_unref(op);
+        apply_route_volume(self, target_port);
+        update_active_port(self, &self->active_sink_port, target_port);
     }
 }
 
@@ -540,13 +918,83 @@ static void init_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, v
  * sound card
  ******************************************************************************/
 
-static void init_card_info(pa_context *ctx, const pa_card_info *info, int eol, void *data)
+static gboolean is_modem_card(const pa_card_info *info)
+{
+    const gchar *prop;
+
+    prop = pa_proplist_gets(info->proplist, "alsa.card_name");
+    if (prop && strcmp(prop, CARD_MODEM_NAME) == 0)
+        return TRUE;
+    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_CLASS);
+    if (prop && strcmp(prop, CARD_MODEM_CLASS) == 0)
+        return TRUE;
+
+    return FALSE;
+}
+
+/*
+ * The modem isn't used for routing, but on devices where it is a separate
+ * sound card (e.g. USB modems) we need to bridge its audio to the main card
+ * during calls.
+ */
+static void process_modem_card(CadPulse *self, const pa_card_info *info)
+{
+    if (self->modem_card_id >= 0)
+        return;
+
+    self->modem_card_id = info->index;
+
+    g_debug("MODEM: idx=%u name='%s'", info->index, info->name);
+}
+
+static void modem_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
+{
+    if (eol != 0 || !info)
+        return;
+
+    process_modem_device(data, LOOPBACK_UPLINK, info->card, info->index,
+                         info->name, &info->sample_spec);
+}
+
+static void modem_source_info(pa_context *ctx, const pa_source_info *info, int eol, void *data)
+{
+    if (eol != 0 || !info)
+        return;
+
+    process_modem_device(data, LOOPBACK_DOWNLINK, info->card, info->index,
+                         info->name, &info->sample_spec);
+}
+
+static void new_card_info(pa_context *ctx, const pa_card_info *info, int eol, void *data)
 {
     CadPulse *self = data;
+
     pa_operation *op;
-    const gchar *prop;
-    gboolean has_speaker = FALSE;
-    gboolean has_earpiece = FALSE;
+
+    if (eol != 0 || !info)
+        return;
+
+    if (!is_modem_card(info) || self->modem_card_id >= 0)
+        return;
+
+    process_modem_card(self, info);
+
+    /*
+     * Its sink and source may have been announced before we knew about the
+     * card, and filtered out as unrelated: look them up now.
+     */
+    op = pa_context_get_sink_info_list(ctx, modem_sink_info, self);
+    if (op)
+        pa_operation_unref(op);
+    op = pa_context_get_source_info_list(ctx, modem_source_info, self);
+    if (op)
+        pa_operation_unref(op);
+}
+
+static void init_card_info(pa_context *ctx, const pa_card_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+    const CadCardStrategy *strategy;
     guint i;
 
     if (eol != 0) {
@@ -554,6 +1002,7 @@ static void init_card_info(pa_context *ctx, const pa_card_info *info, int eol, v
             g_critical("No suitable card found, retrying in 3s...");
             g_timeout_add_seconds(3, G_SOURCE_FUNC(init_pulseaudio_objects), self);
         }
+        snapshot_list_done(self);
         return;
     }
 
@@ -562,79 +1011,1042 @@ static void init_card_info(pa_context *ctx, const pa_card_info *info, int eol, v
         return;
     }
 
-    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_BUS_PATH);
-    if (prop && !g_str_has_prefix(prop, CARD_BUS_PATH_PREFIX))
-        return;
-    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_FORM_FACTOR);
-    if (prop && strcmp(prop, CARD_FORM_FACTOR) != 0)
-        return;
-    prop = pa_proplist_gets(info->proplist, "alsa.card_name");
-    if (prop && strcmp(prop, CARD_MODEM_NAME) == 0)
-        return;
-    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_CLASS);
-    if (prop && strcmp(prop, CARD_MODEM_CLASS) == 0)
+    if (is_modem_card(info)) {
+        process_modem_card(self, info);
         return;
-
-    for (i = 0; i < info->n_ports; i++) {
-        pa_card_port_info *port = info->ports[i];
-
-#ifdef WITH_DROID_SUPPORT
-        if (strstr(port->name, DROID_OUTPUT_PORT_SPEAKER) != NULL) {
-            has_speaker = TRUE;
-        } else if (strstr(port->name, DROID_OUTPUT_PORT_EARPIECE) != NULL ||
-                   strstr(port->name, DROID_OUTPUT_PORT_WIRED_HEADSET)  != NULL) {
-            has_earpiece = TRUE;
-        }
-#endif /* WITH_DROID_SUPPORT */
-
-        if (strstr(port->name, SND_USE_CASE_DEV_SPEAKER) != NULL) {
-            has_speaker = TRUE;
-        } else if (strstr(port->name, SND_USE_CASE_DEV_EARPIECE) != NULL ||
-                   strstr(port->name, SND_USE_CASE_DEV_HANDSET)  != NULL) {
-            has_earpiece = TRUE;
-        }
     }
 
-    if (!has_speaker || !has_earpiece) {
+    strategy = cad_card_get_strategy(info);
+    if (!cad_card_is_suitable(strategy, info)) {
         g_message("Card '%s' lacks speaker and/or earpiece port, skipping...",
                   info->name);
         return;
     }
 
     self->card_id = info->index;
+    self->strategy = strategy;
+    g_free(self->card_name);
+    self->card_name = g_strdup(info->name);
+    cad_objects_set_card(info->index, info->name,
+                         info->active_profile2 ? info->active_profile2->name : NULL);
 
-    g_debug("CARD: idx=%u name='%s'", info->index, info->name);
+    g_debug("CARD: idx=%u name='%s' strategy='%s'", info->index, info->name,
+            strategy->name);
+
+    self->ringing_profile = NULL;
+    self->voip_profile = NULL;
 
     for (i = 0; i < info->n_profiles; i++) {
         pa_card_profile_info2 *profile = info->profiles2[i];
 
-#ifdef WITH_DROID_SUPPORT
-        if (strstr(profile->name, SND_USE_CASE_VERB_VOICECALL) != NULL || strstr(profile->name, DROID_PROFILE_VOICECALL) != NULL) {
-#else
-        if (strstr(profile->name, SND_USE_CASE_VERB_VOICECALL) != NULL) {
-#endif /* WITH_DROID_SUPPORT */
+        if (g_strcmp0(profile->name, strategy->ringing_profile) == 0) {
+            self->ringing_profile = strategy->ringing_profile;
+            continue;
+        } else if (g_strcmp0(profile->name, strategy->voip_profile) == 0) {
+            self->voip_profile = strategy->voip_profile;
+            continue;
+        }
+
+        /* Exact match, "Voice Call IP" f.e. is the VoIP verb */
+        if (g_strcmp0(profile->name, strategy->voicecall_profile) == 0) {
             self->has_voice_profile = TRUE;
             if (info->active_profile2 == profile)
                 self->audio_mode = CALL_AUDIO_MODE_CALL;
             else
                 self->audio_mode = CALL_AUDIO_MODE_DEFAULT;
-            break;
         }
     }
 
+    if (self->has_voice_profile && info->active_profile2) {
+        const gchar *active = info->active_profile2->name;
+
+        if (g_strcmp0(active, self->ringing_profile) == 0)
+            self->audio_mode = CALL_AUDIO_MODE_RINGING;
+        else if (g_strcmp0(active, self->voip_profile) == 0)
+            self->audio_mode = CALL_AUDIO_MODE_VOIP;
+    }
+
     // We were able determine the current mode, set the corresponding D-Bus property
-    if (self->audio_mode != CALL_AUDIO_MODE_UNKNOWN)
+    if (self->audio_mode != CALL_AUDIO_MODE_UNKNOWN) {
         g_object_set(self->manager, "audio-mode", self->audio_mode, NULL);
+        self->in_call = is_call_mode(self->audio_mode);
+        self->bridge_modem = is_modem_mode(self->audio_mode);
+    }
+
+    cad_manager_update_state(CAD_MANAGER(self->manager));
+
+    g_debug("CARD:   %s voice profile", self->has_voice_profile ? "has" : "doesn't have");
+    g_debug("CARD:   ringing profile '%s', VoIP profile '%s'",
+            self->ringing_profile, self->voip_profile);
+}
+
+/******************************************************************************
+ * Modem loopback management
+ *
+ * The following functions take care of bridging the modem audio to the sound
+ * card during calls, when both are separate devices
+ ******************************************************************************/
+
+static void loopback_sink_input_info(pa_context *ctx, const pa_sink_input_info *info,
+                                     int eol, void *data)
+{
+    CadPulse *self = data;
+    guint i;
+
+    if (eol != 0 || !info)
+        return;
+
+    for (i = 0; i < N_LOOPBACKS; i++) {
+        if (info->owner_module == self->loopbacks[i].module_id)
+            self->loopbacks[i].measuring += info->buffer_usec + info->sink_usec;
+    }
+}
+
+static void loopback_source_output_info(pa_context *ctx, const pa_source_output_info *info,
+                                        int eol, void *data)
+{
+    CadPulse *self = data;
+    guint i;
+
+    if (eol != 0) {
+        /* Both lists have been processed, in order: we're done measuring */
+        for (i = 0; i < N_LOOPBACKS; i++) {
+            self->loopbacks[i].latency = self->loopbacks[i].measuring;
+            g_debug("%s loopback latency: %" G_GUINT64_FORMAT " usec",
+                    loopback_names[i], (guint64)self->loopbacks[i].latency);
+        }
+        return;
+    }
+
+    if (!info)
+        return;
+
+    for (i = 0; i < N_LOOPBACKS; i++) {
+        if (info->owner_module == self->loopbacks[i].module_id)
+            self->loopbacks[i].measuring += info->buffer_usec + info->source_usec;
+    }
+}
+
+/*
+ * A loopback's latency is the sum of the latencies of its source output
+ * (capture side) and sink input (playback side).
+ */
+static gboolean measure_loopbacks(CadPulse *self)
+{
+    pa_operation *op;
+    guint i;
+
+    self->loopback_measure_id = 0;
+
+    if (!self->ctx)
+        return G_SOURCE_REMOVE;
+
+    for (i = 0; i < N_LOOPBACKS; i++)
+        self->loopbacks[i].measuring = 0;
+
+    op = pa_context_get_sink_input_info_list(self->ctx, loopback_sink_input_info, self);
+    if (op)
+        pa_operation_unref(op);
+    op = pa_context_get_source_output_info_list(self->ctx, loopback_source_output_info, self);
+    if (op)
+        pa_operation_unref(op);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void loopback_loaded_cb(pa_context *ctx, uint32_t idx, void *data)
+{
+    CadPulse *self = cad_pulse_get_default();
+    CadLoopbackDirection direction = GPOINTER_TO_INT(data);
+    CadLoopback *loopback = &self->loopbacks[direction];
+
+    loopback->loading = FALSE;
+
+    if (idx == PA_INVALID_INDEX) {
+        g_warning("Unable to load %s loopback: %s", loopback_names[direction],
+                  pa_strerror(pa_context_errno(ctx)));
+        return;
+    }
+
+    g_debug("%s loopback loaded as module %u", loopback_names[direction], idx);
+    cad_events_record(CAD_EVENT_MODULE, idx, 0, LOOPBACK_MODULE);
+    loopback->module_id = idx;
+
+    /* The call may have ended while the module was loading */
+    update_loopbacks(self);
+
+    /* Let the loopback settle before measuring its actual latency */
+    g_clear_handle_id(&self->loopback_measure_id, g_source_remove);
+    self->loopback_measure_id = g_timeout_add_seconds(LOOPBACK_SETTLE_DELAY,
+                                                      G_SOURCE_FUNC(measure_loopbacks),
+                                                      self);
+}
+
+static void load_loopback(CadPulse *self, CadLoopbackDirection direction)
+{
+    CadLoopback *loopback = &self->loopbacks[direction];
+    const gchar *endpoint_type;
+    g_autofree gchar *args = NULL;
+    pa_operation *op;
+
+    endpoint_type = (direction == LOOPBACK_DOWNLINK) ? "source" : "sink";
+
+    /*
+     * Only the modem side is pinned: the sound card side follows the default
+     * sink/source, so it tracks our routing changes. Running at the modem's
+     * sample rate avoids resampling on the modem side, and properties allow
+     * us to find our loopbacks again if we're restarted.
+     */
+    args = g_strdup_printf("%s=%s %s_dont_move=true latency_msec=%u rate=%u channels=%u "
+                           "sink_input_properties='media.role=phone " LOOPBACK_MARKER "=%s' "
+                           "source_output_properties='media.role=phone " LOOPBACK_MARKER "=%s'",
+                           endpoint_type, loopback->endpoint, endpoint_type,
+                           cad_config_get_loopback_latency_msec(),
+                           loopback->spec.rate, loopback->spec.channels,
+                           loopback_names[direction], loopback_names[direction]);
+
+    g_debug("loading %s loopback: %s", loopback_names[direction], args);
+
+    op = pa_context_load_module(self->ctx, LOOPBACK_MODULE, args,
+                                loopback_loaded_cb, GINT_TO_POINTER(direction));
+    if (op) {
+        loopback->loading = TRUE;
+        pa_operation_unref(op);
+    }
+}
+
+static void unload_loopback(CadPulse *self, CadLoopbackDirection direction)
+{
+    CadLoopback *loopback = &self->loopbacks[direction];
+    pa_operation *op;
+
+    g_debug("unloading %s loopback (module %u)", loopback_names[direction],
+            loopback->module_id);
+
+    op = pa_context_unload_module(self->ctx, loopback->module_id, NULL, NULL);
+    if (op)
+        pa_operation_unref(op);
+
+    loopback->module_id = PA_INVALID_INDEX;
+    loopback->latency = 0;
+}
+
+/*
+ * Load or unload the loopbacks so they match the current mode. While the mode
+ * is still unknown we keep whatever we found at startup.
+ */
+static void update_loopbacks(CadPulse *self)
+{
+    gboolean wanted;
+    guint i;
+
+    if (!self->ctx || !self->ready)
+        return;
+
+    wanted = self->bridge_modem && cad_config_get_loopback_enabled();
+
+    for (i = 0; i < N_LOOPBACKS; i++) {
+        CadLoopback *loopback = &self->loopbacks[i];
+
+        if (wanted && loopback->endpoint && !loopback->loading &&
+            loopback->module_id == PA_INVALID_INDEX) {
+            load_loopback(self, i);
+        } else if (!wanted && self->audio_mode != CALL_AUDIO_MODE_UNKNOWN &&
+                   loopback->module_id != PA_INVALID_INDEX) {
+            unload_loopback(self, i);
+        }
+    }
+}
+
+static gboolean process_modem_device(CadPulse *self, CadLoopbackDirection direction,
+                                     uint32_t card, uint32_t index,
+                                     const gchar *name, const pa_sample_spec *spec)
+{
+    CadLoopback *loopback = &self->loopbacks[direction];
+
+    if (self->modem_card_id < 0 || card != self->modem_card_id)
+        return FALSE;
+
+    /* Skip monitor sources */
+    if (direction == LOOPBACK_DOWNLINK && g_str_has_suffix(name, ".monitor"))
+        return TRUE;
+
+    if (loopback->endpoint_id >= 0)
+        return TRUE;
+
+    loopback->endpoint_id = index;
+    g_free(loopback->endpoint);
+    loopback->endpoint = g_strdup(name);
+    loopback->spec = *spec;
+
+    g_debug("MODEM: %s endpoint idx=%u name='%s' rate=%u channels=%u",
+            loopback_names[direction], index, name, spec->rate, spec->channels);
+
+    update_loopbacks(self);
+
+    return TRUE;
+}
+
+static void forget_modem_device(CadPulse *self, CadLoopbackDirection direction)
+{
+    CadLoopback *loopback = &self->loopbacks[direction];
+
+    if (loopback->endpoint_id < 0)
+        return;
+
+    g_debug("modem %s endpoint %d removed", loopback_names[direction],
+            loopback->endpoint_id);
+
+    /* PulseAudio unloads the loopback along with its sink/source */
+    loopback->endpoint_id = -1;
+    g_clear_pointer(&loopback->endpoint, g_free);
+    loopback->module_id = PA_INVALID_INDEX;
+    loopback->latency = 0;
+}
+
+/******************************************************************************
+ * Echo cancellation management
+ *
+ * The following functions take care of the echo canceller sitting on top of
+ * the default sink and source. It is loaded as soon as those are known, but
+ * kept suspended outside of calls so entering call mode is cheap.
+ ******************************************************************************/
+
+/*
+ * PulseAudio doesn't account CPU usage per module, so we report the CPU time
+ * used by the server while the echo canceller is active as an upper bound.
+ */
+static guint64 get_server_cpu_time(void)
+{
+    g_autofree gchar *pid_file = NULL;
+    g_autofree gchar *stat_file = NULL;
+    g_autofree gchar *contents = NULL;
+    g_auto(GStrv) fields = NULL;
+    const gchar *name_end;
+    guint64 pid;
+    guint64 ticks;
+
+    pid_file = g_build_filename(g_get_user_runtime_dir(), "pulse", "pid", NULL);
+    if (!g_file_get_contents(pid_file, &contents, NULL, NULL))
+        return 0;
+
+    pid = g_ascii_strtoull(contents, NULL, 10);
+    if (pid == 0)
+        return 0;
+
+    g_clear_pointer(&contents, g_free);
+    stat_file = g_strdup_printf("/proc/%" G_GUINT64_FORMAT "/stat", pid);
+    if (!g_file_get_contents(stat_file, &contents, NULL, NULL))
+        return 0;
+
+    /*
+     * The process name may contain spaces: skip it, the following fields
+     * start with the state (3rd field), utime and stime being the 14th and
+     * 15th fields.
+     */
+    name_end = strrchr(contents, ')');
+    if (!name_end || name_end[1] == '\0')
+        return 0;
+
+    fields = g_strsplit(name_end + 2, " ", 14);
+    if (g_strv_length(fields) < 13)
+        return 0;
+
+    ticks = g_ascii_strtoull(fields[11], NULL, 10) +
+            g_ascii_strtoull(fields[12], NULL, 10);
+
+    return ticks * G_USEC_PER_SEC / sysconf(_SC_CLK_TCK);
+}
+
+static void account_echo_cancel(CadPulse *self, guint64 *active_time,
+                                guint64 *server_cpu_time)
+{
+    guint64 cpu_time;
+
+    *active_time = self->ec_active_time;
+    *server_cpu_time = self->ec_server_cpu_time;
+
+    if (!self->ec_active || !self->ec_applied)
+        return;
+
+    *active_time += g_get_monotonic_time() - self->ec_active_since;
+    cpu_time = get_server_cpu_time();
+    if (cpu_time > self->ec_server_cpu_since)
+        *server_cpu_time += cpu_time - self->ec_server_cpu_since;
+}
+
+static void echo_cancel_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+
+    if (eol != 0 || !info)
+        return;
+
+    self->ec_sink_id = info->index;
+    g_debug("EC SINK: idx=%u", info->index);
+}
+
+static void echo_cancel_source_info(pa_context *ctx, const pa_source_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+
+    if (eol != 0 || !info)
+        return;
+
+    self->ec_source_id = info->index;
+    g_debug("EC SOURCE: idx=%u", info->index);
+}
+
+static void lookup_echo_cancel_devices(CadPulse *self)
+{
+    pa_operation *op;
+
+    op = pa_context_get_sink_info_by_name(self->ctx, EC_SINK_NAME,
+                                          echo_cancel_sink_info, self);
+    if (op)
+        pa_operation_unref(op);
+    op = pa_context_get_source_info_by_name(self->ctx, EC_SOURCE_NAME,
+                                            echo_cancel_source_info, self);
+    if (op)
+        pa_operation_unref(op);
+}
+
+static void suspend_echo_cancel(CadPulse *self, gboolean suspend)
+{
+    pa_operation *op;
+
+    op = pa_context_suspend_sink_by_name(self->ctx, EC_SINK_NAME, suspend, NULL, NULL);
+    if (op)
+        pa_operation_unref(op);
+    op = pa_context_suspend_source_by_name(self->ctx, EC_SOURCE_NAME, suspend, NULL, NULL);
+    if (op)
+        pa_operation_unref(op);
+}
+
+/*
+ * When entering call mode, call streams are moved from the sound card to the
+ * echo canceller; when leaving it, everything is moved back to the card.
+ */
+static void echo_cancel_move_sink_input(pa_context *ctx, const pa_sink_input_info *info,
+                                        int eol, void *data)
+{
+    CadPulse *self = data;
+    const gchar *role;
+    pa_operation *op;
+
+    if (eol != 0 || !info)
+        return;
+
+    if (self->ec_active) {
+        role = pa_proplist_gets(info->proplist, PA_PROP_MEDIA_ROLE);
+        if (info->sink != self->sink_id || g_strcmp0(role, "phone") != 0)
+            return;
+        op = pa_context_move_sink_input_by_name(ctx, info->index, EC_SINK_NAME,
+                                                NULL, NULL);
+    } else {
+        if (info->sink != self->ec_sink_id || !self->sink_name)
+            return;
+        op = pa_context_move_sink_input_by_name(ctx, info->index, self->sink_name,
+                                                NULL, NULL);
+    }
+
+    g_debug("EC: moving sink input %u", info->index);
+    if (op)
+        pa_operation_unref(op);
+}
+
+static void echo_cancel_move_source_output(pa_context *ctx, const pa_source_output_info *info,
+                                           int eol, void *data)
+{
+    CadPulse *self = data;
+    const gchar *role;
+    pa_operation *op;
+
+    if (eol != 0) {
+        /* Streams have been moved away, the echo canceller can now sleep */
+        if (!self->ec_active)
+            suspend_echo_cancel(self, TRUE);
+        return;
+    }
+
+    if (!info)
+        return;
+
+    if (self->ec_active) {
+        role = pa_proplist_gets(info->proplist, PA_PROP_MEDIA_ROLE);
+        if (info->source != self->source_id || g_strcmp0(role, "phone") != 0)
+            return;
+        op = pa_context_move_source_output_by_name(ctx, info->index, EC_SOURCE_NAME,
+                                                   NULL, NULL);
+    } else {
+        if (info->source != self->ec_source_id || !self->source_name)
+            return;
+        op = pa_context_move_source_output_by_name(ctx, info->index, self->source_name,
+                                                   NULL, NULL);
+    }
+
+    g_debug("EC: moving source output %u", info->index);
+    if (op)
+        pa_operation_unref(op);
+}
+
+static void echo_cancel_save_defaults(pa_context *ctx, const pa_server_info *info, void *data)
+{
+    CadPulse *self = data;
+
+    if (!info)
+        return;
+
+    /* If the echo canceller was reloaded meanwhile, keep the original defaults */
+    if (!self->ec_saved_sink && g_strcmp0(info->default_sink_name, EC_SINK_NAME) != 0)
+        self->ec_saved_sink = g_strdup(info->default_sink_name);
+    if (!self->ec_saved_source && g_strcmp0(info->default_source_name, EC_SOURCE_NAME) != 0)
+        self->ec_saved_source = g_strdup(info->default_source_name);
+}
+
+/*
+ * The previous default may have gone away during the call: fall back to the
+ * sound card rather than leaving the suspended echo canceller as default.
+ */
+static void echo_cancel_sink_restored(pa_context *ctx, int success, void *data)
+{
+    CadPulse *self = data;
+    pa_operation *op;
+
+    if (success || !self->sink_name)
+        return;
+
+    op = pa_context_set_default_sink(ctx, self->sink_name, NULL, NULL);
+    if (op)
+        pa_operation_unref(op);
+}
+
+static void echo_cancel_source_restored(pa_context *ctx, int success, void *data)
+{
+    CadPulse *self = data;
+    pa_operation *op;
+
+    if (success || !self->source_name)
+        return;
+
+    op = pa_context_set_default_source(ctx, self->source_name, NULL, NULL);
+    if (op)
+        pa_operation_unref(op);
+}
+
+static void echo_cancel_restore_defaults(pa_context *ctx, const pa_server_info *info, void *data)
+{
+    CadPulse *self = data;
+    g_autofree gchar *sink = NULL;
+    g_autofree gchar *source = NULL;
+    pa_operation *op;
+
+    /* Activated again before we got there, the saved defaults still apply */
+    if (!info || self->ec_active)
+        return;
+
+    sink = g_steal_pointer(&self->ec_saved_sink);
+    source = g_steal_pointer(&self->ec_saved_source);
+    if (!sink)
+        sink = g_strdup(self->sink_name);
+    if (!source)
+        source = g_strdup(self->source_name);
+
+    /* Only undo our own change, the user may have picked other defaults since */
+    if (sink && g_strcmp0(info->default_sink_name, EC_SINK_NAME) == 0) {
+        op = pa_context_set_default_sink(ctx, sink, echo_cancel_sink_restored, self);
+        if (op)
+            pa_operation_unref(op);
+    }
+    if (source && g_strcmp0(info->default_source_name, EC_SOURCE_NAME) == 0) {
+        op = pa_context_set_default_source(ctx, source, echo_cancel_source_restored, self);
+        if (op)
+            pa_operation_unref(op);
+    }
+}
+
+/*
+ * New call streams should go through the echo canceller, so it becomes the
+ * default sink and source while active. The previous defaults, f.e. a
+ * Bluetooth headset, are restored when deactivating it; if it was never
+ * made the default, the defaults are left alone.
+ */
+static void set_echo_cancel_active(CadPulse *self, gboolean active)
+{
+    pa_operation *op;
+
+    g_debug("%s echo canceller", active ? "activating" : "deactivating");
+
+    account_echo_cancel(self, &self->ec_active_time, &self->ec_server_cpu_time);
+
+    self->ec_active = active;
+    self->ec_applied = TRUE;
+
+    if (active) {
+        self->ec_active_since = g_get_monotonic_time();
+        self->ec_server_cpu_since = get_server_cpu_time();
+        suspend_echo_cancel(self, FALSE);
+
+        /* Requests are processed in order: this gets the defaults prior to ours */
+        op = pa_context_get_server_info(self->ctx, echo_cancel_save_defaults, self);
+        if (op)
+            pa_operation_unref(op);
+        op = pa_context_set_default_sink(self->ctx, EC_SINK_NAME, NULL, NULL);
+        if (op)
+            pa_operation_unref(op);
+        op = pa_context_set_default_source(self->ctx, EC_SOURCE_NAME, NULL, NULL);
+        if (op)
+            pa_operation_unref(op);
+        self->ec_defaults_taken = TRUE;
+    } else if (self->ec_defaults_taken) {
+        op = pa_context_get_server_info(self->ctx, echo_cancel_restore_defaults, self);
+        if (op)
+            pa_operation_unref(op);
+        self->ec_defaults_taken = FALSE;
+    }
+
+    op = pa_context_get_sink_input_info_list(self->ctx, echo_cancel_move_sink_input, self);
+    if (op)
+        pa_operation_unref(op);
+    op = pa_context_get_source_output_info_list(self->ctx, echo_cancel_move_source_output, self);
+    if (op)
+        pa_operation_unref(op);
+}
+
+static void echo_cancel_loaded_cb(pa_context *ctx, uint32_t idx, void *data)
+{
+    CadPulse *self = data;
+
+    self->ec_loading = FALSE;
+    self->ec_load_time = g_get_monotonic_time() - self->ec_load_since;
+
+    if (idx == PA_INVALID_INDEX) {
+        g_warning("Unable to load echo canceller: %s",
+                  pa_strerror(pa_context_errno(ctx)));
+        return;
+    }
+
+    g_debug("echo canceller loaded as module %u in %" G_GINT64_FORMAT "us",
+            idx, self->ec_load_time);
+    cad_events_record(CAD_EVENT_MODULE, idx, 0, EC_MODULE);
+    self->ec_module_id = idx;
+    self->ec_loads++;
+    self->ec_applied = FALSE;
+
+    lookup_echo_cancel_devices(self);
+    update_echo_cancel(self);
+}
+
+static void load_echo_cancel(CadPulse *self)
+{
+    const gchar *aec_args = cad_config_get_echo_cancel_args();
+    g_autofree gchar *args = NULL;
+    pa_operation *op;
+
+    args = g_strdup_printf("aec_method=%s%s%s%s sink_master=%s source_master=%s "
+                           "sink_name=" EC_SINK_NAME " source_name=" EC_SOURCE_NAME " "
+                           "use_master_format=1",
+                           cad_config_get_echo_cancel_method(),
+                           aec_args ? " aec_args='" : "",
+                           aec_args ? aec_args : "",
+                           aec_args ? "'" : "",
+                           self->sink_name, self->source_name);
+
+    g_debug("loading echo canceller: %s", args);
+
+    self->ec_load_since = g_get_monotonic_time();
+    op = pa_context_load_module(self->ctx, EC_MODULE, args,
+                                echo_cancel_loaded_cb, self);
+    if (op) {
+        self->ec_loading = TRUE;
+        pa_operation_unref(op);
+    }
+}
+
+/*
+ * Load the echo canceller if needed, and (de)activate it so it matches the
+ * current mode. While the mode is still unknown we keep it as we found it.
+ */
+static void update_echo_cancel(CadPulse *self)
+{
+    if (!self->ctx || !self->ready || !cad_config_get_echo_cancel_enabled())
+        return;
+
+    /* F.e. the Android HAL already takes care of echo cancellation */
+    if (!self->strategy->echo_cancel)
+        return;
+
+    if (self->ec_module_id == PA_INVALID_INDEX) {
+        if (!self->ec_loading && self->sink_name && self->source_name)
+            load_echo_cancel(self);
+        return;
+    }
+
+    if (!self->sink_name || !self->source_name)
+        return;
+    /* While the mode is unknown, only undo what we did ourselves */
+    if (self->audio_mode == CALL_AUDIO_MODE_UNKNOWN && !self->in_call &&
+        !(self->ec_applied && self->ec_active))
+        return;
+    if (self->ec_applied && self->ec_active == self->in_call)
+        return;
+
+    set_echo_cancel_active(self, self->in_call);
+}
+
+/*
+ * PulseAudio unloads the echo canceller along with its master sink or source,
+ * we'll load a new one on top of their replacements.
+ *
+ * On cards with a dedicated voice profile (f.e. UCM cards), switching profile
+ * replaces both, so the echo canceller gets reloaded at the start and end of
+ * each call. It can't be loaded beforehand on the voice profile's devices, as
+ * they only exist once the profile is active, nor on other masters since call
+ * streams have to go through the card: the time it takes is reported in the
+ * statistics instead.
+ */
+static void forget_echo_cancel(CadPulse *self)
+{
+    if (self->ec_module_id == PA_INVALID_INDEX)
+        return;
+
+    g_debug("echo canceller module %u gone", self->ec_module_id);
+
+    account_echo_cancel(self, &self->ec_active_time, &self->ec_server_cpu_time);
+
+    self->ec_module_id = PA_INVALID_INDEX;
+    self->ec_sink_id = self->ec_source_id = -1;
+    self->ec_active = FALSE;
+    self->ec_applied = FALSE;
+}
+
+/*
+ * Echo cancellation goes first, so the loopbacks are created on top of it.
+ */
+static void update_call_audio(CadPulse *self)
+{
+    /* Wait until we know about all modules, see init_pulseaudio_objects() */
+    if (!self->ready)
+        return;
+
+    update_echo_cancel(self);
+    update_loopbacks(self);
+    update_ducking(self);
+}
+
+/******************************************************************************
+ * Stream ducking
+ *
+ * The following functions take care of lowering non-call streams during calls,
+ * and restoring them afterwards
+ ******************************************************************************/
+
+static gboolean is_own_module(CadPulse *self, uint32_t module)
+{
+    guint i;
+
+    if (module == PA_INVALID_INDEX)
+        return FALSE;
+    if (module == self->ec_module_id)
+        return TRUE;
+
+    for (i = 0; i < N_LOOPBACKS; i++) {
+        if (module == self->loopbacks[i].module_id)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static gboolean should_duck(CadPulse *self, const pa_sink_input_info *info)
+{
+    if (!cad_ducking_should_duck(info->proplist))
+        return FALSE;
+
+    /* Don't duck the call audio going through our own modules */
+    return !is_own_module(self, info->owner_module);
+}
+
+static void duck_request_cb(pa_context *ctx, int success, void *data)
+{
+    CadPulse *self = cad_pulse_get_default();
+    CadDuckedStream *stream = g_hash_table_lookup(self->ducked_streams, data);
+
+    if (stream && stream->pending > 0)
+        stream->pending--;
+}
+
+/*
+ * Set a stream's volume according to the ramp progress. Streams are muted
+ * once fully ducked if the ducking volume is 0.
+ */
+static void apply_duck_level(CadPulse *self, CadDuckedStream *stream)
+{
+    gdouble target = cad_config_get_ducking_volume() / 100.0;
+    gdouble level;
+    pa_volume_t factor;
+    pa_cvolume volume;
+    gboolean mute;
+    pa_operation *op;
+    guint i;
+
+    level = 1.0 - (1.0 - target) * self->duck_step / self->duck_steps;
+    factor = pa_sw_volume_from_linear(level);
+
+    volume = stream->volume;
+    for (i = 0; i < volume.channels; i++)
+        volume.values[i] = pa_sw_volume_multiply(stream->volume.values[i], factor);
+
+    op = pa_context_set_sink_input_volume(self->ctx, stream->index, &volume,
+                                          duck_request_cb, GUINT_TO_POINTER(stream->index));
+    if (op) {
+        stream->pending++;
+        pa_operation_unref(op);
+    }
+    stream->applied = volume;
+
+    mute = stream->muted || (target == 0 && self->duck_step == self->duck_steps);
+    if (mute != stream->applied_mute) {
+        op = pa_context_set_sink_input_mute(self->ctx, stream->index, mute,
+                                            duck_request_cb, GUINT_TO_POINTER(stream->index));
+        if (op) {
+            stream->pending++;
+            pa_operation_unref(op);
+        }
+        stream->applied_mute = mute;
+    }
+}
+
+static gboolean duck_ramp_cb(CadPulse *self)
+{
+    GHashTableIter iter;
+    CadDuckedStream *stream;
+    gboolean done;
+
+    if (self->ducking)
+        self->duck_step++;
+    else
+        self->duck_step--;
+
+    g_hash_table_iter_init(&iter, self->ducked_streams);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&stream))
+        apply_duck_level(self, stream);
+
+    done = self->ducking ? (self->duck_step == self->duck_steps) : (self->duck_step == 0);
+    if (!done)
+        return G_SOURCE_CONTINUE;
+
+    /* Streams are back to their original volume, forget about them */
+    if (!self->ducking)
+        g_hash_table_remove_all(self->ducked_streams);
+
+    self->duck_ramp_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static void start_duck_ramp(CadPulse *self)
+{
+    if (self->duck_ramp_id || !self->ctx)
+        return;
+
+    if ((self->ducking && self->duck_step == self->duck_steps) ||
+        (!self->ducking && self->duck_step == 0))
+        return;
+
+    self->duck_ramp_id = g_timeout_add(DUCK_RAMP_INTERVAL,
+                                       G_SOURCE_FUNC(duck_ramp_cb), self);
+}
+
+static void duck_sink_input_info(pa_context *ctx, const pa_sink_input_info *info,
+                                 int eol, void *data)
+{
+    CadPulse *self = data;
+    CadDuckedStream *stream;
+
+    if (eol != 0 || !info)
+        return;
+
+    /* The call may have ended in the meantime */
+    if (!self->ducking || !should_duck(self, info))
+        return;
+
+    if (g_hash_table_contains(self->ducked_streams, GUINT_TO_POINTER(info->index)))
+        return;
+
+    g_debug("ducking sink input %u", info->index);
+
+    stream = g_new0(CadDuckedStream, 1);
+    stream->index = info->index;
+    stream->volume = stream->applied = info->volume;
+    stream->muted = stream->applied_mute = !!info->mute;
+    g_hash_table_insert(self->ducked_streams, GUINT_TO_POINTER(info->index), stream);
+    self->n_ducked_total++;
+
+    /* Streams appearing during the ramp catch up with the others right away */
+    if (self->duck_step > 0)
+        apply_duck_level(self, stream);
+}
+
+static void update_ducking(CadPulse *self)
+{
+    gboolean wanted = cad_ducking_is_wanted(get_route_mode(self)) &&
+                      cad_config_get_ducking_enabled();
+    pa_operation *op;
+
+    if (!self->ctx || wanted == self->ducking)
+        return;
+
+    g_debug("%s other streams", wanted ? "ducking" : "restoring");
+
+    self->ducking = wanted;
+    self->duck_steps = MAX(1, cad_config_get_ducking_ramp_msec() / DUCK_RAMP_INTERVAL);
+    self->duck_step = MIN(self->duck_step, self->duck_steps);
+
+    if (wanted) {
+        op = pa_context_get_sink_input_info_list(self->ctx, duck_sink_input_info, self);
+        if (op)
+            pa_operation_unref(op);
+    }
+
+    /* A ramp in progress simply reverses its direction */
+    start_duck_ramp(self);
+}
+
+/* Streams starting during a call are ducked too */
+static void duck_new_sink_input(CadPulse *self, uint32_t idx)
+{
+    pa_operation *op;
+
+    if (!self->ducking)
+        return;
+
+    op = pa_context_get_sink_input_info(self->ctx, idx, duck_sink_input_info, self);
+    if (op)
+        pa_operation_unref(op);
+}
+
+/*
+ * The user changed a ducked stream's volume or mute state during the call:
+ * leave it alone from now on, rather than overwriting their change when
+ * restoring it. Our own mute doesn't outlive the call though.
+ */
+static void duck_sink_input_changed(pa_context *ctx, const pa_sink_input_info *info,
+                                    int eol, void *data)
+{
+    CadPulse *self = data;
+    CadDuckedStream *stream;
+    pa_operation *op;
+
+    if (eol != 0 || !info)
+        return;
+
+    stream = g_hash_table_lookup(self->ducked_streams, GUINT_TO_POINTER(info->index));
+    /* Changes of our own are still on their way, the next event will tell */
+    if (!stream || stream->pending > 0)
+        return;
+
+    if (pa_cvolume_equal(&info->volume, &stream->applied) &&
+        !!info->mute == stream->applied_mute)
+        return;
+
+    g_debug("sink input %u changed by the user, no longer ducking it", info->index);
+
+    if (info->mute && stream->applied_mute && !stream->muted) {
+        op = pa_context_set_sink_input_mute(ctx, info->index, FALSE, NULL, NULL);
+        if (op)
+            pa_operation_unref(op);
+    }
+
+    g_hash_table_remove(self->ducked_streams, GUINT_TO_POINTER(info->index));
+}
+
+static void check_ducked_stream(CadPulse *self, uint32_t idx)
+{
+    pa_operation *op;
+
+    if (!g_hash_table_contains(self->ducked_streams, GUINT_TO_POINTER(idx)))
+        return;
+
+    op = pa_context_get_sink_input_info(self->ctx, idx, duck_sink_input_changed, self);
+    if (op)
+        pa_operation_unref(op);
+}
+
+/*
+ * Put ducked streams back as we found them right away, without a ramp.
+ * Returns the last request issued, if any: as PA processes requests in
+ * order, all of them are done once it is.
+ */
+static pa_operation *restore_ducked_streams(CadPulse *self)
+{
+    GHashTableIter iter;
+    CadDuckedStream *stream;
+    pa_operation *last = NULL;
+    pa_operation *op;
+
+    g_hash_table_iter_init(&iter, self->ducked_streams);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&stream)) {
+        g_debug("restoring sink input %u", stream->index);
+
+        op = pa_context_set_sink_input_volume(self->ctx, stream->index, &stream->volume,
+                                              NULL, NULL);
+        if (op) {
+            if (last)
+                pa_operation_unref(last);
+            last = op;
+        }
+        if (stream->applied_mute == stream->muted)
+            continue;
+
+        op = pa_context_set_sink_input_mute(self->ctx, stream->index, stream->muted,
+                                            NULL, NULL);
+        if (op) {
+            if (last)
+                pa_operation_unref(last);
+            last = op;
+        }
+    }
+
+    g_hash_table_remove_all(self->ducked_streams);
+    g_clear_handle_id(&self->duck_ramp_id, g_source_remove);
+    self->ducking = FALSE;
+    self->duck_step = 0;
+
+    return last;
+}
+
+/*
+ * Module-stream-restore saves the volumes we set, so ducked streams mustn't
+ * be left behind when the connection drops: if it comes back to the same
+ * server, they're restored before being ducked again if still in a call.
+ * On a new server, they're gone along with the old one.
+ */
+static void recover_ducked_streams(pa_context *ctx, const pa_server_info *info, void *data)
+{
+    CadPulse *self = data;
+    gboolean same_server;
+    pa_operation *op;
+
+    if (!info)
+        return;
+
+    same_server = (info->cookie == self->server_cookie);
+    self->server_cookie = info->cookie;
+
+    if (g_hash_table_size(self->ducked_streams) == 0)
+        return;
 
-    g_debug("CARD:   %s voice profile", self->has_voice_profile ? "has" : "doesn't have");
+    if (same_server) {
+        op = restore_ducked_streams(self);
+        if (op)
+            pa_operation_unref(op);
+    } else {
+        g_hash_table_remove_all(self->ducked_streams);
+        self->ducking = FALSE;
+        self->duck_step = 0;
+    }
 
-    /* Found a suitable card, let's prepare the sink/source */
-    op = pa_context_get_sink_info_list(self->ctx, init_sink_info, self);
-    if (op)
-        pa_operation_unref(op);
-    op = pa_context_get_source_info_list(self->ctx, init_source_info, self);
-    if (op)
-        pa_operation_unref(op);
+    update_ducking(self);
 }
 
 /******************************************************************************
@@ -644,12 +2056,52 @@ static void init_card_info(pa_context *ctx, const pa_card_info *info, int eol, v
  * state of PulseAudio objects
  ******************************************************************************/
 
+/*
+ * Called once each list of the startup snapshot is complete: once we have the
+ * full picture, set up everything which depends on several objects at once.
+ */
+static void snapshot_list_done(CadPulse *self)
+{
+    if (self->snapshot_pending == 0 || --self->snapshot_pending > 0)
+        return;
+
+    self->ready = TRUE;
+    self->n_snapshots++;
+    self->time_to_ready = g_get_monotonic_time() - self->snapshot_start;
+
+    g_message("PulseAudio objects initialized in %" G_GINT64_FORMAT " ms",
+              self->time_to_ready / 1000);
+    cad_events_record(CAD_EVENT_SERVER, 0, self->time_to_ready, "initialized");
+
+    update_call_audio(self);
+}
+
+static void snapshot_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
+{
+    if (eol != 0)
+        snapshot_list_done(data);
+    else
+        init_sink_info(ctx, info, eol, data);
+}
+
+static void snapshot_source_info(pa_context *ctx, const pa_source_info *info, int eol, void *data)
+{
+    if (eol != 0)
+        snapshot_list_done(data);
+    else
+        init_source_info(ctx, info, eol, data);
+}
+
 static void init_module_info(pa_context *ctx, const pa_module_info *info, int eol, void *data)
 {
+    CadPulse *self = data;
     pa_operation *op;
+    guint i;
 
-    if (eol != 0)
+    if (eol != 0) {
+        snapshot_list_done(self);
         return;
+    }
 
     if (!info) {
         g_critical("PA returned no module info (eol=%d)", eol);
@@ -663,39 +2115,249 @@ static void init_module_info(pa_context *ctx, const pa_module_info *info, int eo
         op = pa_context_unload_module(ctx, info->index, NULL, NULL);
         if (op)
             pa_operation_unref(op);
+    } else if (strcmp(info->name, LOOPBACK_MODULE) == 0 && info->argument) {
+        /*
+         * We may have been restarted during a call: take over the loopbacks
+         * we previously loaded rather than creating new ones.
+         */
+        for (i = 0; i < N_LOOPBACKS; i++) {
+            g_autofree gchar *marker = g_strdup_printf(LOOPBACK_MARKER "=%s",
+                                                       loopback_names[i]);
+
+            if (strstr(info->argument, marker) != NULL) {
+                g_debug("MODULE: found %s loopback", loopback_names[i]);
+                self->loopbacks[i].module_id = info->index;
+                break;
+            }
+        }
+    } else if (strcmp(info->name, EC_MODULE) == 0 && info->argument &&
+               strstr(info->argument, "sink_name=" EC_SINK_NAME) != NULL) {
+        g_debug("MODULE: found echo canceller");
+        self->ec_module_id = info->index;
+        lookup_echo_cancel_devices(self);
     }
 }
 
 static gboolean init_pulseaudio_objects(CadPulse *self)
 {
     pa_operation *op;
+    guint i;
+
+    /* Everything is about to be enumerated again */
+    cad_objects_clear();
 
     self->card_id = self->sink_id = self->source_id = -1;
-    self->sink_ports = self->source_ports = NULL;
+    g_clear_pointer(&self->sink_ports, g_hash_table_destroy);
+    g_clear_pointer(&self->source_ports, g_hash_table_destroy);
+    self->strategy = cad_card_get_default_strategy();
+
+    self->modem_card_id = -1;
+    for (i = 0; i < N_LOOPBACKS; i++) {
+        self->loopbacks[i].endpoint_id = -1;
+        self->loopbacks[i].module_id = PA_INVALID_INDEX;
+        self->loopbacks[i].loading = FALSE;
+    }
+
+    self->ec_module_id = PA_INVALID_INDEX;
+    self->ec_loading = FALSE;
+    self->ec_sink_id = self->ec_source_id = -1;
+    self->ec_applied = FALSE;
+
+    /*
+     * Fetch everything at once: PA answers requests in order, so modules
+     * and cards are known by the time sinks and sources come in, without
+     * waiting for a round trip between each list.
+     */
+    self->ready = FALSE;
+    self->snapshot_pending = 0;
+    self->snapshot_start = g_get_monotonic_time();
 
+    op = pa_context_get_module_info_list(self->ctx, init_module_info, self);
+    if (op) {
+        self->snapshot_pending++;
+        pa_operation_unref(op);
+    }
     op = pa_context_get_card_info_list(self->ctx, init_card_info, self);
-    if (op)
+    if (op) {
+        self->snapshot_pending++;
         pa_operation_unref(op);
-    op = pa_context_get_module_info_list(self->ctx, init_module_info, self);
-    if (op)
+    }
+    op = pa_context_get_sink_info_list(self->ctx, snapshot_sink_info, self);
+    if (op) {
+        self->snapshot_pending++;
+        pa_operation_unref(op);
+    }
+    op = pa_context_get_source_info_list(self->ctx, snapshot_source_info, self);
+    if (op) {
+        self->snapshot_pending++;
         pa_operation_unref(op);
+    }
+
+    if (self->snapshot_pending == 0)
+        g_critical("Unable to query PulseAudio objects: %s",
+                   pa_strerror(pa_context_errno(self->ctx)));
 
     return G_SOURCE_REMOVE;
 }
 
+static const gchar *get_facility_name(pa_subscription_event_type_t type)
+{
+    switch (type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) {
+    case PA_SUBSCRIPTION_EVENT_SINK:
+        return "sink";
+    case PA_SUBSCRIPTION_EVENT_SOURCE:
+        return "source";
+    case PA_SUBSCRIPTION_EVENT_CARD:
+        return "card";
+    case PA_SUBSCRIPTION_EVENT_SINK_INPUT:
+        return "sink-input";
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * Most objects on the system (monitors, virtual or Bluetooth devices, other
+ * applications' streams...) are of no interest to us. Tell whether an event
+ * may concern one of the objects we track, or one we're still looking for,
+ * so the others are dropped before issuing any request.
+ */
+static gboolean is_relevant_event(CadPulse *self, pa_subscription_event_type_t type,
+                                  uint32_t idx)
+{
+    gboolean is_new = (type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_NEW;
+    gboolean want_modem = self->modem_card_id >= 0;
+    int uplink = self->loopbacks[LOOPBACK_UPLINK].endpoint_id;
+    int downlink = self->loopbacks[LOOPBACK_DOWNLINK].endpoint_id;
+
+    switch (type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) {
+    case PA_SUBSCRIPTION_EVENT_SINK:
+        if (is_new)
+            return self->sink_id < 0 || (want_modem && uplink < 0);
+        return idx == self->sink_id || idx == uplink;
+    case PA_SUBSCRIPTION_EVENT_SOURCE:
+        if (is_new)
+            return self->source_id < 0 || (want_modem && downlink < 0);
+        return idx == self->source_id || idx == downlink;
+    case PA_SUBSCRIPTION_EVENT_CARD:
+        if (is_new)
+            return self->modem_card_id < 0;
+        return idx == self->card_id || idx == self->modem_card_id;
+    case PA_SUBSCRIPTION_EVENT_SINK_INPUT:
+        if (is_new)
+            return self->ducking;
+        return g_hash_table_contains(self->ducked_streams, GUINT_TO_POINTER(idx));
+    default:
+        return FALSE;
+    }
+}
+
+/*
+ * The card changed: publish its new profile, and if ringing, keep the
+ * prepared call plan in sync with it.
+ */
+static void change_card_info(pa_context *ctx, const pa_card_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+
+    if (eol != 0 || !info || info->index != self->card_id)
+        return;
+
+    cad_objects_set_card(info->index, info->name,
+                         info->active_profile2 ? info->active_profile2->name : NULL);
+
+    if (self->call_plan && info->active_profile2) {
+        g_free(self->call_plan);
+        self->call_plan = g_strdup(info->active_profile2->name);
+    }
+}
+
+static gboolean is_jack_port(const gchar *name)
+{
+    g_autofree gchar *lower = g_ascii_strdown(name, -1);
+
+    return strstr(lower, "headphone") != NULL || strstr(lower, "headset") != NULL;
+}
+
+/*
+ * A headset was (un)plugged: record the new availability of the matching
+ * ports and switch right away. The card change PA emits once it notices
+ * the same jack then finds the ports as it expects and does nothing.
+ */
+static void jack_changed_cb(CadJackType type, gboolean plugged, gpointer data)
+{
+    CadPulse *self = data;
+    GHashTable *ports = type == CAD_JACK_OUTPUT ? self->sink_ports : self->source_ports;
+    int id = type == CAD_JACK_OUTPUT ? self->sink_id : self->source_id;
+    int available = plugged ? PA_PORT_AVAILABLE_YES : PA_PORT_AVAILABLE_NO;
+    GHashTableIter iter;
+    gpointer key, value;
+    gboolean change = FALSE;
+    pa_operation *op;
+
+    if (!self->ctx || !self->ready || id < 0 || !ports)
+        return;
+
+    g_hash_table_iter_init(&iter, ports);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (!is_jack_port(key) || GPOINTER_TO_INT(value) == available)
+            continue;
+
+        g_hash_table_iter_replace(&iter, GINT_TO_POINTER(available));
+        change = TRUE;
+    }
+
+    if (!change)
+        return;
+
+    self->n_jack_switches++;
+    cad_events_record(CAD_EVENT_SERVER_EVENT, id, plugged,
+                      type == CAD_JACK_OUTPUT ? "output jack" : "input jack");
+
+    if (type == CAD_JACK_OUTPUT)
+        op = pa_context_get_sink_info_by_index(self->ctx, id, jack_sink_info, self);
+    else
+        op = pa_context_get_source_info_by_index(self->ctx, id, jack_source_info, self);
+    if (op)
+        pa_operation_unref(op);
+}
+
 static void changed_cb(pa_context *ctx, pa_subscription_event_type_t type, uint32_t idx, void *data)
 {
     CadPulse *self = data;
     pa_subscription_event_type_t kind = type & PA_SUBSCRIPTION_EVENT_TYPE_MASK;
     pa_operation *op = NULL;
+    guint i;
+
+    CAD_TRACE3(pa_event, type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK, kind, idx);
+
+    self->n_events++;
+    if (!is_relevant_event(self, type, idx)) {
+        self->n_events_filtered++;
+        return;
+    }
+
+    cad_events_record(CAD_EVENT_SERVER_EVENT, idx, kind, get_facility_name(type));
 
     switch (type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) {
     case PA_SUBSCRIPTION_EVENT_SINK:
-        if (idx == self->sink_id && kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
+        if (idx == self->loopbacks[LOOPBACK_UPLINK].endpoint_id &&
+            kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
+            forget_modem_device(self, LOOPBACK_UPLINK);
+        } else if (idx == self->sink_id && kind == PA_SUBSCRIPTION_EVENT_CHANGE) {
+            op = pa_context_get_sink_info_by_index(ctx, idx, change_sink_volume, self);
+            if (op)
+                pa_operation_unref(op);
+        } else if (idx == self->sink_id && kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
             g_debug("sink %u removed", idx);
             self->sink_id = -1;
+            g_clear_pointer(&self->sink_name, g_free);
+            forget_echo_cancel(self);
             g_hash_table_destroy(self->sink_ports);
             self->sink_ports = NULL;
+            update_active_port(self, &self->active_sink_port, NULL);
+            cad_objects_remove_routes(self->card_id, CAD_ROUTE_OUTPUT);
+            update_available_outputs(self, 0);
         } else if (kind == PA_SUBSCRIPTION_EVENT_NEW) {
             g_debug("new sink %u", idx);
             op = pa_context_get_sink_info_by_index(ctx, idx, init_sink_info, self);
@@ -704,11 +2366,18 @@ static void changed_cb(pa_context *ctx, pa_subscription_event_type_t type, uint3
         }
         break;
     case PA_SUBSCRIPTION_EVENT_SOURCE:
-        if (idx == self->source_id && kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
+        if (idx == self->loopbacks[LOOPBACK_DOWNLINK].endpoint_id &&
+            kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
+            forget_modem_device(self, LOOPBACK_DOWNLINK);
+        } else if (idx == self->source_id && kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
             g_debug("source %u removed", idx);
             self->source_id = -1;
+            g_clear_pointer(&self->source_name, g_free);
+            forget_echo_cancel(self);
             g_hash_table_destroy(self->source_ports);
             self->source_ports = NULL;
+            update_active_port(self, &self->active_source_port, NULL);
+            cad_objects_remove_routes(self->card_id, CAD_ROUTE_INPUT);
         } else if (kind == PA_SUBSCRIPTION_EVENT_NEW) {
             g_debug("new source %u", idx);
             op = pa_context_get_source_info_by_index(ctx, idx, init_source_info, self);
@@ -719,6 +2388,9 @@ static void changed_cb(pa_context *ctx, pa_subscription_event_type_t type, uint3
     case PA_SUBSCRIPTION_EVENT_CARD:
         if (idx == self->card_id && kind == PA_SUBSCRIPTION_EVENT_CHANGE) {
             g_debug("card %u changed", idx);
+            op = pa_context_get_card_info_by_index(ctx, idx, change_card_info, self);
+            if (op)
+                pa_operation_unref(op);
             if (self->sink_id != -1) {
                 op = pa_context_get_sink_info_by_index(ctx, self->sink_id,
                                                        change_sink_info, self);
@@ -731,8 +2403,28 @@ static void changed_cb(pa_context *ctx, pa_subscription_event_type_t type, uint3
                 if (op)
                     pa_operation_unref(op);
             }
+        } else if (kind == PA_SUBSCRIPTION_EVENT_NEW) {
+            op = pa_context_get_card_info_by_index(ctx, idx, new_card_info, self);
+            if (op)
+                pa_operation_unref(op);
+        } else if (idx == self->card_id && kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
+            g_debug("card %u removed", idx);
+            cad_objects_remove_card(idx);
+        } else if (idx == self->modem_card_id && kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
+            g_debug("modem card %u removed", idx);
+            self->modem_card_id = -1;
+            for (i = 0; i < N_LOOPBACKS; i++)
+                forget_modem_device(self, i);
         }
         break;
+    case PA_SUBSCRIPTION_EVENT_SINK_INPUT:
+        if (kind == PA_SUBSCRIPTION_EVENT_NEW)
+            duck_new_sink_input(self, idx);
+        else if (kind == PA_SUBSCRIPTION_EVENT_CHANGE)
+            check_ducked_stream(self, idx);
+        else if (kind == PA_SUBSCRIPTION_EVENT_REMOVE)
+            g_hash_table_remove(self->ducked_streams, GUINT_TO_POINTER(idx));
+        break;
     default:
         break;
     }
@@ -742,6 +2434,7 @@ static void pulse_state_cb(pa_context *ctx, void *data)
 {
     CadPulse *self = data;
     pa_context_state_t state;
+    pa_operation *op;
 
     state = pa_context_get_state(ctx);
     switch (state) {
@@ -752,17 +2445,26 @@ static void pulse_state_cb(pa_context *ctx, void *data)
         g_debug("PA not ready");
         break;
     case PA_CONTEXT_FAILED:
+        cad_events_record(CAD_EVENT_SERVER, 0, state, "failed");
         g_critical("Error in PulseAudio context: %s", pa_strerror(pa_context_errno(ctx)));
         pulseaudio_cleanup(self);
         g_idle_add(G_SOURCE_FUNC(pulseaudio_connect), self);
         break;
     case PA_CONTEXT_TERMINATED:
+        /* We closed the connection ourselves, nothing to do */
+        g_debug("PA connection terminated");
+        break;
     case PA_CONTEXT_READY:
+        cad_events_record(CAD_EVENT_SERVER, 0, state, "ready");
         pa_context_set_subscribe_callback(ctx, changed_cb, self);
         pa_context_subscribe(ctx,
-                             PA_SUBSCRIPTION_MASK_SINK  | PA_SUBSCRIPTION_MASK_SOURCE | PA_SUBSCRIPTION_MASK_CARD,
+                             PA_SUBSCRIPTION_MASK_SINK  | PA_SUBSCRIPTION_MASK_SOURCE |
+                             PA_SUBSCRIPTION_MASK_CARD | PA_SUBSCRIPTION_MASK_SINK_INPUT,
                              NULL, self);
         g_debug("PA is ready, initializing cards list");
+        op = pa_context_get_server_info(ctx, recover_ducked_streams, self);
+        if (op)
+            pa_operation_unref(op);
         init_pulseaudio_objects(self);
         break;
     }
@@ -770,11 +2472,16 @@ static void pulse_state_cb(pa_context *ctx, void *data)
 
 static void pulseaudio_cleanup(CadPulse *self)
 {
-    if (self->ctx) {
+    /* Ducked streams are kept until we reconnect, see recover_ducked_streams() */
+    g_clear_handle_id(&self->duck_ramp_id, g_source_remove);
+
+    if (self->ctx)
         pa_context_disconnect(self->ctx);
-        pa_context_unref(self->ctx);
-        self->ctx = NULL;
-    }
+
+    /* Requests still pending will never call back once the context is gone */
+    fail_requests(self);
+
+    g_clear_pointer(&self->ctx, pa_context_unref);
 }
 
 static gboolean pulseaudio_connect(CadPulse *self)
@@ -818,6 +2525,9 @@ static void constructed(GObject *object)
 
     pulseaudio_connect(self);
 
+    if (cad_config_get_jack_enabled())
+        cad_jack_start(jack_changed_cb, self);
+
     parent_class->constructed(object);
 }
 
@@ -826,13 +2536,40 @@ static void dispose(GObject *object)
 {
     GObjectClass *parent_class = g_type_class_peek(G_TYPE_OBJECT);
     CadPulse *self = CAD_PULSE(object);
+    pa_operation *op;
+    guint i;
+
+    /* Don't leave streams ducked behind us, wait until they're restored */
+    if (self->ctx && pa_context_get_state(self->ctx) == PA_CONTEXT_READY) {
+        op = restore_ducked_streams(self);
+        while (op && pa_operation_get_state(op) == PA_OPERATION_RUNNING)
+            g_main_context_iteration(NULL, TRUE);
+        if (op)
+            pa_operation_unref(op);
+    }
 
     if (self->speaker_port)
         g_free(self->speaker_port);
     if (self->earpiece_port)
         g_free(self->earpiece_port);
-
+    g_clear_pointer(&self->card_name, g_free);
+    g_clear_pointer(&self->call_plan, g_free);
+    g_clear_pointer(&self->sink_name, g_free);
+    g_clear_pointer(&self->source_name, g_free);
+    g_clear_pointer(&self->active_sink_port, g_free);
+    g_clear_pointer(&self->active_source_port, g_free);
+    g_clear_pointer(&self->ec_saved_sink, g_free);
+    g_clear_pointer(&self->ec_saved_source, g_free);
+    g_clear_handle_id(&self->loopback_measure_id, g_source_remove);
+    g_clear_pointer(&self->ducked_streams, g_hash_table_destroy);
+    g_clear_pointer(&self->sink_ports, g_hash_table_destroy);
+    g_clear_pointer(&self->source_ports, g_hash_table_destroy);
+    for (i = 0; i < N_LOOPBACKS; i++)
+        g_clear_pointer(&self->loopbacks[i].endpoint, g_free);
+
+    cad_jack_stop();
     pulseaudio_cleanup(self);
+    g_clear_pointer(&self->requests, g_array_unref);
 
     if (self->loop) {
         pa_glib_mainloop_free(self->loop);
@@ -842,91 +2579,266 @@ static void dispose(GObject *object)
     parent_class->dispose(object);
 }
 
-static void cad_pulse_class_init(CadPulseClass *klass)
+static void cad_pulse_class_init(CadPulseClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+    object_class->constructed = constructed;
+    object_class->dispose = dispose;
+}
+
+static void cad_pulse_init(CadPulse *self)
+{
+    guint i;
+
+    self->manager = G_OBJECT(cad_manager_get_default());
+    self->audio_mode = CALL_AUDIO_MODE_UNKNOWN;
+    self->next_mode = CALL_AUDIO_MODE_UNKNOWN;
+    self->speaker_state = CALL_AUDIO_SPEAKER_UNKNOWN;
+    self->mic_state = CALL_AUDIO_MIC_UNKNOWN;
+    self->requests = g_array_new(FALSE, FALSE, sizeof(CadRequest));
+    self->preferred_output = CAD_OUTPUT_UNKNOWN;
+    self->strategy = cad_card_get_default_strategy();
+
+    self->modem_card_id = -1;
+    for (i = 0; i < N_LOOPBACKS; i++) {
+        self->loopbacks[i].endpoint_id = -1;
+        self->loopbacks[i].module_id = PA_INVALID_INDEX;
+    }
+    self->ec_module_id = PA_INVALID_INDEX;
+    self->ec_sink_id = self->ec_source_id = -1;
+
+    self->ducked_streams = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                                 NULL, g_free);
+}
+
+CadPulse *cad_pulse_get_default(void)
+{
+    static CadPulse *pulse = NULL;
+
+    if (pulse == NULL) {
+        g_debug("initializing pulseaudio backend...");
+        pulse = g_object_new(CAD_TYPE_PULSE, NULL);
+        g_object_add_weak_pointer(G_OBJECT(pulse), (gpointer *)&pulse);
+    }
+
+    return pulse;
+}
+
+/******************************************************************************
+ * Commands management
+ *
+ * The following functions handle external requests to switch mode, output port
+ * or microphone status
+ ******************************************************************************/
+
+/*
+ * Every PA request issued on behalf of an operation holds its own reference on
+ * that operation, which is released by the request callback once done.
+ * This helper drops the request's reference if it couldn't be issued.
+ */
+static gboolean track_request_full(pa_operation *op, CadOperation *operation,
+                                   const gchar *caller)
+{
+    CadPulse *self = cad_pulse_get_default();
+    CadRequest request;
+    guint i;
+
+    CAD_TRACE3(pa_request, operation->type, caller, op != NULL);
+
+    if (!op) {
+        cad_operation_unref(operation);
+        return FALSE;
+    }
+
+    /* Forget about requests whose callback already ran */
+    for (i = self->requests->len; i > 0; i--) {
+        CadRequest *entry = &g_array_index(self->requests, CadRequest, i - 1);
+
+        if (pa_operation_get_state(entry->pa_op) == PA_OPERATION_DONE) {
+            pa_operation_unref(entry->pa_op);
+            g_array_remove_index_fast(self->requests, i - 1);
+        }
+    }
+
+    /* The callback owns the reference on the operation, we just keep op */
+    request.pa_op = op;
+    request.operation = operation;
+    g_array_append_val(self->requests, request);
+
+    return TRUE;
+}
+
+#define track_request(op, operation) track_request_full(op, operation, G_STRFUNC)
+
+/*
+ * When the context fails, PA cancels all pending requests without calling
+ * their callback: drop their reference on the operation ourselves, which
+ * answers the corresponding D-Bus invocation and returns it to the pool.
+ */
+static void fail_requests(CadPulse *self)
+{
+    g_autoptr(GArray) requests = self->requests;
+    guint i;
+
+    if (!requests)
+        return;
+
+    self->requests = g_array_new(FALSE, FALSE, sizeof(CadRequest));
+
+    for (i = 0; i < requests->len; i++) {
+        CadRequest *entry = &g_array_index(requests, CadRequest, i);
+        pa_operation_state_t state = pa_operation_get_state(entry->pa_op);
+
+        if (state == PA_OPERATION_RUNNING)
+            pa_operation_cancel(entry->pa_op);
+
+        if (state != PA_OPERATION_DONE) {
+            g_debug("operation %d: PA request lost", entry->operation->type);
+            cad_operation_complete(entry->operation, FALSE);
+            cad_operation_unref(entry->operation);
+        }
+
+        pa_operation_unref(entry->pa_op);
+    }
+}
+
+/*
+ * A newer request of the same type was received while this operation was in
+ * flight: stop processing it here so both don't race each other, and let the
+ * newer one take over from the current state.
+ */
+static gboolean check_superseded(CadOperation *operation)
+{
+    if (!cad_operation_is_superseded(operation))
+        return FALSE;
+
+    g_debug("operation %d superseded, cancelling", operation->type);
+    cad_operation_cancel(operation);
+
+    return TRUE;
+}
+
+static void finish_operation(CadOperation *operation, gboolean success)
+{
+    CadPulse *self = cad_pulse_get_default();
+
+    /*
+     * A newer request is on its way and will set the state once done: don't
+     * report a state it's about to override.
+     */
+    if (check_superseded(operation))
+        return;
+
+    if (success) {
+        guint new_value = operation->value;
+
+        switch (operation->type) {
+        case CAD_OPERATION_SELECT_MODE:
+            if (self->answer_time && new_value == CALL_AUDIO_MODE_CALL) {
+                self->n_answers++;
+                self->last_answer_time = g_get_monotonic_time() - self->answer_time;
+                self->answer_time = 0;
+                g_debug("call answered in %" G_GINT64_FORMAT " us",
+                        self->last_answer_time);
+            }
+            if (self->audio_mode != new_value) {
+                self->audio_mode = new_value;
+                g_object_set(self->manager, "audio-mode", new_value, NULL);
+            }
+            /* The call starts on the speaker if that's what was selected last */
+            if (is_call_mode(new_value) && self->preferred_output == CAD_OUTPUT_SPEAKER &&
+                self->speaker_state != CALL_AUDIO_SPEAKER_ON) {
+                self->speaker_state = CALL_AUDIO_SPEAKER_ON;
+                g_object_set(self->manager, "speaker-state", self->speaker_state, NULL);
+            }
+            break;
+        case CAD_OPERATION_ENABLE_SPEAKER:
+            if (self->speaker_state != new_value) {
+                self->speaker_state = new_value;
+                g_object_set(self->manager, "speaker-state", new_value, NULL);
+            }
+            /* Internal requests, f.e. when ending a call, aren't user choices */
+            if (operation->invocation) {
+                self->preferred_output = new_value ? CAD_OUTPUT_SPEAKER : CAD_OUTPUT_UNKNOWN;
+                cad_output_store(self->card_name, self->audio_mode,
+                                 self->preferred_output);
+            }
+            break;
+        case CAD_OPERATION_SELECT_OUTPUT:
+            new_value = new_value == CAD_OUTPUT_SPEAKER ?
+                        CALL_AUDIO_SPEAKER_ON : CALL_AUDIO_SPEAKER_OFF;
+            if (self->speaker_state != new_value) {
+                self->speaker_state = new_value;
+                g_object_set(self->manager, "speaker-state", new_value, NULL);
+            }
+            self->preferred_output = operation->value;
+            cad_output_store(self->card_name, self->audio_mode, operation->value);
+            break;
+        case CAD_OPERATION_MUTE_MIC:
+            /*
+             * "Mute mic" operation's value is TRUE (1) for muting the mic,
+             * so ensure mic_state carries the right value.
+             */
+            new_value = new_value ? CALL_AUDIO_MIC_OFF : CALL_AUDIO_MIC_ON;
+            if (self->mic_state != new_value) {
+                self->mic_state = new_value;
+                g_object_set(self->manager, "mic-state", new_value, NULL);
+            }
+            break;
+        case CAD_OPERATION_SET_VOLUME: {
+            pa_cvolume volume;
+
+            pa_cvolume_set(&volume, MAX(self->sink_volume.channels, 1),
+                           percent_to_volume(new_value));
+            update_volume(self, &volume);
+            cad_volume_store(self->card_name, self->active_sink_port,
+                             get_route_mode(self), percent_to_volume(new_value));
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    cad_operation_complete(operation, success);
+}
+
+/*
+ * Call audio is set up as soon as a mode switch is requested: if the switch
+ * didn't go through, set it back up for the mode we're actually in. Should a
+ * newer request have superseded it, that one takes care of it instead.
+ */
+static void mode_operation_done(CadOperation *operation)
 {
-    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+    CadPulse *self = cad_pulse_get_default();
 
-    object_class->constructed = constructed;
-    object_class->dispose = dispose;
-}
+    if (cad_operation_is_superseded(operation))
+        return;
 
-static void cad_pulse_init(CadPulse *self)
-{
-    self->manager = G_OBJECT(cad_manager_get_default());
-    self->audio_mode = CALL_AUDIO_MODE_UNKNOWN;
-    self->speaker_state = CALL_AUDIO_SPEAKER_UNKNOWN;
-    self->mic_state = CALL_AUDIO_MIC_UNKNOWN;
-}
+    /* Whatever the outcome, volumes belong to the current mode again */
+    self->next_mode = CALL_AUDIO_MODE_UNKNOWN;
 
-CadPulse *cad_pulse_get_default(void)
-{
-    static CadPulse *pulse = NULL;
+    if (operation->success)
+        return;
 
-    if (pulse == NULL) {
-        g_debug("initializing pulseaudio backend...");
-        pulse = g_object_new(CAD_TYPE_PULSE, NULL);
-        g_object_add_weak_pointer(G_OBJECT(pulse), (gpointer *)&pulse);
-    }
+    self->in_call = is_call_mode(self->audio_mode);
+    self->bridge_modem = is_modem_mode(self->audio_mode);
 
-    return pulse;
+    if (self->ctx && pa_context_get_state(self->ctx) == PA_CONTEXT_READY)
+        update_call_audio(self);
 }
 
-/******************************************************************************
- * Commands management
- *
- * The following functions handle external requests to switch mode, output port
- * or microphone status
- ******************************************************************************/
-
 static void operation_complete_cb(pa_context *ctx, int success, void *data)
 {
-    CadPulseOperation *operation = data;
-
-    g_debug("operation returned %d", success);
+    CadOperation *operation = data;
 
-    if (operation) {
-        if (operation->op) {
-            operation->op->success = (gboolean)!!success;
-            if (operation->op->callback)
-                operation->op->callback(operation->op);
-
-            if (operation->op->success) {
-                guint new_value = GPOINTER_TO_UINT(operation->value);
-
-                switch (operation->op->type) {
-                case CAD_OPERATION_SELECT_MODE:
-                    if (operation->pulse->audio_mode != new_value) {
-                        operation->pulse->audio_mode = new_value;
-                        g_object_set(operation->pulse->manager, "audio-mode", new_value, NULL);
-                    }
-                    break;
-                case CAD_OPERATION_ENABLE_SPEAKER:
-                    if (operation->pulse->speaker_state != new_value) {
-                        operation->pulse->speaker_state = new_value;
-                        g_object_set(operation->pulse->manager, "speaker-state", new_value, NULL);
-                    }
-                    break;
-                case CAD_OPERATION_MUTE_MIC:
-                    /*
-                     * "Mute mic" operation's value is TRUE (1) for muting the mic,
-                     * so ensure mic_state carries the right value.
-                     */
-                    new_value = new_value ? CALL_AUDIO_MIC_OFF : CALL_AUDIO_MIC_ON;
-                    if (operation->pulse->mic_state != new_value) {
-                        operation->pulse->mic_state = new_value;
-                        g_object_set(operation->pulse->manager, "mic-state", new_value, NULL);
-                    }
-                    break;
-                default:
-                    break;
-                }
-            }
+    CAD_TRACE2(pa_callback, operation->type, G_STRFUNC);
 
-            free(operation->op);
-        }
+    g_debug("operation returned %d", success);
 
-        free(operation);
-    }
+    finish_operation(operation, (gboolean)!!success);
+    cad_operation_unref(operation);
 }
 
 #ifdef WITH_DROID_SUPPORT
@@ -937,18 +2849,24 @@ static void droid_source_parked_complete_cb(pa_context *ctx, int success, void *
      * change the output port.
     */
 
-    CadPulseOperation *operation = data;
-    pa_operation *op = NULL;
+    CadOperation *operation = data;
+    CadPulse *self = cad_pulse_get_default();
 
-    g_debug("droid: parking succeeded, setting real output port");
+    CAD_TRACE2(pa_callback, operation->type, G_STRFUNC);
 
-    op = pa_context_get_sink_info_by_index(operation->pulse->ctx,
-                                           operation->pulse->sink_id,
-                                           set_output_port, data);
+    if (check_superseded(operation)) {
+        cad_operation_unref(operation);
+        return;
+    }
 
-    if (op)
-        pa_operation_unref(op);
+    g_debug("droid: parking succeeded, setting real output port");
 
+    track_request(pa_context_get_sink_info_by_index(self->ctx, self->sink_id,
+                                                    set_output_port,
+                                                    cad_operation_ref(operation)),
+                  operation);
+
+    cad_operation_unref(operation);
 }
 
 static void droid_sink_parked_complete_cb(pa_context *ctx, int success, void *data)
@@ -958,18 +2876,25 @@ static void droid_sink_parked_complete_cb(pa_context *ctx, int success, void *da
      * the source too.
     */
 
-    CadPulseOperation *operation = data;
-    pa_operation *op = NULL;
+    CadOperation *operation = data;
+    CadPulse *self = cad_pulse_get_default();
 
-    g_debug("droid: parking input to trigger mode change");
+    CAD_TRACE2(pa_callback, operation->type, G_STRFUNC);
 
-    op = pa_context_set_source_port_by_index(ctx, operation->pulse->source_id,
-                                            DROID_INPUT_PORT_PARKING,
-                                            droid_source_parked_complete_cb, data);
+    if (check_superseded(operation)) {
+        cad_operation_unref(operation);
+        return;
+    }
 
-    if (op)
-        pa_operation_unref(op);
+    g_debug("droid: parking input to trigger mode change");
+
+    track_request(pa_context_set_source_port_by_index(ctx, self->source_id,
+                                                      DROID_INPUT_PORT_PARKING,
+                                                      droid_source_parked_complete_cb,
+                                                      cad_operation_ref(operation)),
+                  operation);
 
+    cad_operation_unref(operation);
 }
 
 static void droid_mode_change_complete_cb(pa_context *ctx, int success, void *data)
@@ -985,119 +2910,180 @@ static void droid_mode_change_complete_cb(pa_context *ctx, int success, void *da
      * It's one more step that needs to be done only on droid devices.
     */
 
-    CadPulseOperation *operation = data;
-    pa_operation *op = NULL;
+    CadOperation *operation = data;
+    CadPulse *self = cad_pulse_get_default();
 
-    if (!operation->pulse->sink_is_droid)
-        return operation_complete_cb(ctx, success, data);
+    CAD_TRACE2(pa_callback, operation->type, G_STRFUNC);
+
+    if (check_superseded(operation)) {
+        cad_operation_unref(operation);
+        return;
+    }
 
     g_debug("droid: parking output to trigger mode change");
 
-    op = pa_context_set_sink_port_by_index(ctx, operation->pulse->sink_id,
-                                           DROID_OUTPUT_PORT_PARKING,
-                                           droid_sink_parked_complete_cb,
-                                           operation);
-    if (op)
-        pa_operation_unref(op);
+    track_request(pa_context_set_sink_port_by_index(ctx, self->sink_id,
+                                                    DROID_OUTPUT_PORT_PARKING,
+                                                    droid_sink_parked_complete_cb,
+                                                    cad_operation_ref(operation)),
+                  operation);
+
+    cad_operation_unref(operation);
 }
 
 static void droid_output_port_change_complete_cb(pa_context *ctx, int success, void *data)
 {
-    CadPulseOperation *operation = data;
-    pa_operation *op = NULL;
+    CadOperation *operation = data;
+    CadPulse *self = cad_pulse_get_default();
+
+    CAD_TRACE2(pa_callback, operation->type, G_STRFUNC);
+
+    if (check_superseded(operation)) {
+        cad_operation_unref(operation);
+        return;
+    }
 
     g_debug("droid: setting real input port");
 
-    op = pa_context_get_source_info_by_index(operation->pulse->ctx,
-                                           operation->pulse->source_id,
-                                           set_input_port, operation);
+    track_request(pa_context_get_source_info_by_index(self->ctx, self->source_id,
+                                                      set_input_port,
+                                                      cad_operation_ref(operation)),
+                  operation);
 
-    if (op)
-        pa_operation_unref(op);
+    cad_operation_unref(operation);
 }
 #endif /* WITH_DROID_SUPPORT */
 
-static void set_card_profile(pa_context *ctx, const pa_card_info *info, int eol, void *data)
+/*
+ * Switch the card to the profile matching the operation's mode, @active being
+ * the currently active profile.
+ */
+static void switch_card_profile(CadPulse *self, const gchar *active, CadOperation *operation)
 {
-    CadPulseOperation *operation = data;
-    pa_card_profile_info2 *profile;
     pa_operation *op = NULL;
-    gchar *default_profile;
-    gchar *voicecall_profile;
-    pa_context_success_cb_t complete_callback;
+    const gchar *default_profile = self->strategy->hifi_profile;
+    const gchar *voicecall_profile = self->strategy->voicecall_profile;
+    const gchar *target_profile;
 
-    if (eol != 0)
-        return;
+    /*
+     * Ringing and VoIP modes use their own profile when the card has one,
+     * and the default profile otherwise.
+     */
+    switch (operation->value) {
+    case CALL_AUDIO_MODE_CALL:
+        target_profile = voicecall_profile;
+        break;
+    case CALL_AUDIO_MODE_RINGING:
+        target_profile = self->ringing_profile ? self->ringing_profile : default_profile;
+        break;
+    case CALL_AUDIO_MODE_VOIP:
+        target_profile = self->voip_profile ? self->voip_profile : default_profile;
+        break;
+    default:
+        target_profile = default_profile;
+        break;
+    }
 
-    if (!info) {
-        g_critical("PA returned no card info (eol=%d)", eol);
+    /* Leave alone any profile we don't know about */
+    if (!active ||
+        (strcmp(active, default_profile) != 0 &&
+         strcmp(active, voicecall_profile) != 0 &&
+         g_strcmp0(active, self->ringing_profile) != 0 &&
+         g_strcmp0(active, self->voip_profile) != 0)) {
+        g_debug("%s: unknown active profile, nothing to be done", __func__);
+        finish_operation(operation, TRUE);
         return;
     }
 
-    if (info->index != operation->pulse->card_id)
+    /*
+     * While ringing, remember which profile the card is on: answering the
+     * call then only has to commit the switch, see cad_pulse_select_mode().
+     */
+    g_clear_pointer(&self->call_plan, g_free);
+    if (operation->value == CALL_AUDIO_MODE_RINGING)
+        self->call_plan = g_strdup(target_profile);
+
+    if (strcmp(active, target_profile) != 0) {
+        g_debug("switching to profile '%s'", target_profile);
+        cad_events_record(CAD_EVENT_PROFILE, self->card_id, 0, target_profile);
+        op = pa_context_set_card_profile_by_index(self->ctx, self->card_id,
+                                                  target_profile,
+                                                  get_profile_switched_cb(self),
+                                                  cad_operation_ref(operation));
+    } else if (operation->value == CALL_AUDIO_MODE_VOIP && self->sink_id >= 0) {
+        /*
+         * Without a VoIP profile we stay on the default one, so route the
+         * sink ourselves, as we would on cards without a voice profile. When
+         * switching profiles instead, the sink gets recreated and routed by
+         * init_sink_info().
+         */
+        g_debug("no VoIP profile, switching output port");
+        op = pa_context_get_sink_info_by_index(self->ctx, self->sink_id,
+                                               set_output_port,
+                                               cad_operation_ref(operation));
+    } else {
+        g_debug("%s: nothing to be done", __func__);
+        finish_operation(operation, TRUE);
         return;
+    }
 
-#ifdef WITH_DROID_SUPPORT
-    default_profile = operation->pulse->sink_is_droid ?
-                          DROID_PROFILE_HIFI :
-                          SND_USE_CASE_VERB_HIFI;
-    voicecall_profile = operation->pulse->sink_is_droid ?
-                            DROID_PROFILE_VOICECALL :
-                            SND_USE_CASE_VERB_VOICECALL;
-    complete_callback = droid_mode_change_complete_cb;
-#else
-    default_profile = SND_USE_CASE_VERB_HIFI;
-    voicecall_profile = SND_USE_CASE_VERB_VOICECALL;
-    complete_callback = operation_complete_cb;
-#endif /* WITH_DROID_SUPPORT */
+    track_request(op, operation);
+}
+
+static void set_card_profile(pa_context *ctx, const pa_card_info *info, int eol, void *data)
+{
+    CadOperation *operation = data;
+    CadPulse *self = cad_pulse_get_default();
 
-    profile = info->active_profile2;
+    CAD_TRACE2(pa_callback, operation->type, G_STRFUNC);
 
-    if (strcmp(profile->name, voicecall_profile) == 0 && operation->value == 0) {
-        g_debug("switching to default profile");
-        op = pa_context_set_card_profile_by_index(ctx, operation->pulse->card_id,
-                                                  default_profile,
-                                                  complete_callback, operation);
-    } else if (strcmp(profile->name, default_profile) == 0 && operation->value == 1) {
-        g_debug("switching to voice profile");
-        op = pa_context_set_card_profile_by_index(ctx, operation->pulse->card_id,
-                                                  voicecall_profile,
-                                                  complete_callback, operation);
+    if (eol != 0) {
+        cad_operation_unref(operation);
+        return;
     }
 
-    if (op) {
-        pa_operation_unref(op);
-    } else {
-        g_debug("%s: nothing to be done", __func__);
-        operation_complete_cb(ctx, 1, operation);
+    if (!info) {
+        g_critical("PA returned no card info (eol=%d)", eol);
+        return;
     }
+
+    if (info->index != self->card_id)
+        return;
+
+    if (check_superseded(operation))
+        return;
+
+    switch_card_profile(self,
+                        info->active_profile2 ? info->active_profile2->name : NULL,
+                        operation);
 }
 
 static void set_output_port(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
 {
-    CadPulseOperation *operation = data;
-    pa_operation *op = NULL;
+    CadOperation *operation = data;
+    CadPulse *self = cad_pulse_get_default();
+    const gchar *active_port;
     const gchar *target_port;
-    pa_context_success_cb_t complete_callback;
 
-#ifdef WITH_DROID_SUPPORT
-    complete_callback = droid_output_port_change_complete_cb;
-#else
-    complete_callback = operation_complete_cb;
-#endif
+    CAD_TRACE2(pa_callback, operation->type, G_STRFUNC);
 
-    if (eol != 0)
+    if (eol != 0) {
+        cad_operation_unref(operation);
         return;
+    }
 
     if (!info) {
         g_critical("PA returned no sink info (eol=%d)", eol);
         return;
     }
 
-    if (info->card != operation->pulse->card_id || info->index != operation->pulse->sink_id)
+    if (info->card != self->card_id || info->index != self->sink_id)
+        return;
+
+    if (check_superseded(operation))
         return;
 
-    if (operation->op && operation->op->type == CAD_OPERATION_SELECT_MODE) {
+    if (operation->type == CAD_OPERATION_SELECT_MODE) {
         /*
          * When switching to voice call mode, we want to switch to any port
          * other than the speaker; this makes sure we use the headphones if they
@@ -1105,18 +3091,13 @@ static void set_output_port(pa_context *ctx, const pa_sink_info *info, int eol,
          * When switching back to normal mode, the highest priority port is to
          * be selected anyway.
          */
-        if (operation->value == CALL_AUDIO_MODE_CALL)
-#ifdef WITH_DROID_SUPPORT
-            target_port = get_available_sink_port(info, operation->pulse->speaker_port, operation->pulse->sink_is_droid);
-#else
-            target_port = get_available_sink_port(info, operation->pulse->speaker_port);
-#endif
+        if (is_call_mode(operation->value) && self->preferred_output != CAD_OUTPUT_SPEAKER)
+            target_port = get_preferred_sink_port(self, info, self->speaker_port);
         else
-#ifdef WITH_DROID_SUPPORT
-            target_port = get_available_sink_port(info, NULL, operation->pulse->sink_is_droid);
-#else
-            target_port = get_available_sink_port(info, NULL);
-#endif
+            target_port = get_preferred_sink_port(self, info, NULL);
+    } else if (operation->type == CAD_OPERATION_SELECT_OUTPUT) {
+        target_port = cad_card_find_output_port(info, self->sink_ports,
+                                                operation->value, NULL);
     } else {
         /*
          * When forcing speaker output, we simply select the speaker port.
@@ -1125,69 +3106,90 @@ static void set_output_port(pa_context *ctx, const pa_sink_info *info, int eol,
          * and the earpiece otherwise.
          */
         if (operation->value)
-            target_port = operation->pulse->speaker_port;
+            target_port = self->speaker_port;
         else
-#ifdef WITH_DROID_SUPPORT
-            target_port = get_available_sink_port(info, operation->pulse->speaker_port, operation->pulse->sink_is_droid);
-#else
-            target_port = get_available_sink_port(info, operation->pulse->speaker_port);
-#endif
+            target_port = get_available_sink_port(self, info, self->speaker_port);
     }
 
-    g_debug("active port is '%s', target port is '%s'", info->active_port->name, target_port);
+    active_port = info->active_port ? info->active_port->name : NULL;
+    g_debug("active port is '%s', target port is '%s'", active_port, target_port);
 
-    if (strcmp(info->active_port->name, target_port) != 0) {
-        g_debug("switching to target port '%s'", target_port);
-        op = pa_context_set_sink_port_by_index(ctx, operation->pulse->sink_id,
-                                               target_port,
-                                               complete_callback, operation);
+    if (!target_port) {
+        /* F.e. no speaker port, or all ports reported as unavailable */
+        g_warning("no suitable output port on sink '%s'", info->name);
+        finish_operation(operation, FALSE);
+        return;
     }
 
-    if (op) {
-        pa_operation_unref(op);
+    if (g_strcmp0(active_port, target_port) != 0) {
+        g_debug("switching to target port '%s'", target_port);
+        update_active_port(self, &self->active_sink_port, target_port);
+        track_request(pa_context_set_sink_port_by_index(ctx, self->sink_id,
+                                                        target_port,
+                                                        get_output_port_switched_cb(self),
+                                                        cad_operation_ref(operation)),
+                      operation);
+        apply_route_volume(self, target_port);
     } else {
         g_debug("%s: nothing to be done", __func__);
-        operation_complete_cb(ctx, 1, operation);
+        /* Same port, but the route changes along with the mode */
+        if (operation->type == CAD_OPERATION_SELECT_MODE)
+            apply_route_volume(self, target_port);
+        finish_operation(operation, TRUE);
     }
 }
 
+#ifdef WITH_DROID_SUPPORT
 static void set_input_port(pa_context *ctx, const pa_source_info *info, int eol, void *data)
 {
-    CadPulseOperation *operation = data;
-    pa_operation *op = NULL;
+    CadOperation *operation = data;
+    CadPulse *self = cad_pulse_get_default();
+    const gchar *active_port;
     const gchar *target_port;
 
-    if (eol != 0)
+    CAD_TRACE2(pa_callback, operation->type, G_STRFUNC);
+
+    if (eol != 0) {
+        cad_operation_unref(operation);
         return;
+    }
 
-    if (!info)
-        g_error("PA returned no source info (eol=%d)", eol);
+    if (!info) {
+        g_critical("PA returned no source info (eol=%d)", eol);
+        return;
+    }
 
-    if (info->card != operation->pulse->card_id || info->index != operation->pulse->source_id)
+    if (info->card != self->card_id || info->index != self->source_id)
         return;
 
-#ifdef WITH_DROID_SUPPORT
-    target_port = get_available_source_port(info, NULL, operation->pulse->source_is_droid);
-#else
-    target_port = get_available_source_port(info, NULL);
-#endif
+    if (check_superseded(operation))
+        return;
 
-    g_debug("active source port is '%s', target source port is '%s'", info->active_port->name, target_port);
+    target_port = get_available_source_port(self, info, NULL);
 
-    if (strcmp(info->active_port->name, target_port) != 0) {
-        g_debug("switching to target source port '%s'", target_port);
-        op = pa_context_set_source_port_by_index(ctx, operation->pulse->source_id,
-                                                 target_port,
-                                                 operation_complete_cb, operation);
+    active_port = info->active_port ? info->active_port->name : NULL;
+    g_debug("active source port is '%s', target source port is '%s'", active_port, target_port);
+
+    if (!target_port) {
+        g_warning("no suitable input port on source '%s'", info->name);
+        finish_operation(operation, FALSE);
+        return;
     }
 
-    if (op) {
-        pa_operation_unref(op);
+    if (g_strcmp0(active_port, target_port) != 0) {
+        g_debug("switching to target source port '%s'", target_port);
+        update_active_port(self, &self->active_source_port, target_port);
+        track_request(pa_context_set_source_port_by_index(ctx, self->source_id,
+                                                          target_port,
+                                                          operation_complete_cb,
+                                                          cad_operation_ref(operation)),
+                      operation);
     } else {
         g_debug("%s: nothing to be done", __func__);
-        operation_complete_cb(ctx, 1, operation);
+        finish_operation(operation, TRUE);
     }
 }
+#endif /* WITH_DROID_SUPPORT */
 
 /**
  * cad_pulse_select_mode:
@@ -1197,16 +3199,12 @@ static void set_input_port(pa_context *ctx, const pa_source_info *info, int eol,
  * */
 void cad_pulse_select_mode(guint mode, CadOperation *cad_op)
 {
-    CadPulseOperation *operation = g_new(CadPulseOperation, 1);
-    pa_operation *op = NULL;
+    CadPulse *self = cad_pulse_get_default();
+    g_autofree gchar *call_plan = g_steal_pointer(&self->call_plan);
 
     if (!cad_op) {
         g_critical("%s: no callaudiod operation", __func__);
-        goto error;
-    }
-    if (!operation) {
-        g_critical("%s: unable to allocate memory", __func__);
-        goto error;
+        return;
     }
 
     /*
@@ -1214,77 +3212,100 @@ void cad_pulse_select_mode(guint mode, CadOperation *cad_op)
      */
     g_assert(cad_op->type == CAD_OPERATION_SELECT_MODE);
 
-    operation->pulse = cad_pulse_get_default();
-    operation->op = cad_op;
-    operation->value = mode;
+    cad_op->value = mode;
+    cad_op->backend_callback = mode_operation_done;
+
+    /*
+     * Tell answers apart when the requests are issued: by the time they
+     * complete, the ringing request may not have completed, or have been
+     * superseded.
+     */
+    if (mode == CALL_AUDIO_MODE_RINGING) {
+        self->ringing_time = g_get_monotonic_time();
+        self->answer_time = 0;
+    } else if (mode == CALL_AUDIO_MODE_CALL && self->ringing_time) {
+        self->answer_time = g_get_monotonic_time();
+        self->ringing_time = 0;
+    } else if (mode != CALL_AUDIO_MODE_CALL) {
+        self->ringing_time = self->answer_time = 0;
+    }
+
+    /*
+     * Neither bridging the modem nor echo cancellation depend on the sound
+     * card routing, so set them up right away rather than waiting for the
+     * switch to complete.
+     */
+    self->in_call = is_call_mode(mode);
+    self->next_mode = mode;
+    self->bridge_modem = is_modem_mode(mode);
+    update_call_audio(self);
 
-    if (mode != CALL_AUDIO_MODE_CALL) {
+    if (!is_call_mode(mode)) {
         /*
-         * When ending a call, we want to make sure the mic doesn't stay muted
+         * When ending a call, we want to make sure the mic doesn't stay muted;
+         * when ringing, this prepares the call route ahead of answering.
          */
-        CadOperation *unmute_op = g_new0(CadOperation, 1);
-        unmute_op->type = CAD_OPERATION_MUTE_MIC;
+        CadOperation *unmute_op = cad_operation_new(CAD_OPERATION_MUTE_MIC,
+                                                    NULL, NULL, NULL);
 
         cad_pulse_mute_mic(FALSE, unmute_op);
+        cad_operation_unref(unmute_op);
 
         /*
          * If the card has a dedicated voice profile, disable speaker so it
          * doesn't get automatically enabled for next call.
          */
-        if (operation->pulse->has_voice_profile) {
-            CadOperation *disable_speaker_op = g_new0(CadOperation, 1);
-            disable_speaker_op->type = CAD_OPERATION_ENABLE_SPEAKER;
+        if (self->has_voice_profile) {
+            CadOperation *disable_speaker_op = cad_operation_new(CAD_OPERATION_ENABLE_SPEAKER,
+                                                                 NULL, NULL, NULL);
 
             cad_pulse_enable_speaker(FALSE, disable_speaker_op);
+            cad_operation_unref(disable_speaker_op);
         }
     }
 
-    if (operation->pulse->has_voice_profile) {
+    /* Route to the output selected last time this mode was used, if any */
+    self->preferred_output = cad_output_lookup(self->card_name, mode);
+
+    if (self->has_voice_profile && call_plan && mode == CALL_AUDIO_MODE_CALL) {
+        /*
+         * Everything else was set up while ringing, only the profile switch
+         * itself is left to do.
+         */
+        g_debug("committing call prepared while ringing");
+        self->n_prepared_answers++;
+        switch_card_profile(self, call_plan, cad_op);
+    } else if (self->has_voice_profile) {
       /*
        * The pinephone f.e. has a voice profile
        */
         g_debug("card has voice profile, using it");
-        op = pa_context_get_card_info_by_index(operation->pulse->ctx,
-                                               operation->pulse->card_id,
-                                               set_card_profile, operation);
+        track_request(pa_context_get_card_info_by_index(self->ctx, self->card_id,
+                                                        set_card_profile,
+                                                        cad_operation_ref(cad_op)),
+                      cad_op);
     } else {
-        if (operation->pulse->sink_id < 0) {
+        if (self->sink_id < 0) {
             g_warning("card has no voice profile and no usable sink");
-            goto error;
+            cad_operation_complete(cad_op, FALSE);
+            return;
         }
         g_debug("card doesn't have voice profile, switching output port");
 
-        op = pa_context_get_sink_info_by_index(operation->pulse->ctx,
-                                               operation->pulse->sink_id,
-                                               set_output_port, operation);
+        track_request(pa_context_get_sink_info_by_index(self->ctx, self->sink_id,
+                                                        set_output_port,
+                                                        cad_operation_ref(cad_op)),
+                      cad_op);
     }
-
-    if (op)
-        pa_operation_unref(op);
-
-    return;
-
-error:
-    if (cad_op) {
-        cad_op->success = FALSE;
-        cad_op->callback(cad_op);
-    }
-    if (operation)
-        free(operation);
 }
 
 void cad_pulse_enable_speaker(gboolean enable, CadOperation *cad_op)
 {
-    CadPulseOperation *operation = g_new(CadPulseOperation, 1);
-    pa_operation *op = NULL;
+    CadPulse *self = cad_pulse_get_default();
 
     if (!cad_op) {
         g_critical("%s: no callaudiod operation", __func__);
-        goto error;
-    }
-    if (!operation) {
-        g_critical("%s: unable to allocate memory", __func__);
-        goto error;
+        return;
     }
 
     /*
@@ -1292,45 +3313,57 @@ void cad_pulse_enable_speaker(gboolean enable, CadOperation *cad_op)
      */
     g_assert(cad_op->type == CAD_OPERATION_ENABLE_SPEAKER);
 
-    operation->pulse = cad_pulse_get_default();
-
-    if (operation->pulse->sink_id < 0) {
+    if (self->sink_id < 0) {
         g_warning("card has no usable sink");
-        goto error;
+        cad_operation_complete(cad_op, FALSE);
+        return;
     }
 
-    operation->op = cad_op;
-    operation->value = (guint)enable;
+    cad_op->value = (guint)enable;
 
-    op = pa_context_get_sink_info_by_index(operation->pulse->ctx,
-                                           operation->pulse->sink_id,
-                                           set_output_port, operation);
-    if (op)
-        pa_operation_unref(op);
+    track_request(pa_context_get_sink_info_by_index(self->ctx, self->sink_id,
+                                                    set_output_port,
+                                                    cad_operation_ref(cad_op)),
+                  cad_op);
+}
+
+void cad_pulse_select_output(CadOutput output, CadOperation *cad_op)
+{
+    CadPulse *self = cad_pulse_get_default();
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
 
-    return;
+    /*
+     * Make sure cad_op is of the correct type!
+     */
+    g_assert(cad_op->type == CAD_OPERATION_SELECT_OUTPUT);
 
-error:
-    if (cad_op) {
-        cad_op->success = FALSE;
-        cad_op->callback(cad_op);
+    if (self->sink_id < 0) {
+        g_warning("card has no usable sink");
+        cad_operation_complete(cad_op, FALSE);
+        return;
     }
-    if (operation)
-        free(operation);
+
+    cad_op->value = output;
+
+    track_request(pa_context_get_sink_info_by_index(self->ctx, self->sink_id,
+                                                    set_output_port,
+                                                    cad_operation_ref(cad_op)),
+                  cad_op);
 }
 
 void cad_pulse_mute_mic(gboolean mute, CadOperation *cad_op)
 {
-    CadPulseOperation *operation = g_new(CadPulseOperation, 1);
+    CadPulse *self = cad_pulse_get_default();
     pa_operation *op = NULL;
+    gboolean hw_muted;
 
     if (!cad_op) {
         g_critical("%s: no callaudiod operation", __func__);
-        goto error;
-    }
-    if (!operation) {
-        g_critical("%s: unable to allocate memory", __func__);
-        goto error;
+        return;
     }
 
     /*
@@ -1338,44 +3371,74 @@ void cad_pulse_mute_mic(gboolean mute, CadOperation *cad_op)
      */
     g_assert(cad_op->type == CAD_OPERATION_MUTE_MIC);
 
-    operation->pulse = cad_pulse_get_default();
+    cad_op->value = (guint)mute;
+
+    /*
+     * Hardware switches are toggled right away, so the microphone is muted
+     * even before PulseAudio processes our request, and even if the call
+     * audio doesn't go through PulseAudio at all.
+     */
+    hw_muted = cad_mixer_set_mic_mute(mute);
 
-    if (operation->pulse->source_id < 0) {
+    if (self->source_id < 0) {
+        if (hw_muted) {
+            finish_operation(cad_op, TRUE);
+            return;
+        }
         g_warning("card has no usable source");
-        goto error;
+        cad_operation_complete(cad_op, FALSE);
+        return;
     }
 
-    operation->op = cad_op;
-    operation->value = (guint)mute;
-
-    if (operation->pulse->mic_state == CALL_AUDIO_MIC_OFF && !operation->value) {
+    if (self->mic_state == CALL_AUDIO_MIC_OFF && !cad_op->value) {
         g_debug("mic is muted, unmuting...");
-        op = pa_context_set_source_mute_by_index(operation->pulse->ctx,
-                                                 operation->pulse->source_id, 0,
-                                                 operation_complete_cb, operation);
-    } else if (operation->pulse->mic_state == CALL_AUDIO_MIC_ON && operation->value) {
+        op = pa_context_set_source_mute_by_index(self->ctx, self->source_id, 0,
+                                                 operation_complete_cb,
+                                                 cad_operation_ref(cad_op));
+    } else if (self->mic_state == CALL_AUDIO_MIC_ON && cad_op->value) {
         g_debug("mic is active, muting...");
-        op = pa_context_set_source_mute_by_index(operation->pulse->ctx,
-                                                 operation->pulse->source_id, 1,
-                                                 operation_complete_cb, operation);
-    }
-
-    if (op) {
-        pa_operation_unref(op);
+        op = pa_context_set_source_mute_by_index(self->ctx, self->source_id, 1,
+                                                 operation_complete_cb,
+                                                 cad_operation_ref(cad_op));
     } else {
         g_debug("%s: nothing to be done", __func__);
-        operation_complete_cb(operation->pulse->ctx, 1, operation);
+        finish_operation(cad_op, TRUE);
+        return;
+    }
+
+    track_request(op, cad_op);
+}
+
+void cad_pulse_set_volume(guint volume, CadOperation *cad_op)
+{
+    CadPulse *self = cad_pulse_get_default();
+    pa_cvolume cvolume;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
     }
 
-    return;
+    /*
+     * Make sure cad_op is of the correct type!
+     */
+    g_assert(cad_op->type == CAD_OPERATION_SET_VOLUME);
 
-error:
-    if (cad_op) {
-        cad_op->success = FALSE;
-        cad_op->callback(cad_op);
+    if (self->sink_id < 0) {
+        g_warning("card has no usable sink");
+        cad_operation_complete(cad_op, FALSE);
+        return;
     }
-    if (operation)
-        free(operation);
+
+    cad_op->value = volume;
+
+    pa_cvolume_set(&cvolume, MAX(self->sink_volume.channels, 1),
+                   percent_to_volume(volume));
+    track_request(pa_context_set_sink_volume_by_index(self->ctx, self->sink_id,
+                                                      &cvolume,
+                                                      operation_complete_cb,
+                                                      cad_operation_ref(cad_op)),
+                  cad_op);
 }
 
 CallAudioMode cad_pulse_get_audio_mode(void)
@@ -1396,3 +3459,103 @@ CallAudioMicState cad_pulse_get_mic_state(void)
     return self->mic_state;
 }
 
+guint cad_pulse_get_volume(void)
+{
+    CadPulse *self = cad_pulse_get_default();
+    return self->volume;
+}
+
+/**
+ * cad_pulse_add_state:
+ * @dict: the dictionary to fill
+ *
+ * Add the current audio state to @dict, using the same keys as the
+ * "State" D-Bus property.
+ */
+void cad_pulse_add_state(GVariantDict *dict)
+{
+    CadPulse *self = cad_pulse_get_default();
+
+    g_variant_dict_insert(dict, "mode", "u", self->audio_mode);
+    g_variant_dict_insert(dict, "speaker", "u", self->speaker_state);
+    g_variant_dict_insert(dict, "mic", "u", self->mic_state);
+    g_variant_dict_insert(dict, "output-port", "s",
+                          self->active_sink_port ? self->active_sink_port : "");
+    g_variant_dict_insert(dict, "input-port", "s",
+                          self->active_source_port ? self->active_source_port : "");
+    g_variant_dict_insert(dict, "volume", "u", self->volume);
+    g_variant_dict_insert(dict, "card", "s",
+                          self->card_name ? self->card_name : "");
+    g_variant_dict_insert(dict, "backend", "s", BACKEND_NAME);
+}
+
+/**
+ * cad_pulse_add_statistics:
+ * @dict: the dictionary to fill
+ *
+ * Add the backend statistics to @dict. Loopback latencies are measured
+ * asynchronously: this also triggers a new measurement, whose result will
+ * be reported by the next call.
+ */
+void cad_pulse_add_statistics(GVariantDict *dict)
+{
+    CadPulse *self = cad_pulse_get_default();
+    gboolean active = FALSE;
+    guint64 ec_active_time;
+    guint64 ec_server_cpu_time;
+    guint i;
+
+    g_variant_dict_insert(dict, "loopback-target-latency-msec", "u",
+                          cad_config_get_loopback_latency_msec());
+
+    for (i = 0; i < N_LOOPBACKS; i++) {
+        CadLoopback *loopback = &self->loopbacks[i];
+        g_autofree gchar *key = NULL;
+
+        if (loopback->module_id == PA_INVALID_INDEX)
+            continue;
+
+        active = TRUE;
+
+        key = g_strdup_printf("loopback-%s-latency-usec", loopback_names[i]);
+        g_variant_dict_insert(dict, key, "t", (guint64)loopback->latency);
+        g_free(key);
+        key = g_strdup_printf("loopback-%s-rate", loopback_names[i]);
+        g_variant_dict_insert(dict, key, "u", loopback->spec.rate);
+    }
+
+    g_variant_dict_insert(dict, "loopback-active", "b", active);
+
+    account_echo_cancel(self, &ec_active_time, &ec_server_cpu_time);
+    g_variant_dict_insert(dict, "echo-cancel-loaded", "b",
+                          self->ec_module_id != PA_INVALID_INDEX);
+    g_variant_dict_insert(dict, "echo-cancel-active", "b",
+                          self->ec_active && self->ec_applied);
+    g_variant_dict_insert(dict, "echo-cancel-active-usec", "t", ec_active_time);
+    g_variant_dict_insert(dict, "echo-cancel-server-cpu-usec", "t", ec_server_cpu_time);
+    if (ec_active_time > 0)
+        g_variant_dict_insert(dict, "echo-cancel-server-cpu-load", "d",
+                              (gdouble)ec_server_cpu_time / ec_active_time);
+    g_variant_dict_insert(dict, "echo-cancel-loads", "t", self->ec_loads);
+    if (self->ec_loads > 0)
+        g_variant_dict_insert(dict, "echo-cancel-last-load-usec", "t",
+                              (guint64)self->ec_load_time);
+
+    g_variant_dict_insert(dict, "ducked-streams", "u",
+                          g_hash_table_size(self->ducked_streams));
+    g_variant_dict_insert(dict, "ducked-streams-total", "t", self->n_ducked_total);
+
+    g_variant_dict_insert(dict, "pulse-ready", "b", self->ready);
+    g_variant_dict_insert(dict, "pulse-card-strategy", "s", self->strategy->name);
+    g_variant_dict_insert(dict, "pulse-time-to-ready-usec", "x", self->time_to_ready);
+    g_variant_dict_insert(dict, "pulse-snapshots", "t", self->n_snapshots);
+    g_variant_dict_insert(dict, "pulse-events", "t", self->n_events);
+    g_variant_dict_insert(dict, "pulse-events-filtered", "t", self->n_events_filtered);
+    g_variant_dict_insert(dict, "pulse-jack-switches", "t", self->n_jack_switches);
+    g_variant_dict_insert(dict, "pulse-answers", "t", self->n_answers);
+    g_variant_dict_insert(dict, "pulse-prepared-answers", "t", self->n_prepared_answers);
+    g_variant_dict_insert(dict, "pulse-last-answer-usec", "x", self->last_answer_time);
+
+    if (active && self->loopback_measure_id == 0)
+        measure_loopbacks(self);
+}
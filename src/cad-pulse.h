@@ -9,6 +9,7 @@
 
 #include "libcallaudio.h"
 #include "cad-operation.h"
+#include "cad-output.h"
 
 #include <glib-object.h>
 
@@ -22,9 +23,15 @@ CadPulse *cad_pulse_get_default(void);
 void cad_pulse_select_mode(guint mode, CadOperation *op);
 void cad_pulse_enable_speaker(gboolean enable, CadOperation *op);
 void cad_pulse_mute_mic(gboolean mute, CadOperation *op);
+void cad_pulse_set_volume(guint volume, CadOperation *op);
+void cad_pulse_select_output(CadOutput output, CadOperation *op);
 
 CallAudioMode cad_pulse_get_audio_mode(void);
 CallAudioSpeakerState cad_pulse_get_speaker_state(void);
 CallAudioMicState cad_pulse_get_mic_state(void);
+guint cad_pulse_get_volume(void);
+
+void cad_pulse_add_state(GVariantDict *dict);
+void cad_pulse_add_statistics(GVariantDict *dict);
 
 G_END_DECLS
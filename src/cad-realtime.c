@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-realtime"
+
+#include "cad-config.h"
+#include "cad-realtime.h"
+
+#include <gio/gio.h>
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RTKIT_SERVICE_NAME "org.freedesktop.RealtimeKit1"
+#define RTKIT_OBJECT_PATH "/org/freedesktop/RealtimeKit1"
+#define RTKIT_INTERFACE "org.freedesktop.RealtimeKit1"
+
+#ifndef SCHED_RESET_ON_FORK
+#define SCHED_RESET_ON_FORK 0x40000000
+#endif
+
+/* RealtimeKit only grants realtime priority to processes with a CPU limit */
+#define RTTIME_LIMIT_USEC 200000
+
+/*
+ * Operations are processed on the main thread, which competes with app
+ * launches and the compositor when a call comes in. When enabled, it's given
+ * a realtime priority, either directly if we're allowed to, or through
+ * RealtimeKit, and our memory is locked so it isn't swapped out or reclaimed
+ * while idle.
+ */
+static const gchar *policy = "other";
+static gboolean memory_locked;
+
+static gboolean rtkit_make_realtime(guint priority, GError **error)
+{
+    g_autoptr(GDBusConnection) bus = NULL;
+    g_autoptr(GVariant) ret = NULL;
+    struct rlimit rl;
+
+    rl.rlim_cur = rl.rlim_max = RTTIME_LIMIT_USEC;
+    if (setrlimit(RLIMIT_RTTIME, &rl) < 0)
+        g_debug("unable to set RLIMIT_RTTIME: %s", g_strerror(errno));
+
+    bus = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, error);
+    if (!bus)
+        return FALSE;
+
+    ret = g_dbus_connection_call_sync(bus, RTKIT_SERVICE_NAME, RTKIT_OBJECT_PATH,
+                                      RTKIT_INTERFACE, "MakeThreadRealtime",
+                                      g_variant_new("(tu)",
+                                                    (guint64)syscall(SYS_gettid),
+                                                    priority),
+                                      NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                                      error);
+
+    return ret != NULL;
+}
+
+static void make_realtime(void)
+{
+    g_autoptr(GError) error = NULL;
+    struct sched_param param;
+    guint priority = cad_config_get_realtime_priority();
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+
+    /* Don't let helpers we may spawn inherit our priority */
+    if (sched_setscheduler(0, SCHED_RR | SCHED_RESET_ON_FORK, &param) == 0) {
+        g_debug("running with SCHED_RR priority %u", priority);
+        policy = "rr";
+        return;
+    }
+
+    g_debug("unable to set realtime priority directly (%s), trying RealtimeKit",
+            g_strerror(errno));
+
+    if (rtkit_make_realtime(priority, &error)) {
+        g_debug("running with SCHED_RR priority %u through RealtimeKit", priority);
+        policy = "rr-rtkit";
+        return;
+    }
+
+    g_warning("Unable to get realtime priority: %s", error->message);
+}
+
+static void lock_memory(void)
+{
+    struct rlimit rl;
+    int flags = MCL_CURRENT;
+
+    /*
+     * Once the limit is reached, locking future mappings makes allocations
+     * fail: only do so if there is no limit.
+     */
+    if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur == RLIM_INFINITY)
+        flags |= MCL_FUTURE;
+
+    if (mlockall(flags) < 0) {
+        g_warning("Unable to lock memory: %s", g_strerror(errno));
+        return;
+    }
+
+    g_debug("memory locked");
+    memory_locked = TRUE;
+}
+
+/**
+ * cad_realtime_setup:
+ *
+ * Switch to realtime scheduling and lock our memory, if enabled in the
+ * configuration. This should be called early, before other threads are
+ * spawned, so they inherit the memory locking.
+ */
+void cad_realtime_setup(void)
+{
+    if (!cad_config_get_realtime_enabled())
+        return;
+
+    make_realtime();
+
+    if (cad_config_get_lock_memory())
+        lock_memory();
+}
+
+/* Resident set size in kB, from /proc/self/statm (counted in pages) */
+static gboolean get_rss(guint64 *rss)
+{
+    g_autofree gchar *contents = NULL;
+    g_auto(GStrv) fields = NULL;
+
+    if (!g_file_get_contents("/proc/self/statm", &contents, NULL, NULL))
+        return FALSE;
+
+    fields = g_strsplit(contents, " ", 3);
+    if (!fields[0] || !fields[1])
+        return FALSE;
+
+    *rss = g_ascii_strtoull(fields[1], NULL, 10) * (sysconf(_SC_PAGESIZE) / 1024);
+
+    return TRUE;
+}
+
+void cad_realtime_add_statistics(GVariantDict *dict)
+{
+    struct rusage usage;
+    guint64 rss;
+
+    g_variant_dict_insert(dict, "realtime-policy", "s", policy);
+    g_variant_dict_insert(dict, "memory-locked", "b", memory_locked);
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        g_variant_dict_insert(dict, "page-faults-minor", "t", (guint64)usage.ru_minflt);
+        g_variant_dict_insert(dict, "page-faults-major", "t", (guint64)usage.ru_majflt);
+        g_variant_dict_insert(dict, "memory-max-rss-kb", "t", (guint64)usage.ru_maxrss);
+    }
+
+    if (get_rss(&rss))
+        g_variant_dict_insert(dict, "memory-rss-kb", "t", rss);
+}
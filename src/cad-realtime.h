@@ -0,0 +1,17 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+void cad_realtime_setup(void);
+
+void cad_realtime_add_statistics(GVariantDict *dict);
+
+G_END_DECLS
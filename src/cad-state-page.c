@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define _GNU_SOURCE
+#define G_LOG_DOMAIN "callaudiod-state-page"
+
+#include "callaudiod.h"
+#include "cad-state-page.h"
+
+#include "libcallaudio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+/*
+ * Most clients only ever read the current state. Rather than going through
+ * D-Bus each time, they can map this page and read it directly: we write it
+ * under a sequence lock, so readers never need to take a lock nor wake us
+ * up.
+ *
+ * The page is created on first request. Clients get a read-only descriptor
+ * and the memfd is sealed against resizing and new writable mappings, so
+ * they can neither corrupt the page nor make us fault on it.
+ */
+static CallAudioStatePage *page;
+static int page_fd = -1;
+
+static guint64 n_updates;
+static guint64 n_fds;
+
+static void write_value(int32_t *field, GVariant *state, const gchar *key,
+                        int32_t fallback)
+{
+    guint32 value;
+
+    if (!state || !g_variant_lookup(state, key, "u", &value))
+        value = fallback;
+
+    g_atomic_int_set(field, value);
+}
+
+/* Readers copy the string under the sequence lock, no need for atomics */
+static void write_output(GVariant *state)
+{
+    const gchar *output = NULL;
+
+    if (!state || !g_variant_lookup(state, "output", "&s", &output))
+        output = "";
+
+    /* Pads with NULs, the last one always staying in place */
+    strncpy(page->output, output, sizeof(page->output) - 1);
+}
+
+static gboolean create_page(void)
+{
+    g_autofree gchar *path = NULL;
+    void *map;
+    int fd;
+
+    fd = memfd_create("callaudiod-state", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        g_warning("Unable to create state page: %s", g_strerror(errno));
+        return FALSE;
+    }
+
+    if (ftruncate(fd, sizeof(CallAudioStatePage)) < 0) {
+        g_warning("Unable to size state page: %s", g_strerror(errno));
+        close(fd);
+        return FALSE;
+    }
+
+    map = mmap(NULL, sizeof(CallAudioStatePage), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        g_warning("Unable to map state page: %s", g_strerror(errno));
+        close(fd);
+        return FALSE;
+    }
+
+    /* F_SEAL_FUTURE_WRITE needs Linux 5.1, the read-only fd is enough anyway */
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE) < 0 &&
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0)
+        g_debug("Unable to seal state page: %s", g_strerror(errno));
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SEAL);
+
+    /* Hand out a read-only descriptor, from which no writable mapping is possible */
+    path = g_strdup_printf("/proc/self/fd/%d", fd);
+    page_fd = open(path, O_RDONLY | O_CLOEXEC);
+    close(fd);
+    if (page_fd < 0) {
+        g_warning("Unable to reopen state page read-only: %s", g_strerror(errno));
+        munmap(map, sizeof(CallAudioStatePage));
+        return FALSE;
+    }
+
+    page = map;
+    page->magic = CALLAUDIO_STATE_PAGE_MAGIC;
+    page->version = CALLAUDIO_STATE_PAGE_VERSION;
+
+    g_debug("state page created");
+
+    return TRUE;
+}
+
+/**
+ * cad_state_page_get_fd:
+ * @state: (nullable): the current state, as returned by GetState
+ *
+ * Get a read-only descriptor of the state page, creating it with @state as
+ * its initial contents if needed.
+ *
+ * Returns: the descriptor, owned by the state page, or -1 if shared memory
+ * isn't available.
+ */
+int cad_state_page_get_fd(GVariant *state)
+{
+    if (!page) {
+        if (!create_page())
+            return -1;
+        cad_state_page_update(state);
+        g_atomic_int_set(&page->alive, TRUE);
+    }
+
+    n_fds++;
+
+    return page_fd;
+}
+
+/**
+ * cad_state_page_update:
+ * @state: (nullable): the current state, as returned by GetState
+ *
+ * Publish @state to readers of the state page, if it has been created.
+ */
+void cad_state_page_update(GVariant *state)
+{
+    guint64 generation;
+
+    if (!page)
+        return;
+
+    /* Odd sequence: update in progress */
+    g_atomic_int_inc(&page->sequence);
+
+    write_value(&page->mode, state, "mode", CALL_AUDIO_MODE_UNKNOWN);
+    write_value(&page->speaker, state, "speaker", CALL_AUDIO_SPEAKER_UNKNOWN);
+    write_value(&page->mic, state, "mic", CALL_AUDIO_MIC_UNKNOWN);
+    write_value(&page->volume, state, "volume", 0);
+    write_output(state);
+
+    if (!state || !g_variant_lookup(state, "generation", "t", &generation))
+        generation = 0;
+    g_atomic_int_set(&page->generation, (int32_t)generation);
+
+    g_atomic_int_inc(&page->sequence);
+    n_updates++;
+}
+
+/**
+ * cad_state_page_close:
+ *
+ * Let readers know the state page won't be updated anymore, and release it.
+ */
+void cad_state_page_close(void)
+{
+    if (!page)
+        return;
+
+    g_atomic_int_set(&page->alive, FALSE);
+    munmap(page, sizeof(CallAudioStatePage));
+    page = NULL;
+
+    close(page_fd);
+    page_fd = -1;
+}
+
+void cad_state_page_add_statistics(GVariantDict *dict)
+{
+    g_variant_dict_insert(dict, "state-page-updates", "t", n_updates);
+    g_variant_dict_insert(dict, "state-page-fds", "t", n_fds);
+}
@@ -0,0 +1,19 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+int cad_state_page_get_fd(GVariant *state);
+void cad_state_page_update(GVariant *state);
+void cad_state_page_close(void);
+
+void cad_state_page_add_statistics(GVariantDict *dict);
+
+G_END_DECLS
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "config.h"
+
+/*
+ * Static tracepoints for bpftrace/perf, enabled with the "usdt" build option.
+ * Probes are a single nop when nobody is tracing, and nothing at all when
+ * disabled. All of them belong to the "callaudiod" provider:
+ *
+ *   request(type, value)             a D-Bus request was received
+ *   pa_request(type, caller, issued) a PulseAudio request was sent
+ *   pa_callback(type, callback)      a PulseAudio request callback was called
+ *   pa_event(facility, kind, index)  a PulseAudio subscription event came in
+ *   complete(type, success)          a D-Bus request was answered
+ *
+ * where "type" is the CadOperationType, and "caller" and "callback" are
+ * function names.
+ */
+#ifdef ENABLE_USDT
+
+#include <sys/sdt.h>
+
+#define CAD_TRACE2(name, a1, a2) \
+    DTRACE_PROBE2(callaudiod, name, a1, a2)
+#define CAD_TRACE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(callaudiod, name, a1, a2, a3)
+
+#else
+
+#define CAD_TRACE2(name, a1, a2) do { } while (0)
+#define CAD_TRACE3(name, a1, a2, a3) do { } while (0)
+
+#endif /* ENABLE_USDT */
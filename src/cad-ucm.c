@@ -0,0 +1,721 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-ucm"
+
+#include "cad-config.h"
+#include "cad-events.h"
+#include "cad-manager.h"
+#include "cad-mixer.h"
+#include "cad-objects.h"
+#include "cad-ucm.h"
+
+#include <gio/gio.h>
+#include <alsa/asoundlib.h>
+
+#include <stdlib.h>
+
+#define BACKEND_NAME "ucm"
+
+/*
+ * On images without a sound server, nothing else switches the sound card
+ * between use cases: we drive the ALSA UCM verbs and devices ourselves.
+ *
+ * UCM calls are synchronous and only take a few ioctls, so operations are
+ * completed right away.
+ */
+struct _CadUcm {
+    GObject parent_instance;
+
+    GObject *manager;
+
+    snd_use_case_mgr_t *uc_mgr;
+    gchar *card_name;
+    gchar *verb;
+    GPtrArray *devices;
+    gchar *output_device;
+    gchar *input_device;
+    /* CAD_OUTPUT_MASK() of the outputs the current verb supports */
+    guint available_outputs;
+
+    CallAudioMode audio_mode;
+    CallAudioSpeakerState speaker_state;
+    CallAudioMicState mic_state;
+
+    guint64 n_verb_switches;
+    guint64 n_device_switches;
+    guint64 n_errors;
+    gint64 last_switch_duration;
+};
+
+G_DEFINE_TYPE(CadUcm, cad_ucm, G_TYPE_OBJECT);
+
+/* Devices in order of preference for each purpose */
+static const gchar * const earpiece_devices[] = {
+    SND_USE_CASE_DEV_EARPIECE, SND_USE_CASE_DEV_HANDSET, NULL
+};
+static const gchar * const speaker_devices[] = {
+    SND_USE_CASE_DEV_SPEAKER, NULL
+};
+static const gchar * const mic_devices[] = {
+    SND_USE_CASE_DEV_MIC, "Mic1", "Mic2", NULL
+};
+
+/******************************************************************************
+ * UCM helpers
+ ******************************************************************************/
+
+static gboolean has_device(CadUcm *self, const gchar *device)
+{
+    guint i;
+
+    for (i = 0; i < self->devices->len; i++) {
+        if (g_strcmp0(g_ptr_array_index(self->devices, i), device) == 0)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static const gchar *find_device(CadUcm *self, const gchar * const *candidates)
+{
+    guint i;
+
+    for (i = 0; candidates[i]; i++) {
+        if (has_device(self, candidates[i]))
+            return candidates[i];
+    }
+
+    return NULL;
+}
+
+static CadRouteDirection get_device_direction(const gchar *device)
+{
+    return g_strv_contains(mic_devices, device) ? CAD_ROUTE_INPUT : CAD_ROUTE_OUTPUT;
+}
+
+/*
+ * Find the first playback device of a given kind, see cad_output_from_port()
+ */
+static const gchar *find_output_device(CadUcm *self, CadOutput output)
+{
+    guint i;
+
+    for (i = 0; i < self->devices->len; i++) {
+        const gchar *device = g_ptr_array_index(self->devices, i);
+
+        if (get_device_direction(device) == CAD_ROUTE_OUTPUT &&
+            cad_output_from_port(device) == output)
+            return device;
+    }
+
+    return NULL;
+}
+
+static void update_available_outputs(CadUcm *self)
+{
+    g_auto(GStrv) outputs = NULL;
+    guint mask = 0;
+    guint i;
+
+    for (i = 0; i < self->devices->len; i++) {
+        const gchar *device = g_ptr_array_index(self->devices, i);
+        CadOutput output = cad_output_from_port(device);
+
+        if (get_device_direction(device) == CAD_ROUTE_OUTPUT &&
+            output != CAD_OUTPUT_UNKNOWN)
+            mask |= CAD_OUTPUT_MASK(output);
+    }
+
+    if (self->available_outputs == mask)
+        return;
+
+    self->available_outputs = mask;
+    outputs = cad_output_list(mask);
+    g_object_set(self->manager, "available-outputs", outputs, NULL);
+}
+
+/*
+ * Refresh the list of devices supported by the current verb, and publish
+ * them along with the verb. Devices are listed as (name, comment) pairs.
+ */
+static void update_devices(CadUcm *self)
+{
+    g_autoptr(GPtrArray) previous = self->devices;
+    const char **list;
+    guint j;
+    int n, i;
+
+    self->devices = g_ptr_array_new_with_free_func(g_free);
+
+    cad_objects_set_card(0, self->card_name, self->verb);
+
+    n = snd_use_case_get_list(self->uc_mgr, "_devices", &list);
+    if (n < 0) {
+        g_warning("Unable to list devices of verb '%s': %s",
+                  self->verb, snd_strerror(n));
+    }
+
+    for (i = 0; i < n; i += 2) {
+        g_debug("verb '%s' supports device '%s'", self->verb, list[i]);
+        g_ptr_array_add(self->devices, g_strdup(list[i]));
+        cad_objects_set_route(0, get_device_direction(list[i]), list[i],
+                              list[i + 1], TRUE, 0);
+    }
+
+    if (n > 0)
+        snd_use_case_free_list(list, n);
+
+    /* Devices common to both verbs keep their objects */
+    for (j = 0; j < previous->len; j++) {
+        const gchar *device = g_ptr_array_index(previous, j);
+
+        if (!has_device(self, device))
+            cad_objects_remove_route(0, get_device_direction(device), device);
+    }
+
+    update_available_outputs(self);
+}
+
+static gboolean has_verb(CadUcm *self, const gchar *verb)
+{
+    const char **list;
+    gboolean found = FALSE;
+    int n, i;
+
+    n = snd_use_case_get_list(self->uc_mgr, "_verbs", &list);
+    if (n < 0)
+        return FALSE;
+
+    /* Verbs are listed as (name, comment) pairs too */
+    for (i = 0; i < n && !found; i += 2)
+        found = g_strcmp0(list[i], verb) == 0;
+
+    snd_use_case_free_list(list, n);
+
+    return found;
+}
+
+/*
+ * Ringing keeps the default verb (and the speaker) so the ringtone can be
+ * heard; VoIP calls use their own verb if the card has one, and the default
+ * verb routed like a call otherwise.
+ */
+static const gchar *get_mode_verb(CadUcm *self, guint mode)
+{
+    switch (mode) {
+    case CALL_AUDIO_MODE_CALL:
+        return SND_USE_CASE_VERB_VOICECALL;
+    case CALL_AUDIO_MODE_VOIP:
+        if (has_verb(self, SND_USE_CASE_VERB_IP_VOICECALL))
+            return SND_USE_CASE_VERB_IP_VOICECALL;
+        return SND_USE_CASE_VERB_HIFI;
+    default:
+        return SND_USE_CASE_VERB_HIFI;
+    }
+}
+
+static gboolean is_speaker(const gchar *device)
+{
+    return device && g_strv_contains(speaker_devices, device);
+}
+
+static const gchar *pick_output(CadUcm *self, CallAudioMode mode, gboolean speaker)
+{
+    CadOutput preferred = cad_output_lookup(self->card_name, mode);
+    const gchar *device = NULL;
+
+    /* Honour the output the user selected last time, if it's still there */
+    if (!speaker && preferred != CAD_OUTPUT_SPEAKER && preferred != CAD_OUTPUT_UNKNOWN)
+        device = find_output_device(self, preferred);
+
+    if (!device && (mode == CALL_AUDIO_MODE_CALL || mode == CALL_AUDIO_MODE_VOIP) && !speaker)
+        device = find_device(self, earpiece_devices);
+
+    if (!device)
+        device = find_device(self, speaker_devices);
+
+    return device;
+}
+
+/*
+ * Switch from the current device to @target, either of them being possibly
+ * %NULL. Using "_swdev" rather than disabling then enabling avoids going
+ * through a state where no device is routed.
+ */
+static gboolean switch_device(CadUcm *self, gchar **current, const gchar *target)
+{
+    g_autofree gchar *identifier = NULL;
+    int err;
+
+    if (g_strcmp0(*current, target) == 0)
+        return TRUE;
+
+    g_debug("switching device from '%s' to '%s'", *current, target);
+
+    if (*current && target) {
+        identifier = g_strdup_printf("_swdev/%s", *current);
+        err = snd_use_case_set(self->uc_mgr, identifier, target);
+    } else if (target) {
+        err = snd_use_case_set(self->uc_mgr, "_enadev", target);
+    } else {
+        err = snd_use_case_set(self->uc_mgr, "_disdev", *current);
+    }
+
+    if (err < 0) {
+        g_warning("Unable to switch device from '%s' to '%s': %s",
+                  *current, target, snd_strerror(err));
+        self->n_errors++;
+        return FALSE;
+    }
+
+    self->n_device_switches++;
+    g_free(*current);
+    *current = g_strdup(target);
+
+    if (current == &self->output_device) {
+        cad_events_record(CAD_EVENT_OUTPUT_PORT, 0, 0, target);
+        cad_objects_set_active_route(0, CAD_ROUTE_OUTPUT, target);
+    } else {
+        cad_events_record(CAD_EVENT_INPUT_PORT, 0, 0, target);
+        cad_objects_set_active_route(0, CAD_ROUTE_INPUT, target);
+    }
+
+    return TRUE;
+}
+
+static gboolean set_verb(CadUcm *self, const gchar *verb)
+{
+    int err;
+
+    if (g_strcmp0(self->verb, verb) == 0)
+        return TRUE;
+
+    g_debug("switching verb from '%s' to '%s'", self->verb, verb);
+
+    err = snd_use_case_set(self->uc_mgr, "_verb", verb);
+    if (err < 0) {
+        g_warning("Unable to switch to verb '%s': %s", verb, snd_strerror(err));
+        self->n_errors++;
+        return FALSE;
+    }
+
+    self->n_verb_switches++;
+    g_free(self->verb);
+    self->verb = g_strdup(verb);
+    cad_events_record(CAD_EVENT_PROFILE, 0, 0, verb);
+
+    /* Devices of the previous verb have been disabled along with it */
+    g_clear_pointer(&self->output_device, g_free);
+    g_clear_pointer(&self->input_device, g_free);
+    cad_objects_set_active_route(0, CAD_ROUTE_OUTPUT, NULL);
+    cad_objects_set_active_route(0, CAD_ROUTE_INPUT, NULL);
+    update_devices(self);
+
+    return TRUE;
+}
+
+/*
+ * Pick up the current state, which may have been left behind by a previous
+ * instance or another UCM client.
+ */
+static void init_state(CadUcm *self)
+{
+    const char *verb = NULL;
+    const char **list;
+    int n, i;
+
+    if (snd_use_case_get(self->uc_mgr, "_verb", &verb) < 0 || !verb)
+        verb = NULL;
+
+    self->verb = g_strdup(verb);
+    free((void *)verb);
+
+    if (g_strcmp0(self->verb, SND_USE_CASE_VERB_VOICECALL) == 0)
+        self->audio_mode = CALL_AUDIO_MODE_CALL;
+    else if (g_strcmp0(self->verb, SND_USE_CASE_VERB_IP_VOICECALL) == 0)
+        self->audio_mode = CALL_AUDIO_MODE_VOIP;
+    else if (self->verb && g_strcmp0(self->verb, SND_USE_CASE_VERB_INACTIVE) != 0)
+        self->audio_mode = CALL_AUDIO_MODE_DEFAULT;
+
+    if (!self->verb)
+        return;
+
+    update_devices(self);
+
+    n = snd_use_case_get_list(self->uc_mgr, "_enadevs", &list);
+    for (i = 0; i < n; i++) {
+        if (g_strv_contains(mic_devices, list[i])) {
+            g_free(self->input_device);
+            self->input_device = g_strdup(list[i]);
+        } else if (cad_output_from_port(list[i]) != CAD_OUTPUT_UNKNOWN) {
+            g_free(self->output_device);
+            self->output_device = g_strdup(list[i]);
+        }
+    }
+    if (n > 0)
+        snd_use_case_free_list(list, n);
+
+    if (self->output_device)
+        self->speaker_state = is_speaker(self->output_device) ?
+                              CALL_AUDIO_SPEAKER_ON : CALL_AUDIO_SPEAKER_OFF;
+    self->mic_state = CALL_AUDIO_MIC_ON;
+
+    cad_objects_set_active_route(0, CAD_ROUTE_OUTPUT, self->output_device);
+    cad_objects_set_active_route(0, CAD_ROUTE_INPUT, self->input_device);
+
+    g_debug("verb '%s', output '%s', input '%s'",
+            self->verb, self->output_device, self->input_device);
+}
+
+static void update_mode(CadUcm *self, CallAudioMode mode)
+{
+    if (self->audio_mode != mode) {
+        self->audio_mode = mode;
+        g_object_set(self->manager, "audio-mode", mode, NULL);
+    }
+}
+
+static void update_speaker_state(CadUcm *self, CallAudioSpeakerState state)
+{
+    if (self->speaker_state != state) {
+        self->speaker_state = state;
+        g_object_set(self->manager, "speaker-state", state, NULL);
+    }
+}
+
+static void update_mic_state(CadUcm *self, CallAudioMicState state)
+{
+    if (self->mic_state != state) {
+        self->mic_state = state;
+        g_object_set(self->manager, "mic-state", state, NULL);
+    }
+}
+
+static void check_operation(CadOperation *op, CadOperationType type)
+{
+    /*
+     * Make sure op is of the correct type!
+     */
+    g_assert(op->type == type);
+}
+
+/******************************************************************************
+ * Commands management
+ *
+ * The following functions handle external requests to switch mode, output port
+ * or microphone status
+ ******************************************************************************/
+
+void cad_ucm_select_mode(guint mode, CadOperation *cad_op)
+{
+    CadUcm *self = cad_ucm_get_default();
+    const gchar *verb;
+    gint64 start;
+    gboolean success;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    check_operation(cad_op, CAD_OPERATION_SELECT_MODE);
+    cad_op->value = mode;
+
+    if (!self->uc_mgr) {
+        cad_operation_complete(cad_op, FALSE);
+        return;
+    }
+
+    start = g_get_monotonic_time();
+    verb = get_mode_verb(self, mode);
+
+    success = set_verb(self, verb);
+    if (success) {
+        /*
+         * Start each mode from the earpiece (if any), unless another output
+         * was selected last time, and an active mic
+         */
+        gboolean speaker = cad_output_lookup(self->card_name, mode) == CAD_OUTPUT_SPEAKER;
+
+        switch_device(self, &self->output_device, pick_output(self, mode, speaker));
+        switch_device(self, &self->input_device, find_device(self, mic_devices));
+        cad_mixer_set_mic_mute(FALSE);
+
+        update_mode(self, mode);
+        update_speaker_state(self, is_speaker(self->output_device) ?
+                                   CALL_AUDIO_SPEAKER_ON : CALL_AUDIO_SPEAKER_OFF);
+        update_mic_state(self, CALL_AUDIO_MIC_ON);
+    }
+
+    self->last_switch_duration = g_get_monotonic_time() - start;
+    g_debug("mode switch took %" G_GINT64_FORMAT " us", self->last_switch_duration);
+
+    cad_operation_complete(cad_op, success);
+}
+
+void cad_ucm_enable_speaker(gboolean enable, CadOperation *cad_op)
+{
+    CadUcm *self = cad_ucm_get_default();
+    const gchar *target;
+    gboolean success;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    check_operation(cad_op, CAD_OPERATION_ENABLE_SPEAKER);
+    cad_op->value = (guint)enable;
+
+    if (!self->uc_mgr || !self->verb) {
+        cad_operation_complete(cad_op, FALSE);
+        return;
+    }
+
+    target = pick_output(self, self->audio_mode, enable);
+    if (enable && !is_speaker(target)) {
+        g_warning("verb '%s' has no speaker device", self->verb);
+        cad_operation_complete(cad_op, FALSE);
+        return;
+    }
+
+    success = switch_device(self, &self->output_device, target);
+    if (success)
+        update_speaker_state(self, enable ? CALL_AUDIO_SPEAKER_ON : CALL_AUDIO_SPEAKER_OFF);
+    /* Internal requests, f.e. when ending a call, aren't user choices */
+    if (success && cad_op->invocation) {
+        cad_output_store(self->card_name, self->audio_mode,
+                         enable ? CAD_OUTPUT_SPEAKER : CAD_OUTPUT_UNKNOWN);
+    }
+
+    cad_operation_complete(cad_op, success);
+}
+
+void cad_ucm_select_output(CadOutput output, CadOperation *cad_op)
+{
+    CadUcm *self = cad_ucm_get_default();
+    const gchar *target;
+    gboolean success;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    check_operation(cad_op, CAD_OPERATION_SELECT_OUTPUT);
+    cad_op->value = output;
+
+    if (!self->uc_mgr || !self->verb) {
+        cad_operation_complete(cad_op, FALSE);
+        return;
+    }
+
+    target = find_output_device(self, output);
+    if (!target) {
+        g_warning("verb '%s' has no '%s' device", self->verb,
+                  cad_output_to_string(output));
+        cad_operation_complete(cad_op, FALSE);
+        return;
+    }
+
+    success = switch_device(self, &self->output_device, target);
+    if (success) {
+        update_speaker_state(self, output == CAD_OUTPUT_SPEAKER ?
+                                   CALL_AUDIO_SPEAKER_ON : CALL_AUDIO_SPEAKER_OFF);
+        cad_output_store(self->card_name, self->audio_mode, output);
+    }
+
+    cad_operation_complete(cad_op, success);
+}
+
+/*
+ * UCM has no notion of muting: when no mixer control is configured for that
+ * purpose, the microphone device is disabled altogether.
+ */
+void cad_ucm_mute_mic(gboolean mute, CadOperation *cad_op)
+{
+    CadUcm *self = cad_ucm_get_default();
+    gboolean success;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    check_operation(cad_op, CAD_OPERATION_MUTE_MIC);
+    cad_op->value = (guint)mute;
+
+    success = cad_mixer_set_mic_mute(mute);
+    if (!success && self->uc_mgr && self->verb) {
+        success = switch_device(self, &self->input_device,
+                                mute ? NULL : find_device(self, mic_devices));
+    }
+
+    if (success)
+        update_mic_state(self, mute ? CALL_AUDIO_MIC_OFF : CALL_AUDIO_MIC_ON);
+
+    cad_operation_complete(cad_op, success);
+}
+
+void cad_ucm_set_volume(guint volume, CadOperation *cad_op)
+{
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    check_operation(cad_op, CAD_OPERATION_SET_VOLUME);
+
+    g_debug("volume control isn't supported by the UCM backend");
+    cad_operation_complete(cad_op, FALSE);
+}
+
+CallAudioMode cad_ucm_get_audio_mode(void)
+{
+    return cad_ucm_get_default()->audio_mode;
+}
+
+CallAudioSpeakerState cad_ucm_get_speaker_state(void)
+{
+    return cad_ucm_get_default()->speaker_state;
+}
+
+CallAudioMicState cad_ucm_get_mic_state(void)
+{
+    return cad_ucm_get_default()->mic_state;
+}
+
+guint cad_ucm_get_volume(void)
+{
+    return 0;
+}
+
+void cad_ucm_add_state(GVariantDict *dict)
+{
+    CadUcm *self = cad_ucm_get_default();
+
+    g_variant_dict_insert(dict, "mode", "u", self->audio_mode);
+    g_variant_dict_insert(dict, "speaker", "u", self->speaker_state);
+    g_variant_dict_insert(dict, "mic", "u", self->mic_state);
+    g_variant_dict_insert(dict, "output-port", "s",
+                          self->output_device ? self->output_device : "");
+    g_variant_dict_insert(dict, "input-port", "s",
+                          self->input_device ? self->input_device : "");
+    g_variant_dict_insert(dict, "volume", "u", 0);
+    g_variant_dict_insert(dict, "card", "s",
+                          self->card_name ? self->card_name : "");
+    g_variant_dict_insert(dict, "backend", "s", BACKEND_NAME);
+}
+
+void cad_ucm_add_statistics(GVariantDict *dict)
+{
+    CadUcm *self = cad_ucm_get_default();
+
+    g_variant_dict_insert(dict, "ucm-verb", "s", self->verb ? self->verb : "");
+    g_variant_dict_insert(dict, "ucm-verb-switches", "t", self->n_verb_switches);
+    g_variant_dict_insert(dict, "ucm-device-switches", "t", self->n_device_switches);
+    g_variant_dict_insert(dict, "ucm-errors", "t", self->n_errors);
+    g_variant_dict_insert(dict, "ucm-last-mode-switch-us", "x",
+                          self->last_switch_duration);
+}
+
+/******************************************************************************
+ * GObject base functions
+ ******************************************************************************/
+
+static void dispose(GObject *object)
+{
+    CadUcm *self = CAD_UCM(object);
+
+    if (self->uc_mgr) {
+        snd_use_case_mgr_close(self->uc_mgr);
+        self->uc_mgr = NULL;
+    }
+
+    g_clear_pointer(&self->card_name, g_free);
+    g_clear_pointer(&self->verb, g_free);
+    g_clear_pointer(&self->output_device, g_free);
+    g_clear_pointer(&self->input_device, g_free);
+    g_clear_pointer(&self->devices, g_ptr_array_unref);
+
+    G_OBJECT_CLASS(cad_ucm_parent_class)->dispose(object);
+}
+
+static void cad_ucm_class_init(CadUcmClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+    object_class->dispose = dispose;
+}
+
+static void cad_ucm_init(CadUcm *self)
+{
+    self->manager = G_OBJECT(cad_manager_get_default());
+    self->devices = g_ptr_array_new_with_free_func(g_free);
+    self->audio_mode = CALL_AUDIO_MODE_UNKNOWN;
+    self->speaker_state = CALL_AUDIO_SPEAKER_UNKNOWN;
+    self->mic_state = CALL_AUDIO_MIC_UNKNOWN;
+}
+
+CadUcm *cad_ucm_get_default(void)
+{
+    static CadUcm *ucm = NULL;
+
+    if (ucm == NULL) {
+        g_debug("initializing UCM backend...");
+        ucm = g_object_new(CAD_TYPE_UCM, NULL);
+        g_object_add_weak_pointer(G_OBJECT(ucm), (gpointer *)&ucm);
+    }
+
+    return ucm;
+}
+
+/**
+ * cad_ucm_start:
+ * @error: return location for a #GError
+ *
+ * Open the UCM configuration of the configured sound card.
+ *
+ * Returns: %TRUE on success.
+ */
+gboolean cad_ucm_start(GError **error)
+{
+    CadUcm *self = cad_ucm_get_default();
+    const gchar *config_dir = cad_config_get_ucm_config_dir();
+    const gchar *card = cad_config_get_ucm_card();
+    int err;
+
+    if (self->uc_mgr)
+        return TRUE;
+
+    /*
+     * alsa-lib only looks up its UCM files in a single location, which can
+     * be overridden through the environment: set both variables as we don't
+     * know which UCM version the card's configuration uses.
+     */
+    if (config_dir) {
+        g_debug("using UCM configuration from '%s'", config_dir);
+        g_setenv("ALSA_CONFIG_UCM2", config_dir, TRUE);
+        g_setenv("ALSA_CONFIG_UCM", config_dir, TRUE);
+    }
+
+    err = snd_use_case_mgr_open(&self->uc_mgr, card);
+    if (err < 0) {
+        self->uc_mgr = NULL;
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "Unable to open UCM configuration of card '%s': %s",
+                    card, snd_strerror(err));
+        return FALSE;
+    }
+
+    self->card_name = g_strdup(card);
+    init_state(self);
+
+    cad_manager_update_state(CAD_MANAGER(self->manager));
+
+    return TRUE;
+}
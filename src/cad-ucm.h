@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "libcallaudio.h"
+#include "cad-operation.h"
+#include "cad-output.h"
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define CAD_TYPE_UCM (cad_ucm_get_type())
+
+G_DECLARE_FINAL_TYPE(CadUcm, cad_ucm, CAD, UCM, GObject);
+
+CadUcm *cad_ucm_get_default(void);
+gboolean cad_ucm_start(GError **error);
+void cad_ucm_select_mode(guint mode, CadOperation *op);
+void cad_ucm_enable_speaker(gboolean enable, CadOperation *op);
+void cad_ucm_mute_mic(gboolean mute, CadOperation *op);
+void cad_ucm_set_volume(guint volume, CadOperation *op);
+void cad_ucm_select_output(CadOutput output, CadOperation *op);
+
+CallAudioMode cad_ucm_get_audio_mode(void);
+CallAudioSpeakerState cad_ucm_get_speaker_state(void);
+CallAudioMicState cad_ucm_get_mic_state(void);
+guint cad_ucm_get_volume(void);
+
+void cad_ucm_add_state(GVariantDict *dict);
+void cad_ucm_add_statistics(GVariantDict *dict);
+
+G_END_DECLS
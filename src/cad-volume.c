@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-volume"
+
+#include "cad-volume.h"
+#include "config.h"
+
+#include <glib/gstdio.h>
+
+/*
+ * Volumes are remembered per route, i.e. (card, port, mode), and stored on
+ * disk as a serialized a{su} dictionary keyed by "card|port|mode".
+ * Writes are delayed so a volume slider being dragged doesn't end up
+ * rewriting the file for every step.
+ */
+#define VOLUMES_FILE "route-volumes"
+#define VOLUMES_TYPE "a{su}"
+#define SAVE_DELAY 2 /* seconds */
+
+static GHashTable *volumes;
+static guint save_id;
+static guint64 n_saves;
+
+static gchar *get_volumes_path(void)
+{
+    return g_build_filename(g_get_user_data_dir(), APP_DATA_NAME, VOLUMES_FILE, NULL);
+}
+
+static gchar *route_key(const gchar *card, const gchar *port, CallAudioMode mode)
+{
+    return g_strdup_printf("%s|%s|%u", card, port, mode);
+}
+
+static void load_volumes(void)
+{
+    g_autofree gchar *path = get_volumes_path();
+    g_autoptr(GVariant) dict = NULL;
+    g_autoptr(GError) error = NULL;
+    GVariantIter iter;
+    gchar *contents;
+    gsize length;
+    const gchar *key;
+    guint32 volume;
+
+    volumes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    if (!g_file_get_contents(path, &contents, &length, &error)) {
+        if (!g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_warning("Unable to load route volumes: %s", error->message);
+        return;
+    }
+
+    dict = g_variant_ref_sink(g_variant_new_from_data(G_VARIANT_TYPE(VOLUMES_TYPE),
+                                                      contents, length, FALSE,
+                                                      g_free, contents));
+
+    g_variant_iter_init(&iter, dict);
+    while (g_variant_iter_next(&iter, "{&su}", &key, &volume))
+        g_hash_table_insert(volumes, g_strdup(key), GUINT_TO_POINTER(volume));
+
+    g_debug("loaded %u route volumes", g_hash_table_size(volumes));
+}
+
+static GHashTable *get_volumes(void)
+{
+    if (!volumes)
+        load_volumes();
+
+    return volumes;
+}
+
+static gboolean save_volumes(gpointer data)
+{
+    g_autofree gchar *path = get_volumes_path();
+    g_autofree gchar *dir = g_path_get_dirname(path);
+    g_autoptr(GVariant) dict = NULL;
+    g_autoptr(GError) error = NULL;
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    save_id = 0;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE(VOLUMES_TYPE));
+    g_hash_table_iter_init(&iter, get_volumes());
+    while (g_hash_table_iter_next(&iter, &key, &value))
+        g_variant_builder_add(&builder, "{su}", key, GPOINTER_TO_UINT(value));
+    dict = g_variant_ref_sink(g_variant_builder_end(&builder));
+
+    if (g_mkdir_with_parents(dir, 0700) < 0) {
+        g_warning("Unable to create '%s'", dir);
+        return G_SOURCE_REMOVE;
+    }
+
+    if (!g_file_set_contents(path, g_variant_get_data(dict),
+                             g_variant_get_size(dict), &error)) {
+        g_warning("Unable to save route volumes: %s", error->message);
+        return G_SOURCE_REMOVE;
+    }
+
+    n_saves++;
+    g_debug("saved %u route volumes", g_hash_table_size(volumes));
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * cad_volume_lookup:
+ * @card: the sound card name
+ * @port: the output port name
+ * @mode: the audio mode
+ * @volume: (out): the remembered volume
+ *
+ * Returns: %TRUE if a volume was remembered for this route.
+ */
+gboolean cad_volume_lookup(const gchar   *card,
+                           const gchar   *port,
+                           CallAudioMode  mode,
+                           guint32       *volume)
+{
+    g_autofree gchar *key = NULL;
+    gpointer value;
+
+    if (!card || !port)
+        return FALSE;
+
+    key = route_key(card, port, mode);
+    if (!g_hash_table_lookup_extended(get_volumes(), key, NULL, &value))
+        return FALSE;
+
+    *volume = GPOINTER_TO_UINT(value);
+    return TRUE;
+}
+
+/**
+ * cad_volume_store:
+ * @card: the sound card name
+ * @port: the output port name
+ * @mode: the audio mode
+ * @volume: the volume to remember
+ *
+ * Remember the volume used for this route. It is written to disk shortly
+ * afterwards.
+ */
+void cad_volume_store(const gchar   *card,
+                      const gchar   *port,
+                      CallAudioMode  mode,
+                      guint32        volume)
+{
+    guint32 current;
+
+    if (!card || !port || mode == CALL_AUDIO_MODE_UNKNOWN)
+        return;
+
+    if (cad_volume_lookup(card, port, mode, &current) && current == volume)
+        return;
+
+    g_debug("remembering volume %u for '%s' on '%s' (mode %u)",
+            volume, port, card, mode);
+
+    g_hash_table_insert(get_volumes(), route_key(card, port, mode),
+                        GUINT_TO_POINTER(volume));
+
+    if (!save_id)
+        save_id = g_timeout_add_seconds(SAVE_DELAY, save_volumes, NULL);
+}
+
+/**
+ * cad_volume_flush:
+ *
+ * Write pending changes to disk right away, e.g. before exiting.
+ */
+void cad_volume_flush(void)
+{
+    if (!save_id)
+        return;
+
+    g_source_remove(save_id);
+    save_volumes(NULL);
+}
+
+void cad_volume_add_statistics(GVariantDict *dict)
+{
+    g_variant_dict_insert(dict, "route-volumes", "u",
+                          volumes ? g_hash_table_size(volumes) : 0);
+    g_variant_dict_insert(dict, "route-volumes-saves", "t", n_saves);
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "libcallaudio.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean cad_volume_lookup(const gchar   *card,
+                           const gchar   *port,
+                           CallAudioMode  mode,
+                           guint32       *volume);
+void cad_volume_store(const gchar   *card,
+                      const gchar   *port,
+                      CallAudioMode  mode,
+                      guint32        volume);
+void cad_volume_flush(void);
+
+void cad_volume_add_statistics(GVariantDict *dict);
+
+G_END_DECLS
@@ -8,8 +8,16 @@
 #define G_LOG_DOMAIN "callaudiod"
 
 #include "callaudiod.h"
+#include "cad-config.h"
 #include "cad-manager.h"
-#include "cad-pulse.h"
+#include "cad-mixer.h"
+#include "cad-objects.h"
+#include "cad-output.h"
+#include "cad-backend.h"
+#include "cad-peer.h"
+#include "cad-realtime.h"
+#include "cad-state-page.h"
+#include "cad-volume.h"
 #include "config.h"
 
 #include <glib.h>
@@ -37,8 +45,10 @@ static void bus_acquired_cb(GDBusConnection *connection, const gchar *name,
 
     g_debug("Bus acquired, creating manager...");
 
+    cad_manager_update_state(manager);
     g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(manager),
                                      connection, CALLAUDIO_DBUS_PATH, NULL);
+    cad_objects_export(connection);
 }
 
 
@@ -66,13 +76,39 @@ static void name_lost_cb(GDBusConnection *connection, const gchar *name,
 
 int main(int argc, char **argv)
 {
+    GOptionContext *context;
+    GError *error = NULL;
+
+    context = g_option_context_new("- call audio routing daemon");
+    g_option_context_set_main_group(context, cad_config_get_option_group());
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    cad_realtime_setup();
+
     g_unix_signal_add(SIGTERM, quit_cb, NULL);
     g_unix_signal_add(SIGINT, quit_cb, NULL);
 
     main_loop = g_main_loop_new(NULL, FALSE);
 
-    // Initialize the PulseAudio backend
-    cad_pulse_get_default();
+    // Initialize the audio backend
+    if (!cad_backend_init(cad_config_get_backend(), &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        g_main_loop_unref(main_loop);
+        return 1;
+    }
+
+    // Allow clients to bypass the bus daemon
+    if (!cad_peer_start(cad_manager_get_default(), &error)) {
+        g_warning("Unable to start peer-to-peer server: %s", error->message);
+        g_clear_error(&error);
+    }
 
     g_bus_own_name(CALLAUDIO_DBUS_TYPE, CALLAUDIO_DBUS_NAME,
                    G_BUS_NAME_OWNER_FLAGS_NONE,
@@ -80,7 +116,16 @@ int main(int argc, char **argv)
                    NULL, NULL);
 
     g_main_loop_run(main_loop);
+
+    cad_backend_shutdown();
+
     g_main_loop_unref(main_loop);
 
+    cad_peer_stop();
+    cad_volume_flush();
+    cad_output_flush();
+    cad_mixer_close();
+    cad_state_page_close();
+
     return 0;
 }
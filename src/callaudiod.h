@@ -6,7 +6,40 @@
 
 #pragma once
 
+#include <stdint.h>
+
 #define CALLAUDIO_DBUS_NAME "org.mobian_project.CallAudio"
 #define CALLAUDIO_DBUS_PATH "/org/mobian_project/CallAudio"
 
+#define CALLAUDIO_DBUS_ERROR_SUPERSEDED CALLAUDIO_DBUS_NAME ".Error.Superseded"
+
 #define CALLAUDIO_DBUS_TYPE G_BUS_TYPE_SESSION
+
+#define CALLAUDIO_STATE_PAGE_MAGIC 0x50444143 /* "CADP" */
+#define CALLAUDIO_STATE_PAGE_VERSION 1
+#define CALLAUDIO_STATE_PAGE_OUTPUT_SIZE 16
+
+/*
+ * Layout of the shared state page handed out by GetStatePage. The daemon
+ * increments @sequence before and after each update, so readers have to
+ * retry while it's odd or if it changed while they were reading.
+ *
+ * @generation holds the lower 32 bits of the "generation" GetState reports,
+ * so readers can tell whether they missed an update, and @output the
+ * CALL_AUDIO_OUTPUT_* identifier of the selected output ("" if unknown).
+ *
+ * @alive is cleared when the daemon exits, but not if it crashes: readers
+ * must also make sure the daemon is still around before trusting it.
+ */
+typedef struct {
+    int32_t magic;
+    int32_t version;
+    int32_t sequence;
+    int32_t alive;
+    int32_t mode;
+    int32_t speaker;
+    int32_t mic;
+    int32_t volume;
+    int32_t generation;
+    char output[CALLAUDIO_STATE_PAGE_OUTPUT_SIZE];
+} CallAudioStatePage;
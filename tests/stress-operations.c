@@ -0,0 +1,582 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "stress-operations"
+
+#include "callaudiod.h"
+#include "cad-backend.h"
+#include "cad-manager.h"
+#include "cad-operation.h"
+#include "cad-realtime.h"
+
+#include <gio/gio.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdlib.h>
+
+/*
+ * Stress the operation path without any sound server: the manager is driven
+ * by several clients over private D-Bus connections, and backed by a fake
+ * backend which completes, fails, drops and supersedes operations at random.
+ * Once all clients are done, every request must have been answered, no
+ * operation may be left alive, and what the manager publishes must match the
+ * fake backend's state.
+ *
+ * The clients are raw GDBus connections rather than libcallaudio, which only
+ * talks to the session bus.
+ */
+
+#define N_CLIENTS       4
+#define CLIENT_DEPTH    8
+#define N_REQUESTS      20000
+#define CALL_TIMEOUT    5 /* seconds */
+#define RUN_TIMEOUT     60 /* seconds */
+#define MAX_DELAY       2 /* milliseconds */
+
+typedef struct {
+    GDBusConnection *connection;
+} StressClient;
+
+static GRand *prng;
+static GMainLoop *loop;
+static StressClient clients[N_CLIENTS];
+static guint64 n_issued;
+static guint64 n_answered;
+static guint64 n_succeeded;
+static guint64 n_superseded;
+static guint64 n_failed;
+static guint64 n_unexpected;
+
+/******************************************************************************
+ * Fake backend
+ ******************************************************************************/
+
+static CallAudioMode audio_mode = CALL_AUDIO_MODE_DEFAULT;
+static CallAudioSpeakerState speaker_state = CALL_AUDIO_SPEAKER_OFF;
+static CallAudioMicState mic_state = CALL_AUDIO_MIC_ON;
+static guint volume = 50;
+static CadOutput output = CAD_OUTPUT_EARPIECE;
+
+/* Operations the fake backend holds a reference on */
+static guint n_held;
+
+static gboolean fake_init(GError **error)
+{
+    return TRUE;
+}
+
+static void commit_state(CadOperation *op)
+{
+    CadManager *manager = cad_manager_get_default();
+
+    switch (op->type) {
+    case CAD_OPERATION_SELECT_MODE:
+        audio_mode = op->value;
+        g_object_set(manager, "audio-mode", audio_mode, NULL);
+        break;
+    case CAD_OPERATION_ENABLE_SPEAKER:
+        speaker_state = op->value ? CALL_AUDIO_SPEAKER_ON : CALL_AUDIO_SPEAKER_OFF;
+        g_object_set(manager, "speaker-state", speaker_state, NULL);
+        break;
+    case CAD_OPERATION_MUTE_MIC:
+        mic_state = op->value ? CALL_AUDIO_MIC_OFF : CALL_AUDIO_MIC_ON;
+        g_object_set(manager, "mic-state", mic_state, NULL);
+        break;
+    case CAD_OPERATION_SET_VOLUME:
+        volume = op->value;
+        g_object_set(manager, "volume", volume, NULL);
+        break;
+    case CAD_OPERATION_SELECT_OUTPUT:
+        output = op->value;
+        cad_manager_update_state(manager);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static gboolean finish_cb(gpointer data)
+{
+    CadOperation *op = data;
+
+    /* Same as the real backends: superseded operations leave the state alone */
+    if (cad_operation_is_superseded(op)) {
+        cad_operation_cancel(op);
+    } else if (g_rand_int_range(prng, 0, 10) == 0) {
+        cad_operation_complete(op, FALSE);
+    } else {
+        commit_state(op);
+        cad_operation_complete(op, TRUE);
+    }
+
+    n_held--;
+    cad_operation_unref(op);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Process @op the way a backend waiting on the sound server would: mostly
+ * later on, sometimes right away, and sometimes losing it altogether, in
+ * which case dropping the reference must still answer the client.
+ */
+static void process(CadOperation *op, guint value)
+{
+    op->value = value;
+    n_held++;
+    cad_operation_ref(op);
+
+    switch (g_rand_int_range(prng, 0, 10)) {
+    case 0:
+        finish_cb(op);
+        break;
+    case 1:
+        n_held--;
+        cad_operation_unref(op);
+        break;
+    default:
+        g_timeout_add(g_rand_int_range(prng, 0, MAX_DELAY + 1), finish_cb, op);
+        break;
+    }
+}
+
+static void fake_select_mode(guint mode, CadOperation *op)
+{
+    /* Leaving a call implicitly unmutes the mic, as the real backends do */
+    if (mode == CALL_AUDIO_MODE_DEFAULT) {
+        CadOperation *unmute_op = cad_operation_new(CAD_OPERATION_MUTE_MIC,
+                                                    NULL, NULL, NULL);
+
+        process(unmute_op, FALSE);
+        cad_operation_unref(unmute_op);
+    }
+
+    process(op, mode);
+}
+
+static void fake_enable_speaker(gboolean enable, CadOperation *op)
+{
+    process(op, enable);
+}
+
+static void fake_mute_mic(gboolean mute, CadOperation *op)
+{
+    process(op, mute);
+}
+
+static void fake_set_volume(guint value, CadOperation *op)
+{
+    process(op, value);
+}
+
+static void fake_select_output(CadOutput value, CadOperation *op)
+{
+    process(op, value);
+}
+
+static CallAudioMode fake_get_audio_mode(void)
+{
+    return audio_mode;
+}
+
+static CallAudioSpeakerState fake_get_speaker_state(void)
+{
+    return speaker_state;
+}
+
+static CallAudioMicState fake_get_mic_state(void)
+{
+    return mic_state;
+}
+
+static guint fake_get_volume(void)
+{
+    return volume;
+}
+
+static void fake_add_state(GVariantDict *dict)
+{
+    g_variant_dict_insert(dict, "mode", "u", audio_mode);
+    g_variant_dict_insert(dict, "speaker", "u", speaker_state);
+    g_variant_dict_insert(dict, "mic", "u", mic_state);
+    g_variant_dict_insert(dict, "output-port", "s", cad_output_to_string(output));
+    g_variant_dict_insert(dict, "volume", "u", volume);
+    g_variant_dict_insert(dict, "backend", "s", "fake");
+}
+
+static void fake_add_statistics(GVariantDict *dict)
+{
+}
+
+static const CadBackend fake_backend = {
+    .name = "fake",
+    .init = fake_init,
+    .select_mode = fake_select_mode,
+    .enable_speaker = fake_enable_speaker,
+    .mute_mic = fake_mute_mic,
+    .set_volume = fake_set_volume,
+    .select_output = fake_select_output,
+    .get_audio_mode = fake_get_audio_mode,
+    .get_speaker_state = fake_get_speaker_state,
+    .get_mic_state = fake_get_mic_state,
+    .get_volume = fake_get_volume,
+    .add_state = fake_add_state,
+    .add_statistics = fake_add_statistics,
+};
+
+/******************************************************************************
+ * Clients
+ ******************************************************************************/
+
+static void issue_request(StressClient *client);
+
+static void request_done_cb(GObject *source, GAsyncResult *result, gpointer data)
+{
+    StressClient *client = data;
+    g_autoptr(GVariant) reply = NULL;
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *remote_error = NULL;
+
+    n_answered++;
+
+    reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), result, &error);
+    if (error && g_dbus_error_is_remote_error(error))
+        remote_error = g_dbus_error_get_remote_error(error);
+
+    if (reply) {
+        n_succeeded++;
+    } else if (g_strcmp0(remote_error, CALLAUDIO_DBUS_ERROR_SUPERSEDED) == 0) {
+        n_superseded++;
+    } else if (g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED)) {
+        n_failed++;
+    } else {
+        /* F.e. a timeout: the manager never answered */
+        g_printerr("unexpected error: %s\n", error->message);
+        n_unexpected++;
+    }
+
+    if (n_issued < N_REQUESTS)
+        issue_request(client);
+    else if (n_answered == n_issued)
+        g_main_loop_quit(loop);
+}
+
+static void issue_request(StressClient *client)
+{
+    const gchar *method;
+    GVariant *parameters;
+
+    switch (g_rand_int_range(prng, 0, 5)) {
+    case 0:
+        method = "SelectMode";
+        parameters = g_variant_new("(u)", g_rand_int_range(prng, CALL_AUDIO_MODE_DEFAULT,
+                                                           CALL_AUDIO_MODE_VOIP + 1));
+        break;
+    case 1:
+        method = "EnableSpeaker";
+        parameters = g_variant_new("(b)", g_rand_boolean(prng));
+        break;
+    case 2:
+        method = "MuteMic";
+        parameters = g_variant_new("(b)", g_rand_boolean(prng));
+        break;
+    case 3:
+        method = "SetVolume";
+        parameters = g_variant_new("(u)", g_rand_int_range(prng, 0, 101));
+        break;
+    default:
+        method = "SelectOutput";
+        parameters = g_variant_new("(s)", cad_output_to_string(g_rand_int_range(prng,
+                                                                                CAD_OUTPUT_EARPIECE,
+                                                                                CAD_OUTPUT_UNKNOWN)));
+        break;
+    }
+
+    n_issued++;
+    g_dbus_connection_call(client->connection, NULL, CALLAUDIO_DBUS_PATH,
+                           CALLAUDIO_DBUS_NAME, method, parameters, NULL,
+                           G_DBUS_CALL_FLAGS_NONE, CALL_TIMEOUT * 1000, NULL,
+                           request_done_cb, client);
+}
+
+/******************************************************************************
+ * Private connections
+ ******************************************************************************/
+
+static void connection_ready_cb(GObject *source, GAsyncResult *result, gpointer data)
+{
+    GDBusConnection **connection = data;
+    g_autoptr(GError) error = NULL;
+
+    *connection = g_dbus_connection_new_finish(result, &error);
+    if (!*connection)
+        g_error("Unable to set up connection: %s", error->message);
+}
+
+/* Both ends of a connection, authenticated over a socket pair */
+static void connect_client(GDBusConnection **server, GDBusConnection **client)
+{
+    g_autofree gchar *guid = g_dbus_generate_guid();
+    GDBusConnectionFlags flags;
+    int fds[2];
+    guint i;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        g_error("Unable to create socket pair: %s", g_strerror(errno));
+
+    for (i = 0; i < 2; i++) {
+        g_autoptr(GError) error = NULL;
+        g_autoptr(GSocket) socket = g_socket_new_from_fd(fds[i], &error);
+        g_autoptr(GSocketConnection) stream = NULL;
+
+        if (!socket)
+            g_error("Unable to wrap socket: %s", error->message);
+
+        stream = g_socket_connection_factory_create_connection(socket);
+        flags = i == 0 ?
+            G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_SERVER |
+            G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_ALLOW_ANONYMOUS :
+            G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT;
+        g_dbus_connection_new(G_IO_STREAM(stream), i == 0 ? guid : NULL, flags,
+                              NULL, NULL, connection_ready_cb,
+                              i == 0 ? server : client);
+    }
+
+    while (!*server || !*client)
+        g_main_context_iteration(NULL, TRUE);
+}
+
+/******************************************************************************
+ * Checks
+ ******************************************************************************/
+
+static gboolean run_timeout_cb(gpointer data)
+{
+    g_printerr("%" G_GUINT64_FORMAT " requests still unanswered after %u seconds\n",
+               n_issued - n_answered, RUN_TIMEOUT);
+    g_main_loop_quit(loop);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void async_result_cb(GObject *source, GAsyncResult *result, gpointer data)
+{
+    GAsyncResult **out = data;
+
+    *out = g_object_ref(result);
+}
+
+/* The manager answers from this thread, so the call can't block it */
+static GVariant *get_state(GDBusConnection *connection)
+{
+    g_autoptr(GAsyncResult) result = NULL;
+    g_autoptr(GVariant) reply = NULL;
+    g_autoptr(GError) error = NULL;
+    GVariant *state;
+
+    g_dbus_connection_call(connection, NULL, CALLAUDIO_DBUS_PATH, CALLAUDIO_DBUS_NAME,
+                           "GetState", NULL, G_VARIANT_TYPE("(a{sv})"),
+                           G_DBUS_CALL_FLAGS_NONE, CALL_TIMEOUT * 1000, NULL,
+                           async_result_cb, &result);
+    while (!result)
+        g_main_context_iteration(NULL, TRUE);
+
+    reply = g_dbus_connection_call_finish(connection, result, &error);
+    if (!reply)
+        g_error("Unable to get state: %s", error->message);
+
+    g_variant_get(reply, "(@a{sv})", &state);
+
+    return state;
+}
+
+static gboolean check_value(const gchar *what, guint value, guint expected)
+{
+    if (value == expected)
+        return TRUE;
+
+    g_printerr("FAIL: %s is %u, the backend has %u\n", what, value, expected);
+
+    return FALSE;
+}
+
+static gboolean check_state_key(GVariant *state, const gchar *key, guint expected)
+{
+    g_autofree gchar *what = g_strdup_printf("state '%s'", key);
+    guint value;
+
+    if (!g_variant_lookup(state, key, "u", &value)) {
+        g_printerr("FAIL: state '%s' is missing\n", key);
+        return FALSE;
+    }
+
+    return check_value(what, value, expected);
+}
+
+/*
+ * Whatever the order requests completed, failed or were superseded in, the
+ * manager's properties and state snapshot must end up matching the backend.
+ */
+static gboolean check_final_state(CadManager *manager, GDBusConnection *connection)
+{
+    g_autoptr(GVariant) state = NULL;
+    const gchar *output_port = NULL;
+    guint manager_mode, manager_speaker, manager_mic, manager_volume;
+    gboolean ok = TRUE;
+
+    g_object_get(manager,
+                 "audio-mode", &manager_mode,
+                 "speaker-state", &manager_speaker,
+                 "mic-state", &manager_mic,
+                 "volume", &manager_volume,
+                 NULL);
+
+    ok &= check_value("audio-mode", manager_mode, audio_mode);
+    ok &= check_value("speaker-state", manager_speaker, speaker_state);
+    ok &= check_value("mic-state", manager_mic, mic_state);
+    ok &= check_value("volume", manager_volume, volume);
+
+    state = get_state(connection);
+    ok &= check_state_key(state, "mode", audio_mode);
+    ok &= check_state_key(state, "speaker", speaker_state);
+    ok &= check_state_key(state, "mic", mic_state);
+    ok &= check_state_key(state, "volume", volume);
+
+    g_variant_lookup(state, "output-port", "&s", &output_port);
+    if (g_strcmp0(output_port, cad_output_to_string(output)) != 0) {
+        g_printerr("FAIL: state 'output-port' is '%s', the backend has '%s'\n",
+                   output_port, cad_output_to_string(output));
+        ok = FALSE;
+    }
+
+    return ok;
+}
+
+static guint64 get_rss(void)
+{
+    GVariantDict stats;
+    guint64 rss = 0;
+
+    g_variant_dict_init(&stats, NULL);
+    cad_realtime_add_statistics(&stats);
+    g_variant_dict_lookup(&stats, "memory-rss-kb", "t", &rss);
+    g_variant_dict_clear(&stats);
+
+    return rss;
+}
+
+static guint64 get_statistic(GVariantDict *dict, const gchar *key)
+{
+    g_autoptr(GVariant) value = g_variant_dict_lookup_value(dict, key, NULL);
+
+    if (!value)
+        g_error("statistic '%s' is missing", key);
+
+    if (g_variant_is_of_type(value, G_VARIANT_TYPE_UINT32))
+        return g_variant_get_uint32(value);
+
+    return g_variant_get_uint64(value);
+}
+
+int main(int argc, char **argv)
+{
+    CadManager *manager;
+    GDBusConnection *server_connections[N_CLIENTS] = { NULL };
+    g_autoptr(GError) error = NULL;
+    GVariantDict stats;
+    guint64 n_alive, n_outstanding;
+    guint64 rss_before, rss_after;
+    guint32 seed;
+    gboolean ok = TRUE;
+    guint timeout_id;
+    guint i;
+
+    seed = argc > 1 ? strtoul(argv[1], NULL, 10) : g_random_int();
+    g_print("seed %u\n", seed);
+    prng = g_rand_new_with_seed(seed);
+    loop = g_main_loop_new(NULL, FALSE);
+
+    cad_backend_set_default(&fake_backend);
+    manager = cad_manager_get_default();
+    /* Same as the real backends once they know the initial state */
+    g_object_set(manager,
+                 "audio-mode", audio_mode,
+                 "speaker-state", speaker_state,
+                 "mic-state", mic_state,
+                 "volume", volume,
+                 NULL);
+
+    for (i = 0; i < N_CLIENTS; i++) {
+        connect_client(&server_connections[i], &clients[i].connection);
+        if (!g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(manager),
+                                              server_connections[i],
+                                              CALLAUDIO_DBUS_PATH, &error))
+            g_error("Unable to export manager: %s", error->message);
+    }
+
+    rss_before = get_rss();
+
+    for (i = 0; i < N_CLIENTS * CLIENT_DEPTH; i++)
+        issue_request(&clients[i % N_CLIENTS]);
+
+    timeout_id = g_timeout_add_seconds(RUN_TIMEOUT, run_timeout_cb, NULL);
+    g_main_loop_run(loop);
+    g_source_remove(timeout_id);
+
+    /* Let the fake backend finish whatever it still holds */
+    while (n_held > 0 && g_main_context_iteration(NULL, TRUE))
+        ;
+    /* ...and the manager publish the outcome */
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+
+    rss_after = get_rss();
+
+    g_print("%" G_GUINT64_FORMAT " requests: %" G_GUINT64_FORMAT " succeeded, %"
+            G_GUINT64_FORMAT " superseded, %" G_GUINT64_FORMAT " failed\n",
+            n_issued, n_succeeded, n_superseded, n_failed);
+    /* For information only, the allocator may well keep what it got */
+    g_print("RSS %" G_GUINT64_FORMAT " kB -> %" G_GUINT64_FORMAT " kB\n",
+            rss_before, rss_after);
+
+    g_variant_dict_init(&stats, NULL);
+    cad_operation_add_statistics(&stats);
+    n_alive = get_statistic(&stats, "operations-alive");
+    n_outstanding = get_statistic(&stats, "invocations-outstanding");
+    g_variant_dict_clear(&stats);
+
+    if (n_answered != n_issued) {
+        g_printerr("FAIL: %" G_GUINT64_FORMAT " requests never answered\n",
+                   n_issued - n_answered);
+        ok = FALSE;
+    }
+    if (n_unexpected > 0) {
+        g_printerr("FAIL: %" G_GUINT64_FORMAT " unexpected errors\n", n_unexpected);
+        ok = FALSE;
+    }
+    if (n_alive > 0) {
+        g_printerr("FAIL: %" G_GUINT64_FORMAT " operations leaked\n", n_alive);
+        ok = FALSE;
+    }
+    if (n_outstanding > 0) {
+        g_printerr("FAIL: %" G_GUINT64_FORMAT " invocations left unanswered\n",
+                   n_outstanding);
+        ok = FALSE;
+    }
+    if (!check_final_state(manager, clients[0].connection))
+        ok = FALSE;
+
+    for (i = 0; i < N_CLIENTS; i++) {
+        g_dbus_interface_skeleton_unexport_from_connection(G_DBUS_INTERFACE_SKELETON(manager),
+                                                           server_connections[i]);
+        g_object_unref(server_connections[i]);
+        g_object_unref(clients[i].connection);
+    }
+    g_main_loop_unref(loop);
+    g_rand_free(prng);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "test-ducking"
+
+#include "cad-ducking.h"
+
+/*
+ * Check which streams get lowered in each audio mode: during VoIP calls, the
+ * call audio may come from streams without the "phone" role, which must stay
+ * audible.
+ */
+
+static gboolean is_ducked(CallAudioMode mode, const gchar *role)
+{
+    pa_proplist *proplist = pa_proplist_new();
+    gboolean ducked;
+
+    pa_proplist_sets(proplist, PA_PROP_APPLICATION_NAME, "test");
+    if (role)
+        pa_proplist_sets(proplist, PA_PROP_MEDIA_ROLE, role);
+
+    ducked = cad_ducking_is_wanted(mode) && cad_ducking_should_duck(proplist);
+    pa_proplist_free(proplist);
+
+    return ducked;
+}
+
+static void test_voice_call(void)
+{
+    g_assert_true(is_ducked(CALL_AUDIO_MODE_CALL, "music"));
+    g_assert_true(is_ducked(CALL_AUDIO_MODE_CALL, NULL));
+    g_assert_false(is_ducked(CALL_AUDIO_MODE_CALL, "phone"));
+}
+
+static void test_voip_call(void)
+{
+    /* F.e. WebRTC in a browser, or Telegram, which don't set a role */
+    g_assert_false(is_ducked(CALL_AUDIO_MODE_VOIP, NULL));
+    g_assert_false(is_ducked(CALL_AUDIO_MODE_VOIP, "video"));
+    g_assert_false(is_ducked(CALL_AUDIO_MODE_VOIP, "phone"));
+}
+
+static void test_other_modes(void)
+{
+    g_assert_false(is_ducked(CALL_AUDIO_MODE_DEFAULT, "music"));
+    g_assert_false(is_ducked(CALL_AUDIO_MODE_RINGING, "music"));
+    g_assert_false(is_ducked(CALL_AUDIO_MODE_UNKNOWN, "music"));
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/ducking/voice-call", test_voice_call);
+    g_test_add_func("/ducking/voip-call", test_voip_call);
+    g_test_add_func("/ducking/other-modes", test_other_modes);
+
+    return g_test_run();
+}
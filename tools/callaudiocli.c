@@ -9,6 +9,216 @@
 #include "libcallaudio-enums.h"
 
 #include <glib.h>
+#include <stdlib.h>
+
+/*
+ * Stress mode: keep a few random requests in flight for a while, then check
+ * that the daemon answered all of them, that its final state matches the
+ * last requests and that it didn't grow. Run several instances at once to
+ * simulate concurrent clients. This runs against the live daemon, see
+ * tests/stress-operations.c for a self-contained version.
+ */
+#define STRESS_DEPTH 8
+#define STRESS_GRACE_SECONDS 10
+
+enum {
+    STRESS_MODE = 0,
+    STRESS_SPEAKER,
+    STRESS_MIC,
+    STRESS_VOLUME,
+    N_STRESS_TYPES
+};
+
+typedef struct {
+    GMainLoop *loop;
+    gint64 deadline;
+    guint in_flight;
+    guint64 seq;
+    guint64 n_issued;
+    guint64 n_succeeded;
+    guint64 n_failed;
+    /* Last request of each type: sequence number, value and result */
+    guint64 last_seq[N_STRESS_TYPES];
+    guint last_value[N_STRESS_TYPES];
+    gboolean last_success[N_STRESS_TYPES];
+} StressData;
+
+typedef struct {
+    StressData *stress;
+    guint type;
+    guint64 seq;
+} StressRequest;
+
+static void stress_issue(StressData *stress);
+
+static void stress_done_cb(gboolean success, GError *error, gpointer data)
+{
+    StressRequest *request = data;
+    StressData *stress = request->stress;
+
+    stress->in_flight--;
+    if (success)
+        stress->n_succeeded++;
+    else
+        stress->n_failed++;
+
+    if (request->seq == stress->last_seq[request->type])
+        stress->last_success[request->type] = success;
+
+    g_free(request);
+
+    if (g_get_monotonic_time() < stress->deadline)
+        stress_issue(stress);
+    else if (stress->in_flight == 0)
+        g_main_loop_quit(stress->loop);
+}
+
+static void stress_issue(StressData *stress)
+{
+    StressRequest *request = g_new0(StressRequest, 1);
+    guint value;
+
+    request->stress = stress;
+    request->type = g_random_int_range(0, N_STRESS_TYPES);
+    request->seq = ++stress->seq;
+
+    switch (request->type) {
+    case STRESS_MODE:
+        value = g_random_int_range(CALL_AUDIO_MODE_DEFAULT, CALL_AUDIO_MODE_VOIP + 1);
+        call_audio_select_mode_async(value, stress_done_cb, request);
+        break;
+    case STRESS_SPEAKER:
+        value = g_random_boolean();
+        call_audio_enable_speaker_async(value, stress_done_cb, request);
+        break;
+    case STRESS_MIC:
+        value = g_random_boolean();
+        call_audio_mute_mic_async(value, stress_done_cb, request);
+        break;
+    default:
+        value = g_random_int_range(0, 101);
+        call_audio_set_volume_async(value, stress_done_cb, request);
+        break;
+    }
+
+    stress->last_seq[request->type] = request->seq;
+    stress->last_value[request->type] = value;
+    stress->last_success[request->type] = FALSE;
+    stress->in_flight++;
+    stress->n_issued++;
+}
+
+static gboolean stress_timeout_cb(gpointer data)
+{
+    StressData *stress = data;
+
+    g_main_loop_quit(stress->loop);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * A request is only expected to stick if it succeeded and no later request
+ * could override it: switching modes resets the speaker and mic, and
+ * switching routes restores the route's volume.
+ */
+static gboolean stress_check_state(StressData *stress)
+{
+    g_autoptr(GVariant) state = call_audio_get_state(NULL);
+    guint64 *last = stress->last_seq;
+    gboolean ok = TRUE;
+    guint value;
+
+    if (!state)
+        return FALSE;
+
+    if (last[STRESS_MODE] && stress->last_success[STRESS_MODE] &&
+        g_variant_lookup(state, "mode", "u", &value) &&
+        value != stress->last_value[STRESS_MODE]) {
+        g_print("Mode is %u, expected %u\n", value, stress->last_value[STRESS_MODE]);
+        ok = FALSE;
+    }
+
+    if (last[STRESS_SPEAKER] > last[STRESS_MODE] && stress->last_success[STRESS_SPEAKER] &&
+        g_variant_lookup(state, "speaker", "u", &value) &&
+        value != (stress->last_value[STRESS_SPEAKER] ? CALL_AUDIO_SPEAKER_ON :
+                                                       CALL_AUDIO_SPEAKER_OFF)) {
+        g_print("Speaker state is %u, expected %s\n", value,
+                stress->last_value[STRESS_SPEAKER] ? "on" : "off");
+        ok = FALSE;
+    }
+
+    if (last[STRESS_MIC] > last[STRESS_MODE] && stress->last_success[STRESS_MIC] &&
+        g_variant_lookup(state, "mic", "u", &value) &&
+        value != (stress->last_value[STRESS_MIC] ? CALL_AUDIO_MIC_OFF :
+                                                   CALL_AUDIO_MIC_ON)) {
+        g_print("Mic state is %u, expected %s\n", value,
+                stress->last_value[STRESS_MIC] ? "muted" : "unmuted");
+        ok = FALSE;
+    }
+
+    if (last[STRESS_VOLUME] > MAX(last[STRESS_MODE], last[STRESS_SPEAKER]) &&
+        stress->last_success[STRESS_VOLUME] &&
+        g_variant_lookup(state, "volume", "u", &value) &&
+        value != stress->last_value[STRESS_VOLUME]) {
+        g_print("Volume is %u%%, expected %u%%\n", value, stress->last_value[STRESS_VOLUME]);
+        ok = FALSE;
+    }
+
+    return ok;
+}
+
+static gboolean run_stress(int seconds)
+{
+    g_autoptr(GVariant) stats_before = call_audio_get_statistics(NULL);
+    g_autoptr(GVariant) stats_after = NULL;
+    StressData stress = { 0 };
+    guint64 rss_before = 0;
+    guint64 rss_after = 0;
+    guint64 outstanding = 0;
+    gboolean consistent;
+    guint timeout_id;
+    guint i;
+
+    stress.loop = g_main_loop_new(NULL, FALSE);
+    stress.deadline = g_get_monotonic_time() + seconds * G_USEC_PER_SEC;
+
+    for (i = 0; i < STRESS_DEPTH; i++)
+        stress_issue(&stress);
+
+    timeout_id = g_timeout_add_seconds(seconds + STRESS_GRACE_SECONDS,
+                                       stress_timeout_cb, &stress);
+    g_main_loop_run(stress.loop);
+    g_main_loop_unref(stress.loop);
+    if (stress.in_flight == 0)
+        g_source_remove(timeout_id);
+
+    consistent = stress.in_flight == 0 && stress_check_state(&stress);
+
+    stats_after = call_audio_get_statistics(NULL);
+    if (stats_before)
+        g_variant_lookup(stats_before, "memory-rss-kb", "t", &rss_before);
+    if (stats_after) {
+        g_variant_lookup(stats_after, "memory-rss-kb", "t", &rss_after);
+        g_variant_lookup(stats_after, "invocations-outstanding", "t", &outstanding);
+    }
+
+    g_print("Issued %" G_GUINT64_FORMAT " requests in %d s: "
+            "%" G_GUINT64_FORMAT " succeeded, %" G_GUINT64_FORMAT " failed, "
+            "%u never answered\n",
+            stress.n_issued, seconds, stress.n_succeeded, stress.n_failed,
+            stress.in_flight);
+    g_print("Daemon: %" G_GUINT64_FORMAT " requests outstanding, "
+            "RSS %" G_GUINT64_FORMAT " kB -> %" G_GUINT64_FORMAT " kB\n",
+            outstanding, rss_before, rss_after);
+    g_print("Final state: %s\n", consistent ? "consistent" : "INCONSISTENT");
+
+    /* Requests we gave up on keep a pointer to the stack-allocated data */
+    if (stress.in_flight > 0)
+        exit(1);
+
+    return consistent;
+}
 
 int main (int argc, char *argv[0])
 {
@@ -17,13 +227,23 @@ int main (int argc, char *argv[0])
     int mode = -1;
     int speaker = -1;
     int mic = -1;
+    int volume = -1;
+    g_autofree char *output = NULL;
     gboolean status = FALSE;
+    gboolean dump = FALSE;
+    int stress = 0;
 
     const GOptionEntry options [] = {
         {"select-mode", 'm', 0, G_OPTION_ARG_INT, &mode, "Select mode", NULL},
         {"enable-speaker", 's', 0, G_OPTION_ARG_INT, &speaker, "Enable speaker", NULL},
         {"mute-mic", 'u', 0, G_OPTION_ARG_INT, &mic, "Mute microphone", NULL},
+        {"volume", 'v', 0, G_OPTION_ARG_INT, &volume, "Set output volume (percent)", NULL},
+        {"output", 'o', 0, G_OPTION_ARG_STRING, &output,
+         "Select output (earpiece, speaker, headset, bluetooth, usb)", "OUTPUT"},
         {"status", 'S', 0, G_OPTION_ARG_NONE, &status, "Print status", NULL},
+        {"dump", 'd', 0, G_OPTION_ARG_NONE, &dump, "Print recent routing events", NULL},
+        {"stress", 't', 0, G_OPTION_ARG_INT, &stress,
+         "Issue random requests for SECONDS and check the daemon's state", "SECONDS"},
         { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
     };
 
@@ -40,10 +260,17 @@ int main (int argc, char *argv[0])
     }
 
     /* If there's nothing else to be done, print the current status */
-    if (mode == -1 && speaker == -1 && mic == -1)
+    if (stress > 0) {
+        gboolean ok = run_stress(stress);
+
+        call_audio_deinit();
+        return ok ? 0 : 1;
+    }
+
+    if (mode == -1 && speaker == -1 && mic == -1 && volume == -1 && !output && !dump)
         status = TRUE;
 
-    if (mode == CALL_AUDIO_MODE_DEFAULT || mode == CALL_AUDIO_MODE_CALL)
+    if (mode >= CALL_AUDIO_MODE_DEFAULT && mode <= CALL_AUDIO_MODE_VOIP)
         call_audio_select_mode(mode, NULL);
 
     if (speaker == 0 || speaker == 1)
@@ -52,18 +279,77 @@ int main (int argc, char *argv[0])
     if (mic == 0 || mic == 1)
         call_audio_mute_mic((gboolean)mic, NULL);
 
+    if (volume >= 0 && volume <= 100)
+        call_audio_set_volume((guint)volume, NULL);
+
+    if (output)
+        call_audio_select_output(output, NULL);
+
     if (status) {
-        CallAudioMode audio_mode = call_audio_get_audio_mode();
-        CallAudioSpeakerState speaker_state = call_audio_get_speaker_state();
-        CallAudioMicState mic_state = call_audio_get_mic_state();
+        g_autoptr(GVariant) state = call_audio_get_state(NULL);
+        CallAudioMode audio_mode = CALL_AUDIO_MODE_UNKNOWN;
+        CallAudioSpeakerState speaker_state = CALL_AUDIO_SPEAKER_UNKNOWN;
+        CallAudioMicState mic_state = CALL_AUDIO_MIC_UNKNOWN;
+        const char *output_port = NULL;
+        const char *input_port = NULL;
+        g_auto(GStrv) outputs = call_audio_get_available_outputs();
+        guint current_volume;
+
+        if (state) {
+            g_variant_lookup(state, "mode", "u", &audio_mode);
+            g_variant_lookup(state, "speaker", "u", &speaker_state);
+            g_variant_lookup(state, "mic", "u", &mic_state);
+            g_variant_lookup(state, "output-port", "&s", &output_port);
+            g_variant_lookup(state, "input-port", "&s", &input_port);
+            if (!g_variant_lookup(state, "volume", "u", &current_volume))
+                current_volume = call_audio_get_volume();
+        } else {
+            /* Older daemon, fall back to individual properties */
+            audio_mode = call_audio_get_audio_mode();
+            speaker_state = call_audio_get_speaker_state();
+            mic_state = call_audio_get_mic_state();
+            current_volume = call_audio_get_volume();
+        }
+
         const char *string_audio = g_enum_to_string(CALL_TYPE_AUDIO_MODE, audio_mode);
         const char *string_speaker = g_enum_to_string(CALL_TYPE_AUDIO_SPEAKER_STATE, speaker_state);
         const char *string_mic = g_enum_to_string(CALL_TYPE_AUDIO_MIC_STATE, mic_state);
 
         g_print("Selected mode: %s\n"
                 "Speaker enabled: %s\n"
-                "Mic muted: %s\n",
-                string_audio, string_speaker, string_mic);
+                "Mic muted: %s\n"
+                "Volume: %u%%\n",
+                string_audio, string_speaker, string_mic, current_volume);
+        if (output_port && input_port)
+            g_print("Output port: %s\n"
+                    "Input port: %s\n",
+                    output_port, input_port);
+        if (outputs) {
+            g_autofree char *list = g_strjoinv(", ", outputs);
+
+            g_print("Available outputs: %s\n", list);
+        }
+    }
+
+    if (dump) {
+        g_autoptr(GVariant) events = call_audio_dump_events(NULL);
+        GVariantIter iter;
+        gint64 time;
+        const char *name;
+        const char *detail;
+        guint32 id;
+        guint32 value;
+
+        if (events) {
+            g_variant_iter_init(&iter, events);
+            while (g_variant_iter_next(&iter, "(x&suu&s)", &time, &name, &id, &value, &detail)) {
+                g_autoptr(GDateTime) date = g_date_time_new_from_unix_local(time / G_USEC_PER_SEC);
+                g_autofree char *date_str = g_date_time_format(date, "%F %T");
+
+                g_print("%s.%06" G_GINT64_FORMAT " %-12s id=%u value=%u %s\n",
+                        date_str, time % G_USEC_PER_SEC, name, id, value, detail);
+            }
+        }
     }
 
     call_audio_deinit ();